@@ -11,8 +11,9 @@
 #include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "./frame.h"
 
-#define BUFSIZE 1024
+#define BUFSIZE 32768  // room for any command or response line
 
 /*
  * Helper that opens a TCP socket representing the server.
@@ -57,13 +58,77 @@ int get_socket(const char *server, const char *port) {
     return sock;
 }
 
+/*
+ * Sends a script line as a binary request (see frame.h). Lines that are not
+ * well-formed commands are sent anyway, for the server to reject.
+ * Returns the opcode sent, or EOF if the connection is gone.
+ */
+int send_frame(FILE *cxn, const char *line) {
+    frame_header_t h;
+    char name[FRAME_MAX_STRING + 1], value[FRAME_MAX_STRING + 1];
+    int opcode = (unsigned char)line[0];
+
+    name[0] = value[0] = '\0';
+    if (line[0] != '\0') sscanf(&line[1], "%255s %255s", name, value);
+    if (opcode != FRAME_ADD) value[0] = '\0';
+
+    memset(&h, 0, sizeof(h));
+    h.opcode = opcode;
+    h.key_len = htons(strlen(name));
+    h.value_len = htonl(strlen(value));
+
+    if (fwrite(&h, sizeof(h), 1, cxn) != 1 ||
+        fwrite(name, strlen(name) + 1, 1, cxn) != 1 ||
+        fwrite(value, strlen(value) + 1, 1, cxn) != 1) {
+        return EOF;
+    }
+    return opcode;
+}
+
+/*
+ * Reads the binary reply to a request with the given opcode and prints it
+ * the way the server words it in the text protocol.
+ * Returns 0, or -1 if the connection is gone.
+ */
+int print_frame_reply(FILE *rcxn, int opcode) {
+    static const char *const words[][2] = {
+        {"added", "already in database"},
+        {"removed", "not in database"},
+        {"file processed", "bad file name"},
+    };
+    frame_header_t h;
+    char value[FRAME_MAX_STRING + 1];
+    size_t len;
+
+    if (fread(&h, sizeof(h), 1, rcxn) != 1) return -1;
+    if ((len = ntohl(h.value_len)) > FRAME_MAX_STRING ||
+        (len > 0 && fread(value, len, 1, rcxn) != 1)) {
+        return -1;
+    }
+    value[len] = '\0';
+
+    if (h.opcode == FRAME_ILL_FORMED) {
+        printf("ill-formed command\n");
+    } else if (opcode == FRAME_QUERY) {
+        printf("%s\n", h.opcode == FRAME_OK ? value : "not found");
+    } else {
+        int i = opcode == FRAME_ADD ? 0 : opcode == FRAME_DELETE ? 1 : 2;
+        printf("%s\n", words[i][h.opcode != FRAME_OK]);
+    }
+    return 0;
+}
+
 /*
  * Forks off a process that attempts to connect to the server, and then run the
- * script in the file provided.
+ * script in the file provided. Up to window commands are sent ahead before
+ * waiting for a response, so with a window above 1 the server receives
+ * commands in batches instead of one per round trip. If binary is set the
+ * commands are sent as binary requests (see frame.h), and the replies are
+ * printed as the text protocol would have worded them.
  * Returns the pid of the child process.
  */
 pid_t create_occurence(const char *server, const char *port,
-                       const char *script) {
+                       const char *script, int window, int binary) {
     pid_t pid;
 
     // create a process for the client
@@ -85,36 +150,81 @@ pid_t create_occurence(const char *server, const char *port,
             exit(1);
         }
 
-        // Step 4: loop, sending queries and printing responses
-        FILE *cxn = fdopen(sock, "w+");
+        // Step 4: loop, sending queries and printing responses. Separate
+        // streams are used for each direction, since requests and
+        // responses no longer strictly alternate.
+        FILE *cxn = fdopen(sock, "w");
+        FILE *rcxn = fdopen(dup(sock), "r");
         char rbuf[BUFSIZE], qbuf[BUFSIZE];
+        char *opcodes = NULL;  // of the requests in flight, oldest first
+        int in_flight = 0;
+        int oldest = 0;
+        int done = 0;
         rbuf[0] = '\0';
 
+        if (binary) {
+            if ((opcodes = (char *)malloc(window)) == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            fputc(FRAME_MAGIC, cxn);
+        }
+
         while (1) {
+            if (!done && in_flight < window) {
+                if (fgets(qbuf, sizeof(qbuf), infile) == NULL) {
+                    done = 1;
+                } else if (binary) {
+                    int opcode = send_frame(cxn, qbuf);
+                    if (opcode == EOF) {
+                        fprintf(stderr, "No connection!\n");
+                        exit(1);
+                    }
+                    opcodes[(oldest + in_flight++) % window] = opcode;
+                } else {
+                    // otherwise, send the command
+                    if (fputs(qbuf, cxn) == EOF) {
+                        fprintf(stderr, "No connection!\n");
+                        exit(1);
+                    }
+                    in_flight++;
+                }
+                continue;
+            }
+
             // if there are no more commands, so we can clean up and exit
-            if (fgets(qbuf, sizeof(qbuf), infile) == NULL) {
-                qbuf[0] = EOF;
-                fputs(qbuf, cxn);
+            if (in_flight == 0) {
+                if (!binary) {
+                    qbuf[0] = EOF;
+                    fputs(qbuf, cxn);
+                }
                 fflush(cxn);
                 fclose(cxn);
+                fclose(rcxn);
                 fclose(infile);
                 printf("Client terminated cleanly.\n");
                 exit(0);
-            } else {
-                // otherwise, send the command
-                if (fputs(qbuf, cxn) == EOF) {
-                    fprintf(stderr, "No connection!\n");
-                    exit(1);
-                }
-                fflush(cxn);
             }
 
-            // wait for the response and print it
-            if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
-                fprintf(stderr, "Connection terminated.\n");
+            // wait for the oldest response and print it
+            if (fflush(cxn) == EOF) {
+                fprintf(stderr, "No connection!\n");
                 exit(1);
             }
-            printf("%s", rbuf);
+            if (binary) {
+                if (print_frame_reply(rcxn, opcodes[oldest]) < 0) {
+                    fprintf(stderr, "Connection terminated.\n");
+                    exit(1);
+                }
+                oldest = (oldest + 1) % window;
+            } else {
+                if (fgets(rbuf, BUFSIZE, rcxn) == NULL) {
+                    fprintf(stderr, "Connection terminated.\n");
+                    exit(1);
+                }
+                printf("%s", rbuf);
+            }
+            in_flight--;
         }
     }
 
@@ -127,14 +237,16 @@ pid_t create_occurence(const char *server, const char *port,
  */
 void usage_error(const char *cmd) {
     fprintf(stderr,
-            "Usage: %s <servername> <port> "
+            "Usage: %s [-b] [-w window] <servername> <port> "
             "[<script> <occurences>]\n",
             cmd);
 }
 
 /*
  * The arguments to the client should be servername, port number,
- * [script-file, number of occurences].
+ * [script-file, number of occurences], optionally preceded by the number of
+ * commands each occurence may have in flight at once (-w, defaults to 1) and
+ * by -b to use the binary protocol instead of the text one.
  *
  * Step 1: fork to create as many clients as number of occurences argument
  *
@@ -145,26 +257,44 @@ void usage_error(const char *cmd) {
  * Step 4: set up an infinite loop that sends queries from the
  *         script-file to the server and prints responses (if any exist)
  */
-int main(int argc, const char *argv[]) {
+int main(int argc, char *argv[]) {
+    int i, opt, occurences = 1, window = 1, binary = 0;
+
     // parse args
-    if (argc != 3 && argc != 5) {
+    while ((opt = getopt(argc, argv, "bw:")) != -1) {
+        switch (opt) {
+            case 'b':
+                binary = 1;
+                break;
+            case 'w':
+                if ((window = atoi(optarg)) < 1) {
+                    usage_error(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2 && argc - optind != 4) {
         usage_error(argv[0]);
         return 1;
     }
 
-    int i, occurences = 1;
     const char *script = NULL;
-    const char *server = argv[1];
-    const char *port = argv[2];
+    const char *server = argv[optind];
+    const char *port = argv[optind + 1];
 
-    if (argc == 5) {
-        script = argv[3];
-        occurences = atoi(argv[4]);
+    if (argc - optind == 4) {
+        script = argv[optind + 2];
+        occurences = atoi(argv[optind + 3]);
     }
 
     // Step 1: create clients, they'll do the rest
     for (i = 0; i < occurences; i++) {
-        if (create_occurence(server, port, script) == -1) {
+        if (create_occurence(server, port, script, window, binary) == -1) {
             perror("Error forking off process");
             return 1;
         }
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE  // pthread_setaffinity_np
 #include "./comm.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,53 +12,101 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include "./frame.h"
 
 /* Serverside I/O functions */
 
-int lsock;
-
-static void *listener(void (*server)(FILE *));
+static void *listener(void *arg);
 
 static int comm_port;
+static int comm_nlisteners;
+static void (*comm_server)(comm_conn_t *);
 
-pthread_t start_listener(int port, void (*server)(FILE *)) {
-    comm_port = port;
-    pthread_t tid;
+/* Starts nlisteners threads accepting connections on the given port and
+ * passing each one to server. With more than one, every thread has its
+ * own SO_REUSEPORT socket and is pinned to a CPU, so the kernel spreads
+ * incoming connections (and the cost of accepting them) across cores.
+ * Returns the first listener thread. */
+pthread_t start_listener(int port, int nlisteners,
+                         void (*server)(comm_conn_t *)) {
+    pthread_t first = 0, tid;
     int err;
 
-    if ((err = pthread_create(&tid, 0, (void *(*)(void *))listener,
-                              (void *)server)))
-        handle_error_en(err, "pthread_create");
-    if ((err = pthread_detach(tid))) handle_error_en(err, "pthread_detach");
+    comm_port = port;
+    comm_nlisteners = nlisteners;
+    comm_server = server;
+
+    for (intptr_t i = 0; i < nlisteners; i++) {
+        if ((err = pthread_create(&tid, 0, listener, (void *)i)))
+            handle_error_en(err, "pthread_create");
+        if ((err = pthread_detach(tid))) handle_error_en(err, "pthread_detach");
+        if (i == 0) first = tid;
+    }
+
+    return first;
+}
+
+/* Pins the calling thread to the i-th online CPU (modulo their number).
+ * Failing to do so is harmless, so it is only reported. */
+void comm_pin_to_cpu(int i) {
+    cpu_set_t set;
+    int err;
 
-    return tid;
+    CPU_ZERO(&set);
+    CPU_SET(i % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+        errno = err;
+        perror("pthread_setaffinity_np");
+    }
 }
 
-void *listener(void (*server)(FILE *)) {
-    if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+/* Creates a TCP socket listening on the given port on all interfaces. If
+ * reuseport is set, other sockets may listen on the same port, and the
+ * kernel balances new connections between them. Exits the process if that
+ * is not possible. */
+int comm_bind(int port, int reuseport) {
+    int sock;
+    int one = 1;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         exit(1);
     }
 
+    if (reuseport &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt");
+        if (close(sock) < 0) perror("close");
+        exit(1);
+    }
+
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(comm_port);
+    addr.sin_port = htons(port);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("bind");
-        if (close(lsock) < 0) perror("close");
+        if (close(sock) < 0) perror("close");
         exit(1);
     }
 
-    if (listen(lsock, 100) < 0) {
+    if (listen(sock, SOMAXCONN) < 0) {
         perror("listen");
-        if (close(lsock) < 0) perror("close");
+        if (close(sock) < 0) perror("close");
         exit(1);
     }
 
-    fprintf(stderr, "listening on port %d\n", comm_port);
+    fprintf(stderr, "listening on port %d\n", port);
+    return sock;
+}
+
+void *listener(void *arg) {
+    int lsock;
+
+    if (comm_nlisteners > 1) comm_pin_to_cpu((intptr_t)arg);
+    lsock = comm_bind(comm_port, comm_nlisteners > 1);
 
     while (1) {
         int csock;
@@ -71,36 +122,165 @@ void *listener(void (*server)(FILE *)) {
         fprintf(stderr, "received connection from %s#%hu\n",
                 inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
 
-        FILE *cxstr;
-        if (!(cxstr = fdopen(csock, "w+"))) {
-            perror("fdopen");
+        comm_conn_t *cxn;
+        if (!(cxn = (comm_conn_t *)malloc(sizeof(comm_conn_t)))) {
+            perror("malloc");
             if (close(csock) < 0) perror("close");
             continue;
         }
+        cxn->fd = csock;
+        cxn->mode = COMM_UNKNOWN;
+        cxn->pending = 0;
+        cxn->rstart = cxn->rlen = 0;
+        cxn->eof = 0;
+        cxn->wlen = 0;
 
-        server(cxstr);
+        comm_server(cxn);
     }
 
     return NULL;
 }
 
-void comm_shutdown(FILE *cxstr) {
-    if (fclose(cxstr) < 0) perror("fclose");
+void comm_shutdown(comm_conn_t *cxn) {
+    if (close(cxn->fd) < 0) perror("close");
+    free(cxn);
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
-    if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
-            fprintf(stderr, "client connection terminated\n");
+/* Returns the length (including the newline) of the first command in
+ * buf[0..len), or 0 if it is not complete yet. Commands are cut the way
+ * fgets(command, BUFLEN, ...) would cut them: a line longer than
+ * BUFLEN - 1 bytes is taken in pieces, and if eof is set a final line
+ * without a newline counts too. */
+size_t comm_line_length(const char *buf, size_t len, int eof) {
+    size_t max = len < BUFLEN - 1 ? len : BUFLEN - 1;
+    const char *nl = memchr(buf, '\n', max);
+
+    if (nl != NULL) return nl - buf + 1;
+    if (max == BUFLEN - 1 || eof) return max;
+    return 0;
+}
+
+/* Returns the length of the first request frame (see frame.h) in
+ * buf[0..len), 0 if it has not fully arrived yet, or -1 if its header is
+ * invalid. */
+ssize_t comm_frame_length(const char *buf, size_t len) {
+    frame_header_t h;
+    size_t key_len, value_len, total;
+
+    if (len < sizeof(h)) return 0;
+
+    memcpy(&h, buf, sizeof(h));
+    key_len = ntohs(h.key_len);
+    value_len = ntohl(h.value_len);
+    if (key_len > FRAME_MAX_STRING || value_len > FRAME_MAX_STRING) return -1;
+
+    total = sizeof(h) + key_len + 1 + value_len + 1;
+    return len < total ? 0 : total;
+}
+
+/* Sends every queued reply. Returns 0, or -1 if the connection is broken. */
+static int comm_flush(comm_conn_t *cxn) {
+    size_t off = 0;
+
+    while (off < cxn->wlen) {
+        ssize_t n = send(cxn->fd, cxn->wbuf + off, cxn->wlen - off,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
             return -1;
         }
+        off += n;
     }
+    cxn->wlen = 0;
+    return 0;
+}
 
-    if (fgets(command, BUFLEN, cxstr) == NULL) {
+/* Queues the reply to the previous request, reply_len bytes that the caller
+ * wrote to where *reply pointed (a text reply without its newline, 0 for
+ * none), and returns the next request: COMM_TEXT with *request pointing to
+ * the next command line, NUL-terminated, or COMM_FRAME with it pointing to
+ * the next binary request. Either stays in the connection's buffer until
+ * the following call, and *reply then points to where its reply goes,
+ * with room for RESPLEN bytes. Returns -1 once the connection is closed or
+ * broken.
+ *
+ * Replies are only sent when the next request has not arrived yet (or
+ * there is no room for another), so a client that sends several at once
+ * (see client -w) gets all the answers back in a single send, in order. */
+int comm_serve(comm_conn_t *cxn, int reply_len, char **request,
+               char **reply) {
+    if (cxn->pending) {
+        if (cxn->mode == COMM_TEXT) {
+            cxn->rbuf[cxn->rstart] = cxn->saved;
+            if (reply_len > 0) cxn->wbuf[cxn->wlen + reply_len++] = '\n';
+        }
+        cxn->wlen += reply_len;
+        cxn->pending = 0;
+    }
+    if (WBUFLEN - cxn->wlen < RESPLEN && comm_flush(cxn) < 0) {
         fprintf(stderr, "client connection terminated\n");
         return -1;
     }
 
-    return 0;
+    while (1) {
+        char *buf = cxn->rbuf + cxn->rstart;
+        size_t avail = cxn->rlen - cxn->rstart;
+        ssize_t len;
+
+        if (cxn->mode == COMM_UNKNOWN && avail > 0) {
+            if ((unsigned char)buf[0] == FRAME_MAGIC) {
+                cxn->mode = COMM_FRAME;
+                cxn->rstart++;
+                continue;
+            }
+            cxn->mode = COMM_TEXT;
+        }
+
+        if (cxn->mode == COMM_FRAME) {
+            if ((len = comm_frame_length(buf, avail)) < 0) {
+                fprintf(stderr, "client sent a bad frame\n");
+                return -1;
+            }
+            if (len > 0) {
+                *request = buf;
+                *reply = cxn->wbuf + cxn->wlen;
+                cxn->rstart += len;
+                cxn->pending = 1;
+                return COMM_FRAME;
+            }
+        } else if (cxn->mode == COMM_TEXT &&
+                   (len = comm_line_length(buf, avail, cxn->eof)) > 0) {
+            // terminate the line where it lies; the byte after it is put
+            // back once the command has been answered
+            cxn->saved = buf[len];
+            buf[len] = '\0';
+            *request = buf;
+            *reply = cxn->wbuf + cxn->wlen;
+            **reply = '\0';  // no reply unless the command writes one
+            cxn->rstart += len;
+            cxn->pending = 1;
+            return COMM_TEXT;
+        }
+
+        // nothing complete is buffered, so send the replies and wait (or,
+        // once the client is done sending, close)
+        if (comm_flush(cxn) < 0 || cxn->eof) {
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+
+        memmove(cxn->rbuf, buf, avail);
+        cxn->rlen = avail;
+        cxn->rstart = 0;
+
+        if ((len = read(cxn->fd, cxn->rbuf + cxn->rlen,
+                        RBUFLEN - cxn->rlen)) > 0) {
+            cxn->rlen += len;
+        } else if (len == 0) {
+            cxn->eof = 1;
+        } else if (errno != EINTR) {
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+    }
 }
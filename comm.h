@@ -5,7 +5,11 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <ctype.h>
-#define BUFLEN 256
+#include <sys/types.h>
+#include "./db.h"
+#define BUFLEN MAXCMD    // longest command
+#define RESPLEN MAXRESP  // longest response
+#define RBUFLEN 16384  // bytes of unprocessed input a connection can hold
 #define handle_error_en(en, msg) \
     do {                         \
         errno = en;              \
@@ -13,8 +17,41 @@
         exit(EXIT_FAILURE);      \
     } while (0)
 
-pthread_t start_listener(int port, void (*server_func)(FILE *));
-extern void comm_shutdown(FILE *cxstr);
-extern int comm_serve(FILE *cxstr, char *resp, char *cmd);
+// Protocol of a connection, decided by its first byte (see frame.h)
+#define COMM_TEXT 0
+#define COMM_FRAME 1
+#define COMM_UNKNOWN 2  // nothing received yet
+
+#define WBUFLEN (4 * RESPLEN)  // bytes of replies a connection can hold
+
+/*
+ * A client connection served by a thread of its own, straight on the
+ * socket. Commands are read into rbuf and handed out where they lie, so
+ * that comm_serve can tell whether the client has already sent more of
+ * them; replies are written by the caller straight into wbuf, and only
+ * sent once nothing more is buffered or wbuf has no room for another.
+ */
+typedef struct comm_conn {
+    int fd;
+    int mode;
+    int pending;  // a request was handed out and not answered yet
+    char saved;   // the byte the terminator of a text command replaced
+    char rbuf[RBUFLEN + 1];  // + a terminator after a command that fills it
+    size_t rstart;  // first byte of rbuf not yet handed out as a command
+    size_t rlen;
+    int eof;
+    char wbuf[WBUFLEN];
+    size_t wlen;
+} comm_conn_t;
+
+extern int comm_bind(int port, int reuseport);
+extern void comm_pin_to_cpu(int i);
+extern size_t comm_line_length(const char *buf, size_t len, int eof);
+extern ssize_t comm_frame_length(const char *buf, size_t len);
+pthread_t start_listener(int port, int nlisteners,
+                         void (*server_func)(comm_conn_t *));
+extern void comm_shutdown(comm_conn_t *cxn);
+extern int comm_serve(comm_conn_t *cxn, int reply_len, char **request,
+                      char **reply);
 
 #endif  // COMM_H_
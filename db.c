@@ -1,248 +1,488 @@
 #include "./db.h"
+#include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "./db_engine.h"
+#include "./db_load.h"
+#include "./epoch.h"
+#include "./frame.h"
+#include "./snapshot.h"
+#include "./stats.h"
+#include "./wal.h"
+
+// The storage engines the server can be started with; the first one is the
+// default.
+static const db_engine_t *engines[] = {&tree_engine, &hash_engine};
+
+static const db_engine_t *engine;
+static void *store;
+
+db_logger_t db_logger;
+
+// set in the promoter, whose changes are not for the log (see promote)
+static __thread int quiet;
+
+static int run_file(const char *name, char *response, int len);
+
+/*
+ * Starting from a snapshot (see snapshot.h). db_restore maps the file, and
+ * the database answers from it straight away while a background thread
+ * promotes its pairs into the engine, a batch at a time. Until then a name
+ * lives either in the snapshot or in the engine, never both; state[i] says
+ * where the snapshot's i-th pair is:
+ */
+#define LIVE 0       // only in the snapshot
+#define PROMOTING 1  // being copied into the engine, still read from the
+                     // snapshot
+#define PROMOTED 2   // in the engine, which owns it from now on
+#define DELETED 3    // removed while it was only in the snapshot
+
+#define PROMOTE_BATCH 1024
+
+/* A name is only added to the engine while the snapshot holds no live pair
+ * for it. Once every pair has been promoted or deleted the snapshot is
+ * dropped; whatever looks at it does so inside an epoch critical section,
+ * which keeps the mapping until then. */
+typedef struct base {
+    snapshot_t *snap;
+    unsigned char *state;
+    long live;  // pairs LIVE or PROMOTING (updated atomically)
+} base_t;
+
+static base_t *base;
+static pthread_t promoter;
+static int promoting;       // whether the promoter was started
+static int stop_promoting;  // set to have it give up
+// held by the promoter for each batch, and by print_all to keep pairs from
+// moving while it goes over both
+static pthread_rwlock_t promote_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void base_destroy(void *arg) {
+    base_t *b = arg;
+
+    snapshot_close(b->snap);
+    free(b->state);
+    free(b);
+}
 
+/* Returns the state of the snapshot's pair for name, or DELETED if it has
+ * none. Called inside an epoch critical section, with base set. */
+static int base_state(base_t *b, const char *name, long *index) {
+    if ((*index = snapshot_find(b->snap, name)) < 0) return DELETED;
+    return __atomic_load_n(&b->state[*index], __ATOMIC_ACQUIRE);
+}
 
-// The root node of the binary tree, unlike all
-// other nodes in the tree, this one is never
-// freed (it's allocated in the data region).
-node_t head = {"", "", 0, 0};
+/* Copies the name_len bytes at name into key (MAXLEN + 1 bytes) with a
+ * terminator, as the snapshot looks names up by; returns 0 if they do not
+ * fit, in which case the snapshot cannot hold the name. */
+static int base_key(const char *name, int name_len, char *key) {
+    if (name_len > MAXLEN) return 0;
+    memcpy(key, name, name_len);
+    key[name_len] = '\0';
+    return 1;
+}
 
+/* Looks name up in the snapshot, for when the engine does not have it. */
+static int base_query(const char *name, int name_len, char *result, int len) {
+    char key[MAXLEN + 1];
+    base_t *b;
+    long i;
+    int found = 0;
+
+    if (rcu_dereference(base) == 0 || !base_key(name, name_len, key)) return 0;
+
+    epoch_enter();
+    if ((b = rcu_dereference(base)) != 0) {
+        switch (base_state(b, key, &i)) {
+            case LIVE:
+            case PROMOTING:
+                snprintf(result, len, "%s", snapshot_value(b->snap, i));
+                found = 1;
+                break;
+            case PROMOTED:  // after the engine was asked
+                found = engine->query(store, name, name_len, result, len);
+                break;
+        }
+    }
+    epoch_exit();
+    return found;
+}
 
-pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Returns whether the snapshot still holds name, which then cannot be
+ * added. */
+static int base_holds(const char *name, int name_len) {
+    char key[MAXLEN + 1];
+    base_t *b;
+    long i;
+    int held = 0;
 
-node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left,
-                         node_t *arg_right) {
-    size_t name_len = strlen(arg_name);
-    size_t val_len = strlen(arg_value);
+    if (rcu_dereference(base) == 0 || !base_key(name, name_len, key)) return 0;
 
-    if (name_len > MAXLEN || val_len > MAXLEN) return 0;
+    epoch_enter();
+    if ((b = rcu_dereference(base)) != 0) {
+        held = base_state(b, key, &i) <= PROMOTING;
+    }
+    epoch_exit();
+    return held;
+}
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
+/* Removes name from the snapshot, if that is where it lives. Returns 1 if
+ * it did, or 0 if name is for the engine to remove. */
+static int base_remove(const char *name, int name_len) {
+    char key[MAXLEN + 1];
+    base_t *b;
+    long i;
+    int removed = 0;
 
-    if (new_node == 0) return 0;
+    if (rcu_dereference(base) == 0 || !base_key(name, name_len, key)) return 0;
 
-    if ((new_node->name = (char *)malloc(name_len + 1)) == 0) {
-        free(new_node);
-        return 0;
-    }
+    epoch_enter();
+    if ((b = rcu_dereference(base)) != 0) {
+        for (;;) {
+            unsigned char state = base_state(b, key, &i);
 
-    if ((new_node->value = (char *)malloc(val_len + 1)) == 0) {
-        free(new_node->name);
-        free(new_node);
-        return 0;
+            if (state == PROMOTING) {
+                sched_yield();  // it's in the engine in a moment
+                continue;
+            }
+            if (state != LIVE) break;
+
+            // logged first, so that it precedes the record of any add of
+            // name that follows; should we lose the race, it is a harmless
+            // extra "d" for a name that is still there or already gone
+            db_log(LOAD_DELETE, key, 0);
+            if (__atomic_compare_exchange_n(&b->state[i], &state, DELETED, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_fetch_sub(&b->live, 1, __ATOMIC_RELAXED);
+                removed = 1;
+                break;
+            }
+        }
     }
+    epoch_exit();
+    return removed;
+}
 
-    if ((snprintf(new_node->name, MAXLEN, "%s", arg_name)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
-    } else if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
-    }
+static int db_query(const char *name, int name_len, char *result, int len) {
+    return engine->query(store, name, name_len, result, len) ||
+           base_query(name, name_len, result, len);
+}
 
-    new_node->lchild = arg_left;
-    new_node->rchild = arg_right;
-    return new_node;
+static int db_add(const char *name, int name_len, const char *value,
+                  int value_len) {
+    return !base_holds(name, name_len) &&
+           engine->add(store, name, name_len, value, value_len);
 }
 
-void node_destructor(node_t *node) {
-    if (node->name != 0) free(node->name);
-    if (node->value != 0) free(node->value);
-    free(node);
+static int db_remove(const char *name, int name_len) {
+    return base_remove(name, name_len) ||
+           engine->remove(store, name, name_len);
 }
 
-node_t *search(char *, node_t *, node_t **);
+/* Scans as the engine's scan does (names[i] and values[i] must hold
+ * MAXLEN bytes, and n is at most MAXBATCH + 1), merging in the pairs that
+ * are still only in the snapshot being promoted. */
+static int db_scan(char *from, char *to, int n, char **names, char **values) {
+    char *found;  // the engine's pairs, n names then n values
+    char *found_names[MAXBATCH + 1], *found_values[MAXBATCH + 1];
+    long live[MAXBATCH + 1];
+    int nlive = 0, m, i = 0, j = 0, k = 0;
+    base_t *b;
+
+    if (rcu_dereference(base) == 0)
+        return engine->scan(store, from, to, n, names, values, MAXLEN);
+    if ((found = (char *)malloc((size_t)n * 2 * MAXLEN)) == 0) return 0;
+
+    epoch_enter();
+
+    // the snapshot first: a pair promoted after this is in the engine by
+    // the time the engine is scanned
+    if ((b = rcu_dereference(base)) != 0) {
+        for (long x = snapshot_lower_bound(b->snap, from);
+             x < b->snap->count && nlive < n &&
+             (to == 0 || strcmp(snapshot_name(b->snap, x), to) < 0);
+             x++) {
+            if (__atomic_load_n(&b->state[x], __ATOMIC_ACQUIRE) <= PROMOTING)
+                live[nlive++] = x;
+        }
+    }
 
-void db_query(char *name, char *result, int len) {
-    // TODO: Make this thread-safe!
-	pthread_mutex_lock (&db_mutex);
+    for (int x = 0; x < n; x++) {
+        found_names[x] = &found[(size_t)x * MAXLEN];
+        found_values[x] = &found[(size_t)(n + x) * MAXLEN];
+    }
+    m = engine->scan(store, from, to, n, found_names, found_values, MAXLEN);
+
+    while (k < n && (i < nlive || j < m)) {
+        int cmp = i == nlive ? 1
+                  : j == m   ? -1
+                             : strcmp(snapshot_name(b->snap, live[i]),
+                                      found_names[j]);
+
+        if (cmp < 0) {
+            snprintf(names[k], MAXLEN, "%s", snapshot_name(b->snap, live[i]));
+            snprintf(values[k++], MAXLEN, "%s",
+                     snapshot_value(b->snap, live[i]));
+            i++;
+        } else {
+            // a pair being promoted can be in both
+            if (cmp == 0) i++;
+            snprintf(names[k], MAXLEN, "%s", found_names[j]);
+            snprintf(values[k++], MAXLEN, "%s", found_values[j++]);
+        }
+    }
 
-    node_t *target;
-    target = search(name, &head, 0);
+    epoch_exit();
+    free(found);
+    return k;
+}
 
-    if (target == 0) {
-        snprintf(result, len, "not found");
-		pthread_mutex_unlock (&db_mutex);
-        return;
-    } else {
-        snprintf(result, len, "%s", target->value);
-		pthread_mutex_unlock (&db_mutex);
-        return;
+/* Applies a bulk load (see load_file), taking the names the snapshot holds
+ * out of it first. */
+static void apply_changes(int n, char **names, char **values, int *ops) {
+    int m = 0;
+
+    if (rcu_dereference(base) != 0) {
+        for (int i = 0; i < n; i++) {
+            int name_len = strlen(names[i]);
+
+            if (ops[i] == LOAD_ADD) {
+                // the snapshot's pair stands
+                if (base_holds(names[i], name_len)) continue;
+            } else if (base_remove(names[i], name_len)) {
+                // removed from the snapshot; a put still adds the value
+                if (ops[i] == LOAD_DELETE) continue;
+            }
+            names[m] = names[i];
+            values[m] = values[i];
+            ops[m++] = ops[i];
+        }
+        n = m;
     }
-	pthread_mutex_unlock (&db_mutex);
+    engine->load(store, n, names, values, ops);
 }
 
-int db_add(char *name, char *value) {
-    // TODO: Make this thread-safe!
-    node_t *parent;
-    node_t *target;
-    node_t *newnode;
-
-	printf("db_added: %s, %s", name, value);
-	pthread_mutex_lock (&db_mutex);
-
-    if ((target = search(name, &head, &parent)) != 0) {
-		pthread_mutex_unlock (&db_mutex);
-        return (0);
+/* The promoter: copies the snapshot's live pairs into the engine, a batch
+ * per lock acquisition, then drops the snapshot. */
+static void *promote(void *arg) {
+    base_t *b = arg;
+    char *names[PROMOTE_BATCH], *values[PROMOTE_BATCH];
+    int ops[PROMOTE_BATCH];
+    long index[PROMOTE_BATCH];
+
+    // the pairs are already in the snapshot, which the log only ever goes
+    // with (see wal.h)
+    quiet = 1;
+
+    for (long i = 0; i < b->snap->count &&
+                     !__atomic_load_n(&stop_promoting, __ATOMIC_RELAXED);) {
+        int n = 0;
+
+        pthread_rwlock_wrlock(&promote_lock);
+        for (; i < b->snap->count && n < PROMOTE_BATCH; i++) {
+            unsigned char state = LIVE;
+
+            if (__atomic_compare_exchange_n(&b->state[i], &state, PROMOTING,
+                                            0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED)) {
+                names[n] = (char *)snapshot_name(b->snap, i);
+                values[n] = (char *)snapshot_value(b->snap, i);
+                ops[n] = LOAD_ADD;
+                index[n++] = i;
+            }
+        }
+        if (n > 0) {
+            engine->load(store, n, names, values, ops);
+            for (int j = 0; j < n; j++) {
+                __atomic_store_n(&b->state[index[j]], PROMOTED,
+                                 __ATOMIC_RELEASE);
+            }
+            __atomic_fetch_sub(&b->live, n, __ATOMIC_RELAXED);
+        }
+        pthread_rwlock_unlock(&promote_lock);
+        sched_yield();  // let clients in between batches
     }
 
-    newnode = node_constructor(name, value, 0, 0);
-
-    if (strcmp(name, parent->name) < 0)
-        parent->lchild = newnode;
-    else
-        parent->rchild = newnode;
-
-	pthread_mutex_unlock (&db_mutex);
-
-    return (1);
+    if (!__atomic_load_n(&stop_promoting, __ATOMIC_RELAXED)) {
+        rcu_assign_pointer(base, 0);
+        epoch_retire(b, base_destroy);
+    }
+    return 0;
 }
 
-int db_remove(char *name) {
-    // TODO: Make this thread-safe!
-    node_t *parent;
-    node_t *dnode;
-    node_t *next;
-
-	pthread_mutex_lock (&db_mutex);
-
-    // first, find the node to be removed
-    if ((dnode = search(name, &head, &parent)) == 0) {
-        // it's not there
-		pthread_mutex_unlock (&db_mutex);
-        return (0);
+/* Starts the database from the snapshot at path: it is served from where it
+ * lies at once, and promoted into the engine in the background. Must be
+ * called after db_init, on an empty database, and before db_journal.
+ *
+ * Returns 0 on success, or -1 (with errno set) if the snapshot could not be
+ * opened. */
+int db_restore(const char *path) {
+    base_t *b;
+    int err;
+
+    if ((b = (base_t *)calloc(1, sizeof(base_t))) == 0) return -1;
+    if ((b->snap = snapshot_open(path)) == 0 ||
+        (b->state = (unsigned char *)calloc(b->snap->count + 1, 1)) == 0) {
+        err = errno;
+        if (b->snap) snapshot_close(b->snap);
+        free(b);
+        errno = err;
+        return -1;
     }
+    b->live = b->snap->count;
 
-    // We found it, if the node has no right child, then we can merely replace
-    // its parent's pointer to it with the node's left child.
-
-    if (dnode->rchild == 0) {
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->lchild;
-        else
-            parent->rchild = dnode->lchild;
+    rcu_assign_pointer(base, b);
+    if ((err = pthread_create(&promoter, 0, promote, b)) != 0) {
+        base = 0;
+        base_destroy(b);
+        errno = err;
+        return -1;
+    }
+    promoting = 1;
+    return 0;
+}
 
-        // done with dnode
-        node_destructor(dnode);
-    } else if (dnode->lchild == 0) {
-        // ditto if the node had no left child
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->rchild;
-        else
-            parent->rchild = dnode->rchild;
+static void log_change(int op, const char *name, const char *value) {
+    if (!quiet) wal_append(op, name, value);
+}
 
-        // done with dnode
-        node_destructor(dnode);
-    } else {
-        // Find the lexicographically smallest node in the right subtree and
-        // replace the node to be deleted with that node. This new node thus is
-        // lexicographically smaller than all nodes in its right subtree, and
-        // greater than all nodes in its left subtree
-
-        next = dnode->rchild;
-        node_t **pnext = &dnode->rchild;
-
-        while (next->lchild != 0) {
-            // work our way down the lchild chain, finding the smallest node
-            // in the subtree.
-            node_t *nextl = next->lchild;
-            pnext = &next->lchild;
-            next = nextl;
+/* Selects the storage engine with the given name (or the default one if
+ * name is NULL) and creates an empty database with it, split into the given
+ * number of shards if that is more than 1. Must be called before any other
+ * db_ function.
+ *
+ * Returns 0 on success, or -1 if there is no such engine or the database
+ * could not be created. */
+int db_init(const char *name, int shards) {
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (name == NULL || strcmp(name, engines[i]->name) == 0) {
+            if (shards > 1) {
+                engine = &shard_engine;
+                store = shard_create(engines[i], shards);
+            } else {
+                engine = engines[i];
+                store = engine->create();
+            }
+            return store ? 0 : -1;
         }
-
-        dnode->name = realloc(dnode->name, strlen(next->name) + 1);
-        dnode->value = realloc(dnode->value, strlen(next->value) + 1);
-
-        snprintf(dnode->name, MAXLEN, "%s", next->name);
-        snprintf(dnode->value, MAXLEN, "%s", next->value);
-        *pnext = next->rchild;
-
-        node_destructor(next);
     }
-
-	pthread_mutex_unlock (&db_mutex);
-    return (1);
+    return -1;
 }
 
-node_t *search(char *name, node_t *parent, node_t **parentpp) {
-    // Search the tree, starting at parent, for a node containing
-    // name (the "target node").  Return a pointer to the node,
-    // if found, otherwise return 0.  If parentpp is not 0, then it points
-    // to a location at which the address of the parent of the target node
-    // is stored.  If the target node is not found, the location pointed to
-    // by parentpp is set to what would be the the address of the parent of
-    // the target node, if it were there.
-    //
-    // TODO: Make this thread-safe!
+/* Makes the database durable: replays the write-ahead log at path (see
+ * wal.h), creating it if need be, and logs every change to it from then on,
+ * syncing at most window_us microseconds after the change is made. The log
+ * goes with the snapshot the database was restored from, if any, and is
+ * rotated at each checkpoint. Must be called after db_init (and db_restore)
+ * and before any command is interpreted.
+ *
+ * Returns 0 on success, or -1 (with errno set) if the log could not be
+ * recovered or opened. */
+int db_journal(const char *path, long window_us) {
+    char response[MAXRESP], old[4096];
+
+    if (snprintf(old, sizeof(old), "%s" WAL_OLD_SUFFIX, path) >=
+        (int)sizeof(old)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    // a checkpoint that did not finish leaves the log from before it
+    if (access(old, F_OK) == 0 &&
+        (wal_recover(old) < 0 || run_file(old, response, MAXRESP) < 0))
+        return -1;
+    if (wal_recover(path) < 0 || run_file(path, response, MAXRESP) < 0 ||
+        wal_start(path, window_us) < 0)
+        return -1;
+    db_logger = log_change;
+    return 0;
+}
 
-    node_t *next;
-    node_t *result;
+static int checkpointing;  // set while a checkpoint is being written
 
-	pthread_mutex_lock (&db_mutex);
+static void *checkpoint(void *arg) {
+    char *path = arg;
+    db_view_t view;
 
-    if (strcmp(name, parent->name) < 0) {
-        next = parent->lchild;
-    } else {
-        next = parent->rchild;
+    // snapshots are taken of the engine, so the one being promoted has to
+    // be in it first
+    while (rcu_dereference(base) != 0) {
+        usleep(10000);
     }
 
-    if (next == NULL) {
-        result = NULL;
+    // the new log starts before the view, so that it misses nothing the
+    // snapshot does
+    if (wal_rotate() < 0) perror("checkpoint: rotating the log");
+
+    if (engine->view(store, &view) < 0) {
+        fprintf(stderr, "checkpoint: out of memory\n");
     } else {
-        if (strcmp(name, next->name) == 0) {
-            result = next;
+        if (snapshot_write(path, view.n, view.names, view.values) < 0) {
+            perror(path);
         } else {
-			pthread_mutex_unlock (&db_mutex);
-            return search(name, next, parentpp);
+            fprintf(stderr, "checkpoint: %d entries written to %s\n", view.n,
+                    path);
+            wal_drop_old();
         }
+        engine->release(store, &view);
     }
 
-    if (parentpp != NULL) {
-        *parentpp = parent;
-    }
-
-	pthread_mutex_unlock (&db_mutex);
-    return result;
+    free(path);
+    __atomic_store_n(&checkpointing, 0, __ATOMIC_RELEASE);
+    return 0;
 }
 
-static inline void print_spaces(int lvl, FILE *out) {
-    for (int i = 0; i < lvl; i++) {
-        fprintf(out, " ");
+/* Starts writing a snapshot of the database (see snapshot.h) to path in the
+ * background. The snapshot holds the database as it is when the writing
+ * starts; clients are held off only while the engine takes its view. The
+ * write-ahead log, if any, is rotated with it: from then on it goes with
+ * this snapshot (see wal.h).
+ *
+ * Returns 0 if the checkpoint was started, or -1 if one is already running
+ * or it could not be started. */
+int db_checkpoint(const char *path) {
+    pthread_t writer;
+    char *copy;
+
+    if (__atomic_exchange_n(&checkpointing, 1, __ATOMIC_ACQ_REL)) return -1;
+
+    if ((copy = strdup(path)) == 0 ||
+        pthread_create(&writer, 0, checkpoint, copy) != 0) {
+        free(copy);
+        __atomic_store_n(&checkpointing, 0, __ATOMIC_RELEASE);
+        return -1;
     }
+    pthread_detach(writer);
+    return 0;
 }
 
-/* Recursively traverses the database tree and prints nodes
- * pre-order. */
-void db_print_recurs(node_t *node, int lvl, FILE *out) {
-    // print spaces to differentiate levels
-    print_spaces(lvl, out);
+/* Prints the engine's pairs in its format, then, one per line, those still
+ * only in the snapshot being promoted. */
+static void print_all(FILE *out) {
+    base_t *b;
 
-    // print out the current node
-    if (node == NULL) {
-        fprintf(out, "(null)\n");
-        return;
-    }
+    pthread_rwlock_rdlock(&promote_lock);
+    engine->print(store, out);
 
-    if (node == &head) {
-        fprintf(out, "(root)\n");
-    } else {
-        fprintf(out, "%s %s\n", node->name, node->value);
+    epoch_enter();
+    if ((b = rcu_dereference(base)) != 0) {
+        for (long i = 0; i < b->snap->count; i++) {
+            if (__atomic_load_n(&b->state[i], __ATOMIC_ACQUIRE) <= PROMOTING)
+                fprintf(out, "%s %s\n", snapshot_name(b->snap, i),
+                        snapshot_value(b->snap, i));
+        }
     }
-
-    db_print_recurs(node->lchild, lvl + 1, out);
-    db_print_recurs(node->rchild, lvl + 1, out);
+    epoch_exit();
+    pthread_rwlock_unlock(&promote_lock);
 }
 
-/* Prints the whole database, using db_print_recurs, to a file with
+/* Prints the whole database, in the engine's format, to a file with
  * the given filename, or to stdout if the filename is empty or NULL.
  * If the file does not exist, it is created. The file is truncated
  * in all cases.
@@ -252,7 +492,7 @@ void db_print_recurs(node_t *node, int lvl, FILE *out) {
 int db_print(char *filename) {
     FILE *out;
     if (filename == NULL) {
-        db_print_recurs(&head, 0, stdout);
+        print_all(stdout);
         return 0;
     }
 
@@ -262,12 +502,7 @@ int db_print(char *filename) {
     }
 
     if (*filename == '\0') {
-		pthread_mutex_lock (&db_mutex);
-
-        db_print_recurs(&head, 0, stdout);
-		
-		pthread_mutex_unlock (&db_mutex);
-
+        print_all(stdout);
         return 0;
     }
 
@@ -275,45 +510,326 @@ int db_print(char *filename) {
         return -1;
     }
 
-	pthread_mutex_lock (&db_mutex);
-    db_print_recurs(&head, 0, out);
-	pthread_mutex_unlock (&db_mutex);
-    
-	fclose(out);
+    print_all(out);
+    fclose(out);
 
     return 0;
 }
 
-/* Recursively destroys node and all its children. */
-void db_cleanup_recurs(node_t *node) {
-    if (node == NULL) {
+/* Returns the length of the longest lookup path in the database. */
+int db_height(void) {
+    return engine->height(store);
+}
+
+/* Returns the number of entries in the database. */
+int db_count(void) {
+    base_t *b;
+    int count;
+
+    epoch_enter();
+    b = rcu_dereference(base);
+    count = engine->count(store) +
+            (b ? __atomic_load_n(&b->live, __ATOMIC_RELAXED) : 0);
+    epoch_exit();
+    return count;
+}
+
+/* Destroys all entries in the database.
+ * No threads should be using the database when this is called. */
+void db_cleanup() {
+    if (promoting) {
+        __atomic_store_n(&stop_promoting, 1, __ATOMIC_RELAXED);
+        pthread_join(promoter, 0);
+        promoting = 0;
+    }
+    if (base != 0) {
+        base_destroy(base);
+        base = 0;
+    }
+    engine->clear(store);
+}
+
+/* Appends a per-name result to a batch response; results are separated by
+ * tabs, since neither names nor values can contain whitespace. */
+static void append_result(char *response, int len, int *used, int first,
+                          const char *result) {
+    if (*used < len) {
+        *used += snprintf(response + *used, len - *used, "%s%s",
+                          first ? "" : "\t", result);
+    }
+}
+
+/* Adds a batch, leaving out the names the snapshot holds. */
+static void batch_add(int n, char **names, char **values, int *added) {
+    char *rest_names[MAXBATCH], *rest_values[MAXBATCH];
+    int rest[MAXBATCH], rest_added[MAXBATCH];
+    int m = 0;
+
+    if (rcu_dereference(base) == 0) {
+        engine->add_many(store, n, names, values, added);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        added[i] = 0;
+        if (!base_holds(names[i], strlen(names[i]))) {
+            rest_names[m] = names[i];
+            rest_values[m] = values[i];
+            rest[m++] = i;
+        }
+    }
+    if (m > 0) engine->add_many(store, m, rest_names, rest_values, rest_added);
+    for (int j = 0; j < m; j++) {
+        added[rest[j]] = rest_added[j];
+    }
+}
+
+/* Removes a batch, taking the names that live in the snapshot out of it. */
+static void batch_remove(int n, char **names, int *removed) {
+    char *rest_names[MAXBATCH];
+    int rest[MAXBATCH], rest_removed[MAXBATCH];
+    int m = 0;
+
+    if (rcu_dereference(base) == 0) {
+        engine->remove_many(store, n, names, removed);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!(removed[i] = base_remove(names[i], strlen(names[i])))) {
+            rest_names[m] = names[i];
+            rest[m++] = i;
+        }
+    }
+    if (m > 0) engine->remove_many(store, m, rest_names, rest_removed);
+    for (int j = 0; j < m; j++) {
+        removed[rest[j]] = rest_removed[j];
+    }
+}
+
+/* Interprets a batch command: "mq name...", "ma name value ..." or
+ * "md name...", with at most MAXBATCH names. The whole batch goes to the
+ * storage engine at once, and the response holds one result per name, in
+ * order, worded as for the single-name command. */
+static void interpret_batch(char *command, char *response, int len) {
+    char line[MAXCMD];
+    char values[MAXBATCH][MAXLEN];
+    char *names[MAXBATCH];
+    char *args[MAXBATCH];  // values to add, or where query results go
+    int results[MAXBATCH];
+    char *tok, *save;
+    int ntok = 0, n, used = 0;
+    char verb = command[1];
+
+    if ((verb != 'q' && verb != 'a' && verb != 'd') ||
+        strlen(command) >= sizeof(line)) {
+        snprintf(response, len, "ill-formed command");
         return;
     }
 
-    db_cleanup_recurs(node->lchild);
-    db_cleanup_recurs(node->rchild);
+    // split a copy of the arguments into names (and values)
+    strcpy(line, &command[2]);
+    for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+         tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (ntok == MAXBATCH * (verb == 'a' ? 2 : 1) || strlen(tok) >= MAXLEN) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (verb == 'a' && ntok % 2) {
+            args[ntok / 2] = tok;
+        } else {
+            names[verb == 'a' ? ntok / 2 : ntok] = tok;
+        }
+        ntok++;
+    }
 
-    node_destructor(node);
+    if (ntok == 0 || (verb == 'a' && ntok % 2)) {
+        snprintf(response, len, "ill-formed command");
+        return;
+    }
+    n = verb == 'a' ? ntok / 2 : ntok;
+
+    response[0] = '\0';
+    switch (verb) {
+        case 'q':
+            for (int i = 0; i < n; i++) args[i] = values[i];
+            engine->query_many(store, n, names, args, MAXLEN, results);
+            for (int i = 0; i < n; i++) {
+                if (!results[i])
+                    results[i] = base_query(names[i], strlen(names[i]),
+                                            values[i], MAXLEN);
+            }
+            for (int i = 0; i < n; i++) {
+                append_result(response, len, &used, i == 0,
+                              results[i] && values[i][0] ? values[i]
+                                                         : "not found");
+            }
+            return;
+
+        case 'a':
+            batch_add(n, names, args, results);
+            for (int i = 0; i < n; i++) {
+                append_result(response, len, &used, i == 0,
+                              results[i] ? "added" : "already in database");
+            }
+            return;
+
+        case 'd':
+            batch_remove(n, names, results);
+            for (int i = 0; i < n; i++) {
+                append_result(response, len, &used, i == 0,
+                              results[i] ? "removed" : "not in database");
+            }
+            return;
+    }
 }
 
-/* Destroys all nodes in the database other than the head.
- * No threads should be using the database when this is called. */
-void db_cleanup() {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+/* Sets to to the smallest name above all those that start with prefix and
+ * returns it, or returns NULL if there is no such name. */
+static char *prefix_end(const char *prefix, char *to) {
+    size_t n = strlen(prefix);
+
+    strcpy(to, prefix);
+    while (n > 0 && (unsigned char)to[n - 1] == 0xff) n--;
+    if (n == 0) return NULL;
+    to[n - 1]++;
+    to[n] = '\0';
+    return to;
+}
+
+/* Interprets a scan: "r from to [limit]" for the names from <= name < to,
+ * or "p prefix [limit [start]]" for the names that start with prefix (and
+ * are not below start). The response holds the pairs, "name value", in
+ * name order, separated by tabs: at most limit of them (MAXBATCH by
+ * default and at most), and fewer if they would not fit. If there are
+ * more, the last field is the bare name the next page starts from, to be
+ * passed as from, or as start. */
+static void interpret_scan(char *command, char *response, int len) {
+    char *pairs;  // limit + 1 names, then as many values
+    char *names[MAXBATCH + 1], *values[MAXBATCH + 1];
+    char from[MAXLEN], to[MAXLEN], prefix[MAXLEN], start[MAXLEN];
+    char *bound = to;
+    int limit = MAXBATCH, n, i, args;
+    size_t used = 0;
+
+    if (command[0] == 'r') {
+        args = sscanf(&command[1], "%255s %255s %d", from, to, &limit);
+        if (args < 2) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+    } else {
+        args = sscanf(&command[1], "%255s %d %255s", prefix, &limit, start);
+        if (args < 1) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        strcpy(from, args == 3 && strcmp(start, prefix) > 0 ? start : prefix);
+        bound = prefix_end(prefix, to);
+    }
+    if (limit < 1) {
+        snprintf(response, len, "ill-formed command");
+        return;
+    }
+    if (limit > MAXBATCH) limit = MAXBATCH;
+
+    // the page, sized for what was asked: one more than that, to tell
+    // whether there are more
+    if ((pairs = (char *)malloc((size_t)(limit + 1) * 2 * MAXLEN)) == 0) {
+        snprintf(response, len, "out of memory");
+        return;
+    }
+    for (i = 0; i <= limit; i++) {
+        names[i] = &pairs[(size_t)i * MAXLEN];
+        values[i] = &pairs[(size_t)(limit + 1 + i) * MAXLEN];
+    }
+    if ((n = db_scan(from, bound, limit + 1, names, values)) == 0) {
+        snprintf(response, len, "no matching names");
+        free(pairs);
+        return;
+    }
+
+    response[0] = '\0';
+    for (i = 0; i < n && i < limit; i++) {
+        // keep room for the name to go on from
+        if (used + strlen(names[i]) + strlen(values[i]) + MAXLEN + 3 >
+            (size_t)len)
+            break;
+        used += snprintf(response + used, len - used, "%s%s %s",
+                         i ? "\t" : "", names[i], values[i]);
+    }
+    if (i < n) {
+        snprintf(response + used, len - used, "%s%s", i ? "\t" : "",
+                 names[i]);
+    }
+    free(pairs);
+}
+
+static void execute_command(char *command, char *response, int len);
+
+/* Runs the commands in a file, silently. Returns 0, or -1 if the file
+ * could not be opened. */
+static int run_file(const char *name, char *response, int len) {
+    char ibuf[MAXCMD];
+    FILE *finput;
+
+    switch (load_file(name, apply_changes)) {
+        case LOAD_DONE:
+            return 0;
+        case LOAD_BAD_FILE:
+            return -1;
+    }
+
+    // LOAD_SEQUENTIAL: run it line by line
+    if ((finput = fopen(name, "r")) == 0) return -1;
+    while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
+        pthread_testcancel();  // fgets is not a cancellation point
+        execute_command(ibuf, response, len);
+    }
+    fclose(finput);
+    return 0;
+}
+
+/* Whitespace as isspace sees it in the C locale. */
+static inline int is_blank(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* Returns whether any of the len bytes at s is whitespace. */
+static int has_blank(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (is_blank(s[i])) return 1;
+    }
+    return 0;
+}
+
+/* Finds the next word of a command as sscanf's "%255s" would, without
+ * copying it: skips whitespace, then takes up to MAXLEN - 1 other bytes
+ * (a longer word goes on in the next one). Sets *word to where it starts
+ * and *p to just after it, and returns its length, 0 if there is none. */
+static int next_word(const char **p, const char **word) {
+    const char *s = *p;
+    int n = 0;
+
+    while (is_blank(*s)) s++;
+    while (n < MAXLEN - 1 && s[n] != '\0' && !is_blank(s[n])) n++;
+    *word = s;
+    *p = s + n;
+    return n;
 }
 
 /* Interprets the given command string and calls the appropriate database
  * function. Writes up to len-1 bytes of the response message string produced
- * by the database to the response buffer. */
-void interpret_command(char *command, char *response, int len) {
+ * by the database to the response buffer. Names and values are passed to
+ * the database where they lie in the command, which is left untouched. */
+static void execute_command(char *command, char *response, int len) {
 	// printf("command: %s, response: %s\n", command, response);
-    char value[MAXLEN];
-    char ibuf[MAXLEN];
-    char name[MAXLEN];
-    int sscanf_ret;
+    const char *rest = &command[1];
+    const char *name, *value;
+    int name_len, value_len;
+    char file[MAXLEN];
 
-    if (strlen(command) <= 1) {
+    if (command[0] == '\0' || command[1] == '\0') {
         snprintf(response, len, "ill-formed command");
         return;
     }
@@ -322,13 +838,12 @@ void interpret_command(char *command, char *response, int len) {
     switch (command[0]) {
         case 'q':
             // Query
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
+            if ((name_len = next_word(&rest, &name)) == 0) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            db_query(name, response, len);
-            if (strlen(response) == 0) {
+            if (!db_query(name, name_len, response, len) ||
+                response[0] == '\0') {
                 snprintf(response, len, "not found");
             }
 
@@ -336,12 +851,12 @@ void interpret_command(char *command, char *response, int len) {
 
         case 'a':
             // Add to the database
-            sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
-            if (sscanf_ret < 2) {
+            if ((name_len = next_word(&rest, &name)) == 0 ||
+                (value_len = next_word(&rest, &value)) == 0) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            if (db_add(name, value)) {
+            if (db_add(name, name_len, value, value_len)) {
                 snprintf(response, len, "added");
             } else {
                 snprintf(response, len, "already in database");
@@ -351,12 +866,11 @@ void interpret_command(char *command, char *response, int len) {
 
         case 'd':
             // Delete from the database
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
+            if ((name_len = next_word(&rest, &name)) == 0) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            if (db_remove(name)) {
+            if (db_remove(name, name_len)) {
                 snprintf(response, len, "removed");
             } else {
                 snprintf(response, len, "not in database");
@@ -366,23 +880,39 @@ void interpret_command(char *command, char *response, int len) {
 
         case 'f':
             // process the commands in a file (silently)
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
+            if ((name_len = next_word(&rest, &name)) == 0) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
+            memcpy(file, name, name_len);
+            file[name_len] = '\0';
 
-            FILE *finput = fopen(name, "r");
-            if (!finput) {
+            if (run_file(file, response, len) < 0) {
                 snprintf(response, len, "bad file name");
-                return;
+            } else {
+                snprintf(response, len, "file processed");
             }
-            while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
-                pthread_testcancel();  // fgets is not a cancellation point
-                interpret_command(ibuf, response, len);
+            return;
+
+        case 'm':
+            // Several names at once
+            interpret_batch(command, response, len);
+            return;
+
+        case 'r':
+        case 'p':
+            // Names in order: a range, or those with a prefix
+            interpret_scan(command, response, len);
+            return;
+
+        case 's':
+            // Server statistics, on one line (see stats.h)
+            if (strncmp(command, "stats", 5) != 0 ||
+                (command[5] != '\0' && !isspace((unsigned char)command[5]))) {
+                snprintf(response, len, "ill-formed command");
+                return;
             }
-            fclose(finput);
-            snprintf(response, len, "file processed");
+            stats_format(response, len, db_count(), db_height());
             return;
 
         default:
@@ -390,3 +920,84 @@ void interpret_command(char *command, char *response, int len) {
             return;
     }
 }
+
+/* Executes a command as execute_command does, returning only once the
+ * changes it made are durable (when there is a write-ahead log), and
+ * counts it in the server's statistics. */
+void interpret_command(char *command, char *response, int len) {
+    uint64_t start = stats_now();
+
+    execute_command(command, response, len);
+    wal_wait();
+    stats_command(command[0], start);
+}
+
+/* Executes a binary request (see frame.h) and writes the reply, at most
+ * FRAME_REPLY_MAX bytes, to reply. The key and value are used where they
+ * lie in the request. Returns the length of the reply. */
+int interpret_frame(char *frame, char *reply) {
+    frame_header_t req, rep;
+    char *name = frame + sizeof(req);
+    char *value;
+    char command[MAXLEN + 2];  // "f " and the file name
+    size_t key_len, value_len;
+    uint64_t start = stats_now();
+
+    memcpy(&req, frame, sizeof(req));
+    key_len = ntohs(req.key_len);
+    value_len = ntohl(req.value_len);
+    value = name + key_len + 1;
+
+    memset(&rep, 0, sizeof(rep));
+    rep.opcode = FRAME_ILL_FORMED;
+
+    // both strings must be NUL-terminated and the key non-empty, and
+    // neither may hold whitespace, which separates them in the text
+    // protocol, the replies and the log
+    if (key_len == 0 || memchr(name, '\0', key_len + 1) != name + key_len ||
+        memchr(value, '\0', value_len + 1) != value + value_len ||
+        has_blank(name, key_len) || has_blank(value, value_len)) {
+        memcpy(reply, &rep, sizeof(rep));
+        stats_command(0, start);
+        return sizeof(rep);
+    }
+
+    switch (req.opcode) {
+        case FRAME_QUERY:
+            if (db_query(name, key_len, reply + sizeof(rep),
+                         FRAME_MAX_STRING + 1) &&
+                reply[sizeof(rep)] != '\0') {
+                rep.opcode = FRAME_OK;
+                rep.value_len = htonl(strlen(reply + sizeof(rep)));
+            } else {
+                rep.opcode = FRAME_NOT_FOUND;
+            }
+            break;
+
+        case FRAME_ADD:
+            if (value_len > 0) {
+                rep.opcode = db_add(name, key_len, value, value_len)
+                                 ? FRAME_OK
+                                 : FRAME_NOT_FOUND;
+            }
+            break;
+
+        case FRAME_DELETE:
+            rep.opcode =
+                db_remove(name, key_len) ? FRAME_OK : FRAME_NOT_FOUND;
+            break;
+
+        case FRAME_FILE:
+            // rare enough to go through the text path
+            snprintf(command, sizeof(command), "f %s", name);
+            execute_command(command, reply, FRAME_REPLY_MAX);
+            rep.opcode = strcmp(reply, "file processed") == 0 ? FRAME_OK
+                                                              : FRAME_NOT_FOUND;
+            break;
+    }
+
+    wal_wait();  // as in interpret_command
+    stats_command(req.opcode, start);
+    memcpy(reply, &rep, sizeof(rep));
+    return sizeof(rep) + ntohl(rep.value_len);
+}
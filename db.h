@@ -4,18 +4,20 @@
 #include <pthread.h>
 
 #define MAXLEN 256
+#define MAXBATCH 64                  // names in one batch command (mq/ma/md)
+#define MAXCMD 4096                  // longest command, with its newline
+#define MAXRESP (MAXBATCH * MAXLEN)  // room for any response
+#define MAXSHARDS 64                 // see db_init
 
-typedef struct node {
-    char *name;
-    char *value;
-    struct node *lchild;
-    struct node *rchild;
-} node_t;
-
-extern node_t head;
-
+extern int db_init(const char *engine, int shards);
+extern int db_restore(const char *path);
+extern int db_journal(const char *path, long window_us);
+extern int db_checkpoint(const char *path);
 extern void interpret_command(char *command, char *response, int resp_capacity);
+extern int interpret_frame(char *frame, char *reply);
 extern int db_print(char *filename);
+extern int db_height(void);
+extern int db_count(void);
 extern void db_cleanup(void);
 
-#endif  // DB_H_
\ No newline at end of file
+#endif  // DB_H_
@@ -0,0 +1,285 @@
+/*
+ * Drives the database directly, without sockets, with the commands from a
+ * script file, the same way a number of client threads running that script
+ * would. Every thread replays the whole script, so the amount of work grows
+ * with the thread count and the interesting number is the aggregate
+ * commands/sec.
+ *
+ * Usage: ./db_bench [-e engine] [-n shards] [-b] [-l script] [-w script]
+ *                   <script>[,<script>...] [max_threads]
+ *        ./db_bench [-e engine] [-n shards] -s <nkeys>
+ *
+ * The database is emptied between rounds; rounds run with 1, 2, 4, ...
+ * threads up to max_threads (default 8). With -l, the given script is run
+ * once before each round to preload the database. With -w, one extra
+ * thread keeps replaying the given script while the round runs, so lookups
+ * can be measured with writers active; its commands are not counted.
+ *
+ * Given several scripts separated by commas, thread i replays script i
+ * modulo their number instead, so that e.g. four permutations of the same
+ * commands can be run against each other. -n splits the database into
+ * that many shards (see db_shard.c).
+ *
+ * With -b, the workload is encoded as binary requests (see frame.h) when it
+ * is loaded and replayed through interpret_frame instead of
+ * interpret_command, which compares the cost of the two protocols without
+ * any network in the way.
+ *
+ * Besides throughput, each round reports how many slab allocations (see
+ * slab.h) and how many actual mallocs were made per command, and how many
+ * bytes of slab memory each entry left in the database takes up.
+ *
+ * With -s, nkeys names are added in strictly increasing order instead (the
+ * worst case for an unbalanced tree) and the resulting tree height is
+ * reported next to log2(nkeys).
+ */
+#include <arpa/inet.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./db.h"
+#include "./frame.h"
+#include "./slab.h"
+
+typedef struct script {
+    char **lines;
+    int nlines;
+} script_t;
+
+#define MAXSCRIPTS 16
+
+static script_t workloads[MAXSCRIPTS];
+static int nworkloads;
+static script_t preload;
+static script_t background;
+static volatile int round_done;
+static int binary;  // replay the workload as binary requests
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Encodes a command line as a binary request, the way client -b does. */
+static char *encode_frame(const char *line) {
+    frame_header_t h;
+    char name[MAXLEN], value[MAXLEN];
+    char *frame;
+    size_t key_len, value_len;
+
+    name[0] = value[0] = '\0';
+    if (line[0] != '\0') sscanf(&line[1], "%255s %255s", name, value);
+    if (line[0] != FRAME_ADD) value[0] = '\0';
+    key_len = strlen(name);
+    value_len = strlen(value);
+
+    memset(&h, 0, sizeof(h));
+    h.opcode = line[0];
+    h.key_len = htons(key_len);
+    h.value_len = htonl(value_len);
+
+    frame = malloc(sizeof(h) + key_len + value_len + 2);
+    memcpy(frame, &h, sizeof(h));
+    memcpy(frame + sizeof(h), name, key_len + 1);
+    memcpy(frame + sizeof(h) + key_len + 1, value, value_len + 1);
+    return frame;
+}
+
+static int load_script(script_t *script, const char *path, int encode) {
+    FILE *in;
+    char buf[MAXCMD];
+    int cap = 1024;
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    script->lines = malloc(cap * sizeof(char *));
+    while (fgets(buf, sizeof(buf), in) != NULL) {
+        if (script->nlines == cap) {
+            cap *= 2;
+            script->lines = realloc(script->lines, cap * sizeof(char *));
+        }
+        script->lines[script->nlines++] =
+            encode ? encode_frame(buf) : strdup(buf);
+    }
+
+    fclose(in);
+    return 0;
+}
+
+static void *replay(void *arg) {
+    script_t *script = arg;
+    char response[MAXRESP];
+
+    for (int i = 0; i < script->nlines; i++) {
+        interpret_command(script->lines[i], response, sizeof(response));
+    }
+    return NULL;
+}
+
+static void *replay_frames(void *arg) {
+    script_t *script = arg;
+    char reply[FRAME_REPLY_MAX];
+
+    for (int i = 0; i < script->nlines; i++) {
+        interpret_frame(script->lines[i], reply);
+    }
+    return NULL;
+}
+
+static void *replay_until_done(void *arg) {
+    while (!round_done) replay(arg);
+    return NULL;
+}
+
+static int sorted_insert(int nkeys) {
+    char name[MAXLEN];
+    char response[MAXLEN];
+    double start = now();
+
+    for (int i = 0; i < nkeys; i++) {
+        snprintf(name, sizeof(name), "a key%010d value%d", i, i);
+        interpret_command(name, response, sizeof(response));
+    }
+
+    double elapsed = now() - start;
+    printf("%d sorted adds in %.3f s (%.0f adds/sec)\n", nkeys, elapsed,
+           nkeys / elapsed);
+    printf("height %d, log2(n) = %.1f\n", db_height(),
+           log2(nkeys > 1 ? nkeys : 2));
+
+    slab_stats_t stats;
+    slab_stats(&stats);
+    printf("%.2f allocs/add, %.1f bytes/entry in use, %.1f reserved\n",
+           (double)stats.allocs / nkeys, (double)stats.bytes_in_use / nkeys,
+           (double)stats.bytes_reserved / nkeys);
+
+    db_cleanup();
+    return 0;
+}
+
+static void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-e engine] [-n shards] [-b] [-l script] [-w script] "
+            "<script>[,<script>...] [max_threads]\n",
+            cmd);
+    fprintf(stderr, "       %s [-e engine] [-n shards] -s <nkeys>\n", cmd);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = 8;
+    int sorted_keys = 0;
+    char *engine = NULL;
+    char *path;
+    int nshards = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "be:l:n:s:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                binary = 1;
+                break;
+            case 'e':
+                engine = optarg;
+                break;
+            case 'l':
+                if (load_script(&preload, optarg, 0) < 0) return 1;
+                break;
+            case 'w':
+                if (load_script(&background, optarg, 0) < 0) return 1;
+                break;
+            case 'n':
+                nshards = atoi(optarg);
+                break;
+            case 's':
+                sorted_keys = atoi(optarg);
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+
+    if (nshards < 1 || nshards > MAXSHARDS) {
+        usage_error(argv[0]);
+        return 1;
+    }
+    if (db_init(engine, nshards) < 0) {
+        fprintf(stderr, "%s: unknown storage engine '%s'\n", argv[0], engine);
+        return 1;
+    }
+    if (sorted_keys > 0) return sorted_insert(sorted_keys);
+
+    if (optind >= argc) {
+        usage_error(argv[0]);
+        return 1;
+    }
+    if (optind + 1 < argc) max_threads = atoi(argv[optind + 1]);
+    for (path = strtok(argv[optind], ","); path != NULL;
+         path = strtok(NULL, ",")) {
+        if (nworkloads == MAXSCRIPTS) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        if (load_script(&workloads[nworkloads++], path, binary) < 0) return 1;
+    }
+    if (nworkloads == 0) {
+        usage_error(argv[0]);
+        return 1;
+    }
+
+    printf("%-8s %12s %12s %14s %12s %12s %12s\n", "threads", "commands",
+           "seconds", "commands/sec", "allocs/cmd", "mallocs/cmd",
+           "bytes/entry");
+
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        pthread_t tids[nthreads];
+        pthread_t writer;
+
+        replay(&preload);
+        round_done = 0;
+        if (background.nlines > 0) {
+            pthread_create(&writer, 0, replay_until_done, &background);
+        }
+
+        slab_stats_t before, after;
+        slab_stats(&before);
+        double start = now();
+        long total = 0;
+
+        for (int i = 0; i < nthreads; i++) {
+            script_t *workload = &workloads[i % nworkloads];
+
+            pthread_create(&tids[i], 0, binary ? replay_frames : replay,
+                           workload);
+            total += workload->nlines;
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(tids[i], 0);
+        }
+
+        double elapsed = now() - start;
+
+        round_done = 1;
+        if (background.nlines > 0) pthread_join(writer, 0);
+        slab_stats(&after);
+
+        int entries = db_count();
+        printf("%-8d %12ld %12.3f %14.0f %12.2f %12.4f %12.1f\n", nthreads,
+               total, elapsed, total / elapsed,
+               (double)(after.allocs - before.allocs) / total,
+               (double)(after.system_allocs - before.system_allocs) / total,
+               entries ? (double)after.bytes_in_use / entries : 0.0);
+
+        db_cleanup();
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+#ifndef DB_ENGINE_H_
+#define DB_ENGINE_H_
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * A storage engine holds the name/value pairs behind interpret_command.
+ * create returns a handle that is passed to every other operation. All
+ * operations must be safe to call from any number of client threads at
+ * once, except clear, which is only called when no other thread is using
+ * the database.
+ */
+// What a bulk load does with a name
+#define LOAD_ADD 0     // add the pair, unless name is already present
+#define LOAD_PUT 1     // add the pair, replacing the value name may have
+#define LOAD_DELETE 2  // remove name, if present
+
+// Every pair in the database, sorted by name, as they stood at one moment
+// (see the view operation).
+typedef struct db_view {
+    int n;
+    char **names;
+    char **values;
+    void *handle;  // the engine's
+} db_view_t;
+
+typedef struct db_engine {
+    const char *name;
+    void *(*create)(void);
+
+    // The single-name operations take the name (and value) as a pointer
+    // and a length, and need not find a terminator after them, so they can
+    // be given words where they lie in a command line.
+    //
+    // copies the value stored under name into result and returns 1, or
+    // returns 0 if name is not present
+    int (*query)(void *db, const char *name, int name_len, char *result,
+                 int len);
+    // returns 1 if the pair was added, 0 if name was already present
+    int (*add)(void *db, const char *name, int name_len, const char *value,
+               int value_len);
+    // returns 1 if name was removed, 0 if it was not present
+    int (*remove)(void *db, const char *name, int name_len);
+
+    // Batch versions of the three above, for n names (n <= MAXBATCH) at
+    // once: the result for names[i] goes to found[i] / added[i] /
+    // removed[i], and for a query its value to results[i]. Names are
+    // handled in order, so a name that occurs twice sees the effect of its
+    // first occurrence. Engines should resolve a batch with as few lock
+    // acquisitions as they can.
+    void (*query_many)(void *db, int n, char **names, char **results,
+                       int len, int *found);
+    void (*add_many)(void *db, int n, char **names, char **values,
+                     int *added);
+    void (*remove_many)(void *db, int n, char **names, int *removed);
+
+    // Copies the pairs with from <= name < to (no upper bound if to is
+    // NULL), smallest name first, at most n of them, into names[i] and
+    // values[i] (len bytes each) and returns how many it copied. It may
+    // reorder the pointers in names and values. No lock is held across the
+    // scan: a pair changed while it runs may or may not be seen.
+    int (*scan)(void *db, char *from, char *to, int n, char **names,
+                char **values, int len);
+
+    // Applies n changes at once (see db_load.h): ops[i] says what to do
+    // with names[i] and values[i] (values[i] is unused for LOAD_DELETE).
+    // Names are sorted by strcmp and none occurs twice. The engine may take
+    // its locks once for the whole load; readers must never see a broken
+    // database, but may see the load partly applied.
+    void (*load)(void *db, int n, char **names, char **values, int *ops);
+
+    // Fills in view and returns 0, or returns -1 if memory runs out.
+    // Writers may be held off while the view is taken, but not while it is
+    // in use. The strings stay valid until release is called, which must be
+    // done from the same thread.
+    int (*view)(void *db, db_view_t *view);
+    void (*release)(void *db, db_view_t *view);
+
+    void (*print)(void *db, FILE *out);
+    void (*clear)(void *db);
+    // clears the database and frees it; nothing may use it any more
+    void (*destroy)(void *db);
+    // length of the longest lookup path (tree height, longest hash chain)
+    int (*height)(void *db);
+    // number of entries
+    int (*count)(void *db);
+} db_engine_t;
+
+/* If set, engines report every change they make to it: LOAD_ADD for a
+ * pair added where name was absent, LOAD_PUT for a value replaced and
+ * LOAD_DELETE for a name removed. They do so while still holding the lock
+ * that orders changes to name, so the reports for any one name come in the
+ * order the changes were made. See wal.h. */
+typedef void (*db_logger_t)(int op, const char *name, const char *value);
+extern db_logger_t db_logger;
+
+static inline void db_log(int op, const char *name, const char *value) {
+    if (db_logger) db_logger(op, name, value);
+}
+
+/* Copies a stored value of value_len bytes into result, as
+ * snprintf(result, len, "%s", value) would. */
+static inline void db_copy_value(char *result, int len, const char *value,
+                                 int value_len) {
+    if (len <= 0) return;
+    if (value_len > len - 1) value_len = len - 1;
+    memcpy(result, value, value_len);
+    result[value_len] = '\0';
+}
+
+extern const db_engine_t tree_engine;
+extern const db_engine_t hash_engine;
+
+/* Names split by hash over n independent databases of the inner engine
+ * (see db_shard.c); its create is shard_create. */
+extern const db_engine_t shard_engine;
+extern void *shard_create(const db_engine_t *inner, int n);
+
+#endif  // DB_ENGINE_H_
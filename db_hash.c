@@ -0,0 +1,564 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./db.h"
+#include "./db_engine.h"
+#include "./slab.h"
+#include "./stats.h"
+
+/*
+ * The "hash" storage engine: a chained hash table for workloads that only
+ * ever look names up exactly. Buckets are guarded by a fixed set of striped
+ * reader/writer locks; bucket i belongs to stripe i % NSTRIPES, which stays
+ * true across resizes since the bucket count is always a multiple of
+ * NSTRIPES. Growing the table takes every stripe.
+ *
+ * Entries are kept in no particular order, so print and view sort them on
+ * demand.
+ */
+
+#define NSTRIPES 64  // at most 64, see hash_batch
+#define INITIAL_BUCKETS 1024  // power of two, multiple of NSTRIPES
+#define MAX_LOAD 2            // average chain length that triggers a resize
+
+typedef struct entry {
+    struct entry *next;
+    uint64_t hash;
+    unsigned short name_len;
+    unsigned short value_len;
+    char name[];  // name, then value, in the same slab block
+} entry_t;
+
+#define entry_value(e) ((e)->name + (e)->name_len + 1)
+
+typedef struct hash {
+    pthread_rwlock_t stripes[NSTRIPES];
+    entry_t **buckets;
+    size_t nbuckets;
+    size_t count;  // updated atomically
+} hash_t;
+
+/* FNV-1a */
+static uint64_t hash_name(const char *name, int name_len) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for (int i = 0; i < name_len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static entry_t *entry_constructor(const char *name, int name_len,
+                                  const char *value, int val_len,
+                                  uint64_t hash) {
+    if (name_len > MAXLEN || val_len > MAXLEN) return 0;
+
+    entry_t *e =
+        (entry_t *)slab_alloc(sizeof(entry_t) + name_len + val_len + 2);
+
+    if (e == 0) return 0;
+
+    e->name_len = name_len;
+    e->value_len = val_len;
+    memcpy(e->name, name, name_len);
+    e->name[name_len] = '\0';
+    memcpy(entry_value(e), value, val_len);
+    entry_value(e)[val_len] = '\0';
+    e->hash = hash;
+    e->next = 0;
+    return e;
+}
+
+static void entry_destructor(entry_t *e) {
+    slab_free(e, sizeof(entry_t) + e->name_len + e->value_len + 2);
+}
+
+static inline pthread_rwlock_t *stripe_of(hash_t *t, uint64_t hash) {
+    return &t->stripes[hash % NSTRIPES];
+}
+
+static inline entry_t **bucket_of(hash_t *t, uint64_t hash) {
+    return &t->buckets[hash & (t->nbuckets - 1)];
+}
+
+static void lock_all(hash_t *t, int write) {
+    for (int i = 0; i < NSTRIPES; i++) {
+        if (write)
+            stats_wrlock(&t->stripes[i]);
+        else
+            stats_rdlock(&t->stripes[i]);
+    }
+}
+
+static void unlock_all(hash_t *t) {
+    for (int i = NSTRIPES - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&t->stripes[i]);
+    }
+}
+
+static void *hash_create(void) {
+    hash_t *t = (hash_t *)calloc(1, sizeof(hash_t));
+
+    if (t == 0) return 0;
+
+    if ((t->buckets = (entry_t **)calloc(INITIAL_BUCKETS,
+                                         sizeof(entry_t *))) == 0) {
+        free(t);
+        return 0;
+    }
+    t->nbuckets = INITIAL_BUCKETS;
+
+    for (int i = 0; i < NSTRIPES; i++) {
+        pthread_rwlock_init(&t->stripes[i], 0);
+    }
+    return t;
+}
+
+/* Doubles the number of buckets, or more if that is what it takes to make
+ * room for extra entries on top of the current ones, unless another thread
+ * already did. If the new bucket array can't be allocated the table simply
+ * stays as is. */
+static void hash_grow(hash_t *t, size_t extra) {
+    size_t count;
+
+    lock_all(t, 1);
+
+    if ((count = t->count + extra) > t->nbuckets * MAX_LOAD) {
+        size_t old_nbuckets = t->nbuckets;
+        size_t nbuckets = old_nbuckets * 2;
+        entry_t **old = t->buckets;
+        entry_t **new_buckets;
+
+        while (count > nbuckets * MAX_LOAD) nbuckets *= 2;
+        new_buckets = (entry_t **)calloc(nbuckets, sizeof(entry_t *));
+
+        if (new_buckets != 0) {
+            t->buckets = new_buckets;
+            t->nbuckets = nbuckets;
+
+            for (size_t i = 0; i < old_nbuckets; i++) {
+                entry_t *e = old[i];
+                while (e != 0) {
+                    entry_t *next = e->next;
+                    entry_t **b = bucket_of(t, e->hash);
+                    e->next = *b;
+                    *b = e;
+                    e = next;
+                }
+            }
+            free(old);
+        }
+    }
+
+    unlock_all(t);
+}
+
+/* Returns the link that points to the entry for name, or the link at the
+ * end of its chain if there is none. The caller holds the stripe. */
+static entry_t **hash_find(hash_t *t, uint64_t h, const char *name,
+                           int name_len) {
+    entry_t **pe;
+
+    for (pe = bucket_of(t, h); *pe != 0; pe = &(*pe)->next) {
+        if ((*pe)->hash == h && (*pe)->name_len == name_len &&
+            memcmp((*pe)->name, name, name_len) == 0)
+            break;
+    }
+    return pe;
+}
+
+/* The bodies of query, add and remove. The caller holds the stripe. */
+
+static int hash_query_locked(hash_t *t, uint64_t h, const char *name,
+                             int name_len, char *result, int len) {
+    entry_t *e = *hash_find(t, h, name, name_len);
+
+    if (e == 0) return 0;
+    db_copy_value(result, len, entry_value(e), e->value_len);
+    return 1;
+}
+
+static int hash_add_locked(hash_t *t, uint64_t h, const char *name,
+                           int name_len, const char *value, int value_len) {
+    entry_t **pe = hash_find(t, h, name, name_len);
+    entry_t *e;
+
+    if (*pe != 0 ||
+        (e = entry_constructor(name, name_len, value, value_len, h)) == 0)
+        return (0);
+    *pe = e;
+    __atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+    db_log(LOAD_ADD, e->name, entry_value(e));
+    return (1);
+}
+
+static int hash_remove_locked(hash_t *t, uint64_t h, const char *name,
+                              int name_len) {
+    entry_t **pe = hash_find(t, h, name, name_len);
+    entry_t *e = *pe;
+
+    if (e == 0) return (0);
+    *pe = e->next;
+    __atomic_sub_fetch(&t->count, 1, __ATOMIC_RELAXED);
+    db_log(LOAD_DELETE, e->name, 0);
+    entry_destructor(e);
+    return (1);
+}
+
+static inline int hash_overloaded(hash_t *t) {
+    return __atomic_load_n(&t->count, __ATOMIC_RELAXED) >
+           t->nbuckets * MAX_LOAD;
+}
+
+static int hash_query(void *db, const char *name, int name_len, char *result,
+                      int len) {
+    hash_t *t = db;
+    uint64_t h = hash_name(name, name_len);
+    pthread_rwlock_t *stripe = stripe_of(t, h);
+    int found;
+
+    stats_rdlock(stripe);
+    found = hash_query_locked(t, h, name, name_len, result, len);
+    pthread_rwlock_unlock(stripe);
+
+    return found;
+}
+
+static int hash_add(void *db, const char *name, int name_len,
+                    const char *value, int value_len) {
+    hash_t *t = db;
+    uint64_t h = hash_name(name, name_len);
+    pthread_rwlock_t *stripe = stripe_of(t, h);
+    int added, grow;
+
+    stats_wrlock(stripe);
+    added = hash_add_locked(t, h, name, name_len, value, value_len);
+    grow = added && hash_overloaded(t);
+    pthread_rwlock_unlock(stripe);
+
+    if (grow) hash_grow(t, 0);
+    return added;
+}
+
+static int hash_remove(void *db, const char *name, int name_len) {
+    hash_t *t = db;
+    uint64_t h = hash_name(name, name_len);
+    pthread_rwlock_t *stripe = stripe_of(t, h);
+    int removed;
+
+    stats_wrlock(stripe);
+    removed = hash_remove_locked(t, h, name, name_len);
+    pthread_rwlock_unlock(stripe);
+
+    return removed;
+}
+
+/*
+ * Batches are handled stripe by stripe: every stripe that some name of the
+ * batch hashes to is locked once, and all of that stripe's names are dealt
+ * with under it, in batch order (the same name always lands on the same
+ * stripe, so per-name ordering is kept).
+ */
+
+#define OP_QUERY 0
+#define OP_ADD 1
+#define OP_REMOVE 2
+
+static void hash_batch(hash_t *t, int op, int n, char **names, char **values,
+                       int len, int *results) {
+    uint64_t hashes[MAXBATCH];
+    uint64_t stripes = 0;  // one bit per stripe, see NSTRIPES
+    int lens[MAXBATCH];
+    int grow = 0;
+
+    for (int i = 0; i < n; i++) {
+        lens[i] = strlen(names[i]);
+        hashes[i] = hash_name(names[i], lens[i]);
+        stripes |= 1ULL << (hashes[i] % NSTRIPES);
+    }
+
+    while (stripes != 0) {
+        int s = __builtin_ctzll(stripes);
+        pthread_rwlock_t *stripe = &t->stripes[s];
+
+        stripes &= stripes - 1;
+        if (op == OP_QUERY) {
+            stats_rdlock(stripe);
+        } else {
+            stats_wrlock(stripe);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (hashes[i] % NSTRIPES != (uint64_t)s) continue;
+
+            if (op == OP_QUERY) {
+                results[i] = hash_query_locked(t, hashes[i], names[i], lens[i],
+                                               values[i], len);
+            } else if (op == OP_ADD) {
+                results[i] = hash_add_locked(t, hashes[i], names[i], lens[i],
+                                             values[i], strlen(values[i]));
+            } else {
+                results[i] =
+                    hash_remove_locked(t, hashes[i], names[i], lens[i]);
+            }
+        }
+
+        if (op == OP_ADD) grow |= hash_overloaded(t);
+        pthread_rwlock_unlock(stripe);
+    }
+
+    if (grow) hash_grow(t, 0);
+}
+
+static void hash_query_many(void *db, int n, char **names, char **results,
+                            int len, int *found) {
+    hash_batch(db, OP_QUERY, n, names, results, len, found);
+}
+
+static void hash_add_many(void *db, int n, char **names, char **values,
+                          int *added) {
+    hash_batch(db, OP_ADD, n, names, values, 0, added);
+}
+
+static void hash_remove_many(void *db, int n, char **names, int *removed) {
+    hash_batch(db, OP_REMOVE, n, names, 0, 0, removed);
+}
+
+/* Names are in no order here, so a scan looks at every entry, keeping the
+ * n smallest names in range sorted in names/values as it goes. It takes
+ * one stripe at a time; an entry never leaves its stripe, even when the
+ * table grows, so none is seen twice or missed for that. */
+static int hash_scan(void *db, char *from, char *to, int n, char **names,
+                     char **values, int len) {
+    hash_t *t = db;
+    int m = 0;
+
+    for (int s = 0; s < NSTRIPES; s++) {
+        stats_rdlock(&t->stripes[s]);
+
+        for (size_t i = s; i < t->nbuckets; i += NSTRIPES) {
+            for (entry_t *e = t->buckets[i]; e != 0; e = e->next) {
+                char *name, *value;
+                int j;
+
+                if (strcmp(e->name, from) < 0 ||
+                    (to != 0 && strcmp(e->name, to) >= 0) ||
+                    (m == n && strcmp(e->name, names[n - 1]) >= 0))
+                    continue;
+
+                // the largest one kept makes room, if need be
+                name = names[m < n ? m : n - 1];
+                value = values[m < n ? m : n - 1];
+                if (m < n) m++;
+                for (j = m - 1; j > 0 && strcmp(e->name, names[j - 1]) < 0;
+                     j--) {
+                    names[j] = names[j - 1];
+                    values[j] = values[j - 1];
+                }
+                names[j] = name;
+                values[j] = value;
+                db_copy_value(name, len, e->name, e->name_len);
+                db_copy_value(value, len, entry_value(e), e->value_len);
+            }
+        }
+
+        pthread_rwlock_unlock(&t->stripes[s]);
+    }
+    return m;
+}
+
+/* Adds the pair, or replaces the value name has. The caller holds the
+ * stripe. */
+static void hash_put_locked(hash_t *t, uint64_t h, const char *name,
+                            int name_len, const char *value, int value_len) {
+    entry_t **pe = hash_find(t, h, name, name_len);
+    entry_t *e = entry_constructor(name, name_len, value, value_len, h);
+
+    if (e == 0) {
+        hash_remove_locked(t, h, name, name_len);
+        return;
+    }
+    if (*pe != 0) {
+        e->next = (*pe)->next;
+        entry_destructor(*pe);
+        db_log(LOAD_PUT, e->name, entry_value(e));
+    } else {
+        __atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+        db_log(LOAD_ADD, e->name, entry_value(e));
+    }
+    *pe = e;
+}
+
+/* A load can be far bigger than a batch, so it is done name by name. The
+ * table is first grown to hold every name the load might add. */
+static void hash_load(void *db, int n, char **names, char **values,
+                      int *ops) {
+    hash_t *t = db;
+
+    hash_grow(t, n);
+
+    for (int i = 0; i < n; i++) {
+        int name_len = strlen(names[i]);
+        uint64_t h = hash_name(names[i], name_len);
+        pthread_rwlock_t *stripe = stripe_of(t, h);
+        int grow;
+
+        stats_wrlock(stripe);
+        if (ops[i] == LOAD_ADD) {
+            hash_add_locked(t, h, names[i], name_len, values[i],
+                            strlen(values[i]));
+        } else if (ops[i] == LOAD_PUT) {
+            hash_put_locked(t, h, names[i], name_len, values[i],
+                            strlen(values[i]));
+        } else {
+            hash_remove_locked(t, h, names[i], name_len);
+        }
+        grow = hash_overloaded(t);
+        pthread_rwlock_unlock(stripe);
+
+        if (grow) hash_grow(t, 0);
+    }
+}
+
+static int name_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Entries are freed as soon as they are removed, so the view is a copy:
+ * every pair is copied, as name and value back to back, into one block
+ * with all stripes read-locked, and sorted once they are released. */
+static int hash_view(void *db, db_view_t *view) {
+    hash_t *t = db;
+    size_t size = 0;
+    char *copy, *p;
+    int n = 0;
+
+    lock_all(t, 0);
+
+    for (size_t i = 0; i < t->nbuckets; i++) {
+        for (entry_t *e = t->buckets[i]; e != 0; e = e->next) {
+            size += e->name_len + e->value_len + 2;
+        }
+    }
+    copy = (char *)malloc(size + 1);
+    view->names = (char **)malloc((t->count + 1) * sizeof(char *));
+    view->values = (char **)malloc((t->count + 1) * sizeof(char *));
+    if (copy == 0 || view->names == 0 || view->values == 0) {
+        unlock_all(t);
+        free(copy);
+        free(view->names);
+        free(view->values);
+        return -1;
+    }
+
+    p = copy;
+    for (size_t i = 0; i < t->nbuckets; i++) {
+        for (entry_t *e = t->buckets[i]; e != 0; e = e->next) {
+            size_t len = e->name_len + e->value_len + 2;
+
+            memcpy(p, e->name, len);
+            view->names[n++] = p;
+            p += len;
+        }
+    }
+
+    unlock_all(t);
+
+    qsort(view->names, n, sizeof(char *), name_compare);
+    for (int i = 0; i < n; i++) {
+        view->values[i] = view->names[i] + strlen(view->names[i]) + 1;
+    }
+    view->n = n;
+    view->handle = copy;
+    return 0;
+}
+
+static void hash_release(void *db, db_view_t *view) {
+    (void)db;
+    free(view->handle);
+    free(view->names);
+    free(view->values);
+}
+
+/* Prints every pair, one per line, sorted by name. The stripes are only
+ * read-locked while the pairs are copied (see hash_view), not while they
+ * are written out. */
+static void hash_print(void *db, FILE *out) {
+    db_view_t view;
+
+    if (hash_view(db, &view) < 0) return;
+    for (int i = 0; i < view.n; i++) {
+        fprintf(out, "%s %s\n", view.names[i], view.values[i]);
+    }
+    hash_release(db, &view);
+}
+
+static void hash_clear(void *db) {
+    hash_t *t = db;
+
+    for (size_t i = 0; i < t->nbuckets; i++) {
+        entry_t *e = t->buckets[i];
+        while (e != 0) {
+            entry_t *next = e->next;
+            entry_destructor(e);
+            e = next;
+        }
+        t->buckets[i] = 0;
+    }
+    t->count = 0;
+}
+
+static void hash_destroy(void *db) {
+    hash_t *t = db;
+
+    hash_clear(t);
+    for (int i = 0; i < NSTRIPES; i++) {
+        pthread_rwlock_destroy(&t->stripes[i]);
+    }
+    free(t->buckets);
+    free(t);
+}
+
+static int hash_height(void *db) {
+    hash_t *t = db;
+    int longest = 0;
+
+    lock_all(t, 0);
+    for (size_t i = 0; i < t->nbuckets; i++) {
+        int len = 0;
+        for (entry_t *e = t->buckets[i]; e != 0; e = e->next) len++;
+        if (len > longest) longest = len;
+    }
+    unlock_all(t);
+
+    return longest;
+}
+
+static int hash_count(void *db) {
+    hash_t *t = db;
+
+    return __atomic_load_n(&t->count, __ATOMIC_RELAXED);
+}
+
+const db_engine_t hash_engine = {
+    .name = "hash",
+    .create = hash_create,
+    .query = hash_query,
+    .add = hash_add,
+    .remove = hash_remove,
+    .query_many = hash_query_many,
+    .add_many = hash_add_many,
+    .remove_many = hash_remove_many,
+    .scan = hash_scan,
+    .load = hash_load,
+    .view = hash_view,
+    .release = hash_release,
+    .print = hash_print,
+    .clear = hash_clear,
+    .destroy = hash_destroy,
+    .height = hash_height,
+    .count = hash_count,
+};
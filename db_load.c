@@ -0,0 +1,410 @@
+#include "./db_load.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./db.h"
+#include "./scan.h"
+
+#define MAXLOADERS 16           // parser threads
+#define MIN_CHUNK (256 * 1024)  // bytes a parser thread is worth starting for
+#define RECENT 65536            // names a chunk remembers, a power of two
+
+/* The net change of a run of adds and deletes of one name. */
+typedef struct change {
+    uint64_t prefix;  // the first bytes of name, big-endian, to sort by
+    char *name;
+    char *value;  // for LOAD_ADD and LOAD_PUT
+    int op;
+    size_t name_len;
+    size_t seq;  // position in the chunk, to keep runs of a name in order
+} change_t;
+
+typedef struct chunk {
+    const char *start, *end;  // whole lines of the file
+    char *strings;            // NUL-terminated copies of names and values
+    size_t used;
+    change_t *changes;  // in order of appearance
+    size_t n, cap;
+    // Recently seen names, by hash: hash << 32 | index + 1 of the newest
+    // change to the name, or 0. A name found here has its change folded
+    // into that one; others start a new change. Duplicates that slip
+    // through are folded after sorting.
+    uint64_t *recent;
+    int sequential;  // found a line that needs LOAD_SEQUENTIAL
+    int failed;      // ran out of memory
+} chunk_t;
+
+/* Folds a later add (LOAD_ADD) or delete (LOAD_DELETE) of the same name,
+ * or the net change of a later chunk, into c. An add after a delete
+ * replaces whatever value there was; an add without a delete before it is
+ * a no-op, since the name is present by then. */
+static void change_fold(change_t *c, int op, char *value) {
+    if (op == LOAD_ADD && c->op != LOAD_DELETE) return;
+    c->op = op == LOAD_ADD ? LOAD_PUT : op;
+    c->value = value;
+}
+
+static int name_compare(const change_t *x, const change_t *y) {
+    if (x->prefix != y->prefix) return x->prefix < y->prefix ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+static int change_compare(const void *a, const void *b) {
+    const change_t *x = a, *y = b;
+    int cmp = name_compare(x, y);
+
+    if (cmp != 0) return cmp;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Packs the first eight bytes of name, zero-padded, so that comparing two
+ * prefixes agrees with strcmp wherever they differ. */
+static uint64_t name_prefix(const char *name, size_t len) {
+    uint64_t p = 0;
+
+    for (size_t i = 0; i < 8; i++) {
+        p = p << 8 | (i < len ? (unsigned char)name[i] : 0);
+    }
+    return p;
+}
+
+/* FNV-1a */
+static unsigned int hash_string(const char *p, size_t len) {
+    unsigned int h = 2166136261u;
+
+    while (len-- > 0) {
+        h ^= (unsigned char)*p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Copies the string p..p+len-1 to the chunk's strings and returns the
+ * copy. There is always room: no byte of the chunk is copied twice. */
+static char *chunk_string(chunk_t *c, const char *p, size_t len) {
+    char *s = c->strings + c->used;
+
+    memcpy(s, p, len);
+    s[len] = '\0';
+    c->used += len + 1;
+    return s;
+}
+
+/* Records an add of name (with value) or a delete of it (value 0). */
+static void chunk_change(chunk_t *c, const char *name, size_t name_len,
+                         const char *value, size_t value_len) {
+    unsigned int h = hash_string(name, name_len);
+    uint64_t *slot = &c->recent[h & (RECENT - 1)];
+    int op = value ? LOAD_ADD : LOAD_DELETE;
+    change_t *ch;
+
+    if (*slot >> 32 == h && *slot != 0) {
+        ch = &c->changes[(uint32_t)*slot - 1];
+        if (ch->name_len == name_len && memcmp(ch->name, name, name_len) == 0) {
+            // (only copy the value if it is going to be used)
+            if (op == LOAD_DELETE) {
+                change_fold(ch, op, 0);
+            } else if (ch->op == LOAD_DELETE) {
+                change_fold(ch, op, chunk_string(c, value, value_len));
+            }
+            return;
+        }
+    }
+
+    if (c->n == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 1024;
+        change_t *changes =
+            (change_t *)realloc(c->changes, cap * sizeof(change_t));
+
+        if (changes == 0 || c->n == UINT32_MAX) {  // see recent
+            c->failed = 1;
+            return;
+        }
+        c->changes = changes;
+        c->cap = cap;
+    }
+
+    ch = &c->changes[c->n];
+    ch->prefix = name_prefix(name, name_len);
+    ch->name = chunk_string(c, name, name_len);
+    ch->value = value ? chunk_string(c, value, value_len) : 0;
+    ch->op = op;
+    ch->name_len = name_len;
+    ch->seq = c->n++;
+    *slot = (uint64_t)h << 32 | c->n;
+}
+
+/* isspace in the C locale, which is what sscanf goes by */
+static const unsigned char is_space[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1,
+};
+
+/* Finds the next word of p..end-1 the way sscanf's "%255s" does: after any
+ * whitespace, at most MAXLEN-1 non-whitespace bytes. Returns its length
+ * (0 if there is none) and advances *p past it. */
+static size_t scan_word(const char **p, const char *end, const char **word) {
+    const unsigned char *s = (const unsigned char *)*p;
+    const unsigned char *e = (const unsigned char *)end;
+    const unsigned char *w;
+
+    while (s < e && is_space[*s]) s++;
+    w = s;
+    if (e - w > MAXLEN - 1) e = w + MAXLEN - 1;
+    s = (const unsigned char *)scan_space((const char *)w, (const char *)e);
+    *word = (const char *)w;
+    *p = (const char *)s;
+    return s - w;
+}
+
+/* interpret_batch's delimiters */
+static inline int is_delimiter(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+/* Finds the next token of p..end-1 the way interpret_batch's strtok_r
+ * does. */
+static size_t scan_token(const char **p, const char *end, const char **tok) {
+    const char *s = *p;
+
+    while (s < end && is_delimiter(*s)) s++;
+    *tok = s;
+    // every delimiter is whitespace, but '\v' and '\f' are not delimiters
+    while ((s = scan_space(s, end)) < end && !is_delimiter(*s)) s++;
+    *p = s;
+    return s - *tok;
+}
+
+/* Parses a batch line, "ma name value ..." or "md name ...". Like
+ * interpret_batch, a batch with any bad part does nothing. */
+static void parse_batch(chunk_t *c, const char *p, const char *end) {
+    const char *toks[2 * MAXBATCH];
+    size_t lens[2 * MAXBATCH];
+    size_t len;
+    const char *tok;
+    char verb = p[1];
+    int ntok = 0;
+
+    for (p += 2; (len = scan_token(&p, end, &tok)) > 0; ntok++) {
+        if (ntok == MAXBATCH * (verb == 'a' ? 2 : 1) || len >= MAXLEN) return;
+        toks[ntok] = tok;
+        lens[ntok] = len;
+    }
+    if (ntok == 0 || (verb == 'a' && ntok % 2)) return;
+
+    for (int i = 0; i < ntok; i += verb == 'a' ? 2 : 1) {
+        if (verb == 'a') {
+            chunk_change(c, toks[i], lens[i], toks[i + 1], lens[i + 1]);
+        } else {
+            chunk_change(c, toks[i], lens[i], 0, 0);
+        }
+    }
+}
+
+/* Parses the line p..end-1 (without its newline) as interpret_command
+ * would execute it, recording the adds and deletes it makes. */
+static void parse_line(chunk_t *c, const char *p, const char *end) {
+    const char *name, *value, *s = p + 1;
+    size_t name_len, value_len;
+
+    switch (*p) {
+        case 'a':
+            name_len = scan_word(&s, end, &name);
+            value_len = scan_word(&s, end, &value);
+            if (value_len > 0)
+                chunk_change(c, name, name_len, value, value_len);
+            return;
+
+        case 'd':
+            if ((name_len = scan_word(&s, end, &name)) > 0)
+                chunk_change(c, name, name_len, 0, 0);
+            return;
+
+        case 'f':
+            // another file, which has to be run right here, in line order
+            if (scan_word(&s, end, &name) > 0) c->sequential = 1;
+            return;
+
+        case 'm':
+            if (end - p > 1 && (p[1] == 'a' || p[1] == 'd'))
+                parse_batch(c, p, end);
+            return;
+
+        default:
+            // queries, and ill-formed lines, change nothing
+            return;
+    }
+}
+
+/* Parses the lines of a chunk into changes, sorted by name and then by
+ * position. */
+static void *parse_chunk(void *arg) {
+    chunk_t *c = arg;
+    const char *p = c->start;
+
+    c->recent = (uint64_t *)calloc(RECENT, sizeof(uint64_t));
+    c->strings = (char *)malloc(2 * (c->end - c->start) + 1);
+    if (c->recent == 0 || c->strings == 0) {
+        c->failed = 1;
+        return 0;
+    }
+
+    while (p < c->end && !c->sequential && !c->failed) {
+        // a command ends at a NUL, but the next one only after the newline
+        const char *eol = scan_line(p, c->end);
+        const char *nl = eol < c->end && *eol == '\0'
+                             ? memchr(eol, '\n', c->end - eol)
+                             : eol;
+        const char *next = nl && nl < c->end ? nl + 1 : c->end;
+
+        // fgets would cut this one into several commands
+        if (next - p > MAXCMD - 1) {
+            c->sequential = 1;
+            break;
+        }
+
+        parse_line(c, p, eol);
+        p = next;
+    }
+
+    if (!c->sequential && !c->failed)
+        qsort(c->changes, c->n, sizeof(change_t), change_compare);
+    return 0;
+}
+
+/* Merges the chunks' changes, folding those to the same name together in
+ * file order (a chunk's changes to a name come in order, and on a tie the
+ * earlier chunk goes first). Returns the number of names. */
+static int merge_changes(chunk_t *chunks, int nchunks, char **names,
+                         char **values, int *ops) {
+    size_t next[MAXLOADERS] = {0};
+    change_t merged;
+    int m = 0;
+
+    for (;;) {
+        change_t *c = 0;
+        int best = -1;
+
+        for (int i = 0; i < nchunks; i++) {
+            if (next[i] == chunks[i].n) continue;
+            if (c == 0 || name_compare(&chunks[i].changes[next[i]], c) < 0) {
+                best = i;
+                c = &chunks[i].changes[next[i]];
+            }
+        }
+        if (c == 0) return m;
+        next[best]++;
+
+        if (m > 0 && strcmp(names[m - 1], c->name) == 0) {
+            merged.op = ops[m - 1];
+            merged.value = values[m - 1];
+            change_fold(&merged, c->op, c->value);
+            m--;
+        } else {
+            merged = *c;
+        }
+        names[m] = c->name;
+        values[m] = merged.value;
+        ops[m++] = merged.op;
+    }
+}
+
+/* Applies the commands in the file through apply. Returns LOAD_DONE,
+ * LOAD_BAD_FILE, or LOAD_SEQUENTIAL if the caller has to execute the file
+ * itself (the database is untouched then). */
+int load_file(const char *filename, load_apply_t apply) {
+    chunk_t chunks[MAXLOADERS];
+    pthread_t threads[MAXLOADERS];
+    int started[MAXLOADERS];
+    char **names = 0, **values = 0;
+    int *ops = 0;
+    size_t size, total = 0;
+    const char *map;
+    struct stat st;
+    int fd, nchunks, cancel_state, ret = LOAD_DONE;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ((fd = open(filename, O_RDONLY)) < 0) return LOAD_BAD_FILE;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return LOAD_BAD_FILE;
+    }
+    if ((size = st.st_size) == 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return size == 0 && S_ISREG(st.st_mode) ? LOAD_DONE : LOAD_SEQUENTIAL;
+    }
+    map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return LOAD_SEQUENTIAL;
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+
+    // the load runs to completion, or a cancelled client would leak it
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+    nchunks = size / MIN_CHUNK + 1;
+    if (nchunks > ncpus) nchunks = ncpus > 0 ? ncpus : 1;
+    if (nchunks > MAXLOADERS) nchunks = MAXLOADERS;
+
+    // cut the file at the first line break after each share
+    memset(chunks, 0, sizeof(chunks));
+    for (int i = 0; i < nchunks; i++) {
+        const char *share = map + size / nchunks * (i + 1);
+        const char *eol;
+
+        chunks[i].start = i == 0 ? map : chunks[i - 1].end;
+        if (i == nchunks - 1) {
+            chunks[i].end = map + size;
+        } else if (share < chunks[i].start) {
+            chunks[i].end = chunks[i].start;  // the last line was long
+        } else {
+            eol = memchr(share, '\n', map + size - share);
+            chunks[i].end = eol ? eol + 1 : map + size;
+        }
+    }
+
+    for (int i = 1; i < nchunks; i++) {
+        started[i] =
+            pthread_create(&threads[i], 0, parse_chunk, &chunks[i]) == 0;
+        if (!started[i]) parse_chunk(&chunks[i]);
+    }
+    parse_chunk(&chunks[0]);
+    for (int i = 1; i < nchunks; i++) {
+        if (started[i]) pthread_join(threads[i], 0);
+    }
+
+    for (int i = 0; i < nchunks; i++) {
+        if (chunks[i].sequential || chunks[i].failed) ret = LOAD_SEQUENTIAL;
+        total += chunks[i].n;
+    }
+
+    if (ret == LOAD_DONE && total > 0) {
+        names = (char **)malloc(total * sizeof(char *));
+        values = (char **)malloc(total * sizeof(char *));
+        ops = (int *)malloc(total * sizeof(int));
+
+        if (names == 0 || values == 0 || ops == 0) {
+            ret = LOAD_SEQUENTIAL;
+        } else {
+            apply(merge_changes(chunks, nchunks, names, values, ops), names,
+                  values, ops);
+        }
+    }
+
+    free(names);
+    free(values);
+    free(ops);
+    for (int i = 0; i < nchunks; i++) {
+        free(chunks[i].strings);
+        free(chunks[i].changes);
+        free(chunks[i].recent);
+    }
+    munmap((void *)map, size);
+    pthread_setcancelstate(cancel_state, 0);
+
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef DB_LOAD_H_
+#define DB_LOAD_H_
+
+#include "./db_engine.h"
+
+/*
+ * Bulk loading for the "f" command. The file is mapped into memory and cut
+ * into chunks of whole lines, which are parsed by one thread each. Every
+ * add and delete the file makes is reduced, per name, to its net effect
+ * (taking the order of the lines into account), and the resulting sorted
+ * list of changes is handed to the caller's apply function in one go. The
+ * database ends up exactly as if the lines had been executed one by one;
+ * queries are skipped, as they change nothing.
+ *
+ * Files with a line the bulk path doesn't handle (one that runs another
+ * file, or one too long to be a single command) are left to the caller.
+ */
+
+#define LOAD_DONE 0
+#define LOAD_BAD_FILE -1   // the file could not be opened
+#define LOAD_SEQUENTIAL 1  // the file has to be executed line by line
+
+/* Applies n changes as the engine's load operation does (see db_engine.h). */
+typedef void (*load_apply_t)(int n, char **names, char **values, int *ops);
+
+extern int load_file(const char *filename, load_apply_t apply);
+
+#endif  // DB_LOAD_H_
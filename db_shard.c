@@ -0,0 +1,456 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./db.h"
+#include "./db_engine.h"
+
+/*
+ * The sharded database: the names are split by hash into a fixed number of
+ * shards, each an independent database of an inner engine with its own
+ * locks, so that writers to different shards never wait on each other.
+ * A name only ever lives in one shard, so everything the engines promise
+ * about a single name holds as it did. Operations on several names are
+ * split up by shard, and those that return pairs in order (scan, view,
+ * print) merge what the shards return.
+ */
+
+typedef struct shard {
+    const db_engine_t *inner;
+    int n;
+    void *dbs[MAXSHARDS];
+} shard_t;
+
+/* FNV-1a, as the hash engine uses, which picks its buckets and stripes by
+ * the low bits; the shard is picked by the high bits so that each shard
+ * still spreads its names over all of them. */
+static int shard_of(shard_t *s, const char *name, int name_len) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for (int i = 0; i < name_len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return (int)((h >> 32) % s->n);
+}
+
+/* Creates a database of n shards (1 <= n <= MAXSHARDS) of the inner engine.
+ * Returns 0 if n is out of range or memory runs out. */
+void *shard_create(const db_engine_t *inner, int n) {
+    shard_t *s;
+
+    if (n < 1 || n > MAXSHARDS) return 0;
+    if ((s = (shard_t *)malloc(sizeof(shard_t))) == 0) return 0;
+    s->inner = inner;
+    s->n = n;
+    for (int i = 0; i < n; i++) {
+        if ((s->dbs[i] = inner->create()) == 0) {
+            while (--i >= 0) inner->destroy(s->dbs[i]);
+            free(s);
+            return 0;
+        }
+    }
+    return s;
+}
+
+static int shard_query(void *db, const char *name, int name_len,
+                       char *result, int len) {
+    shard_t *s = db;
+
+    return s->inner->query(s->dbs[shard_of(s, name, name_len)], name,
+                           name_len, result, len);
+}
+
+static int shard_add(void *db, const char *name, int name_len,
+                     const char *value, int value_len) {
+    shard_t *s = db;
+
+    return s->inner->add(s->dbs[shard_of(s, name, name_len)], name, name_len,
+                         value, value_len);
+}
+
+static int shard_remove(void *db, const char *name, int name_len) {
+    shard_t *s = db;
+
+    return s->inner->remove(s->dbs[shard_of(s, name, name_len)], name,
+                            name_len);
+}
+
+/* The n names of a batch, grouped by shard: index[start[i]] to
+ * index[start[i + 1] - 1] are the positions in the batch of the names that
+ * belong to shard i, in batch order, so that a name that occurs twice still
+ * sees its first occurrence. */
+typedef struct split {
+    int start[MAXSHARDS + 1];
+    int index[MAXBATCH];
+} split_t;
+
+static void split_batch(shard_t *s, int n, char **names, split_t *sp) {
+    int shard[MAXBATCH];
+
+    memset(sp->start, 0, sizeof(sp->start));
+    for (int i = 0; i < n; i++) {
+        shard[i] = shard_of(s, names[i], strlen(names[i]));
+        sp->start[shard[i] + 1]++;
+    }
+    for (int i = 0; i < s->n; i++) sp->start[i + 1] += sp->start[i];
+
+    int next[MAXSHARDS];
+    memcpy(next, sp->start, sizeof(next));
+    for (int i = 0; i < n; i++) sp->index[next[shard[i]]++] = i;
+}
+
+static void shard_query_many(void *db, int n, char **names, char **results,
+                             int len, int *found) {
+    shard_t *s = db;
+    char *sub_names[MAXBATCH], *sub_results[MAXBATCH];
+    int sub_found[MAXBATCH];
+    split_t sp;
+
+    split_batch(s, n, names, &sp);
+    for (int i = 0; i < s->n; i++) {
+        int m = sp.start[i + 1] - sp.start[i];
+        int *index = &sp.index[sp.start[i]];
+
+        if (m == 0) continue;
+        for (int j = 0; j < m; j++) {
+            sub_names[j] = names[index[j]];
+            sub_results[j] = results[index[j]];
+        }
+        s->inner->query_many(s->dbs[i], m, sub_names, sub_results, len,
+                             sub_found);
+        for (int j = 0; j < m; j++) found[index[j]] = sub_found[j];
+    }
+}
+
+static void shard_add_many(void *db, int n, char **names, char **values,
+                           int *added) {
+    shard_t *s = db;
+    char *sub_names[MAXBATCH], *sub_values[MAXBATCH];
+    int sub_added[MAXBATCH];
+    split_t sp;
+
+    split_batch(s, n, names, &sp);
+    for (int i = 0; i < s->n; i++) {
+        int m = sp.start[i + 1] - sp.start[i];
+        int *index = &sp.index[sp.start[i]];
+
+        if (m == 0) continue;
+        for (int j = 0; j < m; j++) {
+            sub_names[j] = names[index[j]];
+            sub_values[j] = values[index[j]];
+        }
+        s->inner->add_many(s->dbs[i], m, sub_names, sub_values, sub_added);
+        for (int j = 0; j < m; j++) added[index[j]] = sub_added[j];
+    }
+}
+
+static void shard_remove_many(void *db, int n, char **names, int *removed) {
+    shard_t *s = db;
+    char *sub_names[MAXBATCH];
+    int sub_removed[MAXBATCH];
+    split_t sp;
+
+    split_batch(s, n, names, &sp);
+    for (int i = 0; i < s->n; i++) {
+        int m = sp.start[i + 1] - sp.start[i];
+        int *index = &sp.index[sp.start[i]];
+
+        if (m == 0) continue;
+        for (int j = 0; j < m; j++) sub_names[j] = names[index[j]];
+        s->inner->remove_many(s->dbs[i], m, sub_names, sub_removed);
+        for (int j = 0; j < m; j++) removed[index[j]] = sub_removed[j];
+    }
+}
+
+/* A min-heap of the lists being merged, keyed by the name each is up to. */
+typedef struct heap {
+    int size;
+    int list[MAXSHARDS];
+    int pos[MAXSHARDS];
+    char ***names;
+} heap_t;
+
+#define heap_name(hp, i) \
+    ((hp)->names[(hp)->list[i]][(hp)->pos[(hp)->list[i]]])
+
+static void sift_down(heap_t *hp, int i) {
+    for (;;) {
+        int least = i, l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < hp->size &&
+            strcmp(heap_name(hp, l), heap_name(hp, least)) < 0)
+            least = l;
+        if (r < hp->size &&
+            strcmp(heap_name(hp, r), heap_name(hp, least)) < 0)
+            least = r;
+        if (least == i) return;
+
+        int tmp = hp->list[i];
+        hp->list[i] = hp->list[least];
+        hp->list[least] = tmp;
+        i = least;
+    }
+}
+
+/* Merges k sorted lists of pairs (list i has counts[i] pairs in names[i]
+ * and values[i]) into out_names and out_values, up to limit pairs, and
+ * returns how many it merged. */
+static int merge(int k, int *counts, char ***names, char ***values,
+                 long limit, char **out_names, char **out_values) {
+    heap_t hp;
+    int n = 0;
+
+    hp.size = 0;
+    hp.names = names;
+    for (int i = 0; i < k; i++) {
+        hp.pos[i] = 0;
+        if (counts[i] > 0) hp.list[hp.size++] = i;
+    }
+    for (int i = hp.size / 2 - 1; i >= 0; i--) sift_down(&hp, i);
+
+    while (hp.size > 0 && n < limit) {
+        int l = hp.list[0];
+
+        out_names[n] = names[l][hp.pos[l]];
+        out_values[n++] = values[l][hp.pos[l]++];
+        if (hp.pos[l] == counts[l]) hp.list[0] = hp.list[--hp.size];
+        sift_down(&hp, 0);
+    }
+    return n;
+}
+
+/* Asks every shard for the first chunk of its pairs in the range, a chunk
+ * sized for its share of the n wanted, and merges them, asking a shard for
+ * its next chunk should it run out before n pairs are found. */
+static int shard_scan(void *db, char *from, char *to, int n, char **names,
+                      char **values, int len) {
+    shard_t *s = db;
+    char **sub_names[MAXSHARDS], **sub_values[MAXSHARDS];
+    int counts[MAXSHARDS];
+    char **ptrs, *bufs;
+    heap_t hp;
+    int chunk, m = 0;
+
+    if (n <= 0) return 0;
+    // the names are spread evenly by hash, so twice a shard's share (and
+    // a few more) is rarely used up
+    chunk = (n + s->n - 1) / s->n * 2 + 4;
+    if (chunk > n) chunk = n;
+    ptrs = (char **)malloc((size_t)s->n * chunk * 2 * sizeof(char *));
+    bufs = (char *)malloc((size_t)s->n * chunk * 2 * len);
+    if (ptrs == 0 || bufs == 0) {
+        free(ptrs);
+        free(bufs);
+        return 0;
+    }
+
+    hp.size = 0;
+    hp.names = sub_names;
+    for (int i = 0; i < s->n; i++) {
+        sub_names[i] = &ptrs[(size_t)i * chunk * 2];
+        sub_values[i] = sub_names[i] + chunk;
+        for (int j = 0; j < chunk; j++) {
+            sub_names[i][j] = &bufs[((size_t)i * chunk * 2 + j) * len];
+            sub_values[i][j] = &bufs[((size_t)i * chunk * 2 + chunk + j) * len];
+        }
+        counts[i] = s->inner->scan(s->dbs[i], from, to, chunk, sub_names[i],
+                                   sub_values[i], len);
+        hp.pos[i] = 0;
+        if (counts[i] > 0) hp.list[hp.size++] = i;
+    }
+    for (int i = hp.size / 2 - 1; i >= 0; i--) sift_down(&hp, i);
+
+    while (hp.size > 0 && m < n) {
+        int l = hp.list[0];
+
+        strcpy(names[m], sub_names[l][hp.pos[l]]);
+        strcpy(values[m++], sub_values[l][hp.pos[l]++]);
+        if (hp.pos[l] == counts[l] && counts[l] == chunk && m < n) {
+            // the next chunk starts from the name just taken, which
+            // (unless it has since gone) comes back first
+            counts[l] = s->inner->scan(s->dbs[l], names[m - 1], to, chunk,
+                                       sub_names[l], sub_values[l], len);
+            hp.pos[l] = 0;
+            while (hp.pos[l] < counts[l] &&
+                   strcmp(sub_names[l][hp.pos[l]], names[m - 1]) <= 0)
+                hp.pos[l]++;
+        }
+        if (hp.pos[l] == counts[l]) hp.list[0] = hp.list[--hp.size];
+        sift_down(&hp, 0);
+    }
+
+    free(ptrs);
+    free(bufs);
+    return m;
+}
+
+/* Splits the sorted changes of a load by shard; each list stays sorted. */
+static void shard_load(void *db, int n, char **names, char **values,
+                       int *ops) {
+    shard_t *s = db;
+    char **sub_names, **sub_values;
+    int *sub_ops, *shard;
+    int start[MAXSHARDS + 1], next[MAXSHARDS];
+
+    sub_names = (char **)malloc((n + 1) * sizeof(char *));
+    sub_values = (char **)malloc((n + 1) * sizeof(char *));
+    sub_ops = (int *)malloc((n + 1) * sizeof(int));
+    shard = (int *)malloc((n + 1) * sizeof(int));
+    if (sub_names == 0 || sub_values == 0 || sub_ops == 0 || shard == 0) {
+        // one change at a time, then
+        free(sub_names);
+        free(sub_values);
+        free(sub_ops);
+        free(shard);
+        for (int i = 0; i < n; i++) {
+            int j = shard_of(s, names[i], strlen(names[i]));
+            s->inner->load(s->dbs[j], 1, &names[i], &values[i], &ops[i]);
+        }
+        return;
+    }
+
+    memset(start, 0, sizeof(start));
+    for (int i = 0; i < n; i++) {
+        shard[i] = shard_of(s, names[i], strlen(names[i]));
+        start[shard[i] + 1]++;
+    }
+    for (int i = 0; i < s->n; i++) start[i + 1] += start[i];
+    memcpy(next, start, sizeof(next));
+    for (int i = 0; i < n; i++) {
+        int j = next[shard[i]]++;
+
+        sub_names[j] = names[i];
+        sub_values[j] = values[i];
+        sub_ops[j] = ops[i];
+    }
+
+    for (int i = 0; i < s->n; i++) {
+        if (start[i + 1] > start[i]) {
+            s->inner->load(s->dbs[i], start[i + 1] - start[i],
+                           &sub_names[start[i]], &sub_values[start[i]],
+                           &sub_ops[start[i]]);
+        }
+    }
+
+    free(sub_names);
+    free(sub_values);
+    free(sub_ops);
+    free(shard);
+}
+
+/* The shards' views are taken one after the other, so the pairs of
+ * different shards may be from different moments; each name still has the
+ * value it had at one moment, which is all a checkpoint needs (see wal.h). */
+static int shard_view(void *db, db_view_t *view) {
+    shard_t *s = db;
+    db_view_t *views;
+    char **sub_names[MAXSHARDS], **sub_values[MAXSHARDS];
+    int counts[MAXSHARDS];
+    long total = 0;
+    int taken;
+
+    if ((views = (db_view_t *)malloc(s->n * sizeof(db_view_t))) == 0)
+        return -1;
+    for (taken = 0; taken < s->n; taken++) {
+        if (s->inner->view(s->dbs[taken], &views[taken]) < 0) break;
+        sub_names[taken] = views[taken].names;
+        sub_values[taken] = views[taken].values;
+        counts[taken] = views[taken].n;
+        total += views[taken].n;
+    }
+
+    view->names = 0;
+    view->values = 0;
+    if (taken == s->n) {
+        view->names = (char **)malloc((total + 1) * sizeof(char *));
+        view->values = (char **)malloc((total + 1) * sizeof(char *));
+    }
+    if (view->names == 0 || view->values == 0) {
+        free(view->names);
+        free(view->values);
+        while (taken-- > 0) s->inner->release(s->dbs[taken], &views[taken]);
+        free(views);
+        return -1;
+    }
+
+    view->n = merge(s->n, counts, sub_names, sub_values, total, view->names,
+                    view->values);
+    view->handle = views;
+    return 0;
+}
+
+static void shard_release(void *db, db_view_t *view) {
+    shard_t *s = db;
+    db_view_t *views = view->handle;
+
+    for (int i = 0; i < s->n; i++) s->inner->release(s->dbs[i], &views[i]);
+    free(views);
+    free(view->names);
+    free(view->values);
+}
+
+/* Prints every pair, one per line, sorted by name, whatever the inner
+ * engine's own format is. */
+static void shard_print(void *db, FILE *out) {
+    db_view_t view;
+
+    if (shard_view(db, &view) < 0) return;
+    for (int i = 0; i < view.n; i++) {
+        fprintf(out, "%s %s\n", view.names[i], view.values[i]);
+    }
+    shard_release(db, &view);
+}
+
+static void shard_clear(void *db) {
+    shard_t *s = db;
+
+    for (int i = 0; i < s->n; i++) s->inner->clear(s->dbs[i]);
+}
+
+static void shard_destroy(void *db) {
+    shard_t *s = db;
+
+    for (int i = 0; i < s->n; i++) s->inner->destroy(s->dbs[i]);
+    free(s);
+}
+
+static int shard_height(void *db) {
+    shard_t *s = db;
+    int height = 0;
+
+    for (int i = 0; i < s->n; i++) {
+        int h = s->inner->height(s->dbs[i]);
+        if (h > height) height = h;
+    }
+    return height;
+}
+
+static int shard_count(void *db) {
+    shard_t *s = db;
+    int count = 0;
+
+    for (int i = 0; i < s->n; i++) count += s->inner->count(s->dbs[i]);
+    return count;
+}
+
+// create is shard_create, which needs the inner engine and shard count
+const db_engine_t shard_engine = {
+    .name = "shard",
+    .create = 0,
+    .query = shard_query,
+    .add = shard_add,
+    .remove = shard_remove,
+    .query_many = shard_query_many,
+    .add_many = shard_add_many,
+    .remove_many = shard_remove_many,
+    .scan = shard_scan,
+    .load = shard_load,
+    .view = shard_view,
+    .release = shard_release,
+    .print = shard_print,
+    .clear = shard_clear,
+    .destroy = shard_destroy,
+    .height = shard_height,
+    .count = shard_count,
+};
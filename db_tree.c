@@ -0,0 +1,952 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./db.h"
+#include "./db_engine.h"
+#include "./epoch.h"
+#include "./slab.h"
+#include "./stats.h"
+
+/*
+ * The "tree" storage engine: an AVL-balanced binary search tree ordered by
+ * strcmp. Names are compared with memcmp and their lengths, which every
+ * node keeps, so a lookup never scans for a terminator.
+ *
+ * Lookups take no locks. They run inside an epoch critical section (see
+ * epoch.h) and just follow child pointers. Writers serialize on the tree's
+ * write_mutex and never change anything a reader could trip over: a node's
+ * name and value are fixed once it has been published, and every change to
+ * the shape of the tree becomes visible through a single pointer store.
+ * Rotations build fresh copies of the nodes they move and then swing the
+ * parent's pointer over to the copies; a reader still inside the old nodes
+ * finds the very same subtrees below them. Nodes that have been replaced
+ * or removed are retired and freed once no reader can still be holding
+ * them.
+ *
+ * A node and its name and value are a single slab block (see slab.h): the
+ * two strings follow the header, each with its terminator, so creating,
+ * copying or freeing a node is one allocator call.
+ *
+ * Snapshots (for print and view) cost O(1): the root is noted and the
+ * generation moves on. Until the snapshot is released, writers treat the
+ * nodes of older generations as frozen. They copy such a node before
+ * changing it, the same way rotations do, and keep the ones they drop
+ * from being freed.
+ */
+
+typedef struct node {
+    struct node *lchild;
+    struct node *rchild;
+    int lheight;  // height of the left subtree (only used by writers)
+    int rheight;  // height of the right subtree (only used by writers)
+    unsigned short name_len;
+    unsigned short value_len;
+    unsigned int gen;  // generation the node was made in
+    char name[];       // name, then value
+} node_t;
+
+#define node_value(node) ((node)->name + (node)->name_len + 1)
+
+typedef struct tree {
+    // The root node of the binary tree. Unlike all other nodes in the tree,
+    // this one is never freed, and its name is the empty string, so every
+    // real name sorts into its right subtree.
+    node_t *head;
+    pthread_mutex_t write_mutex;
+    int count;  // number of entries (protected by write_mutex)
+
+    // Snapshots, one at a time: snapshot_mutex is held for as long as one
+    // is in use. The rest is protected by write_mutex.
+    pthread_mutex_t snapshot_mutex;
+    unsigned int gen;       // generation of the nodes being made
+    unsigned int snap_gen;  // last frozen generation, 0 without a snapshot
+    node_t **dropped;       // frozen nodes that have left the tree
+    size_t ndropped, dropped_cap;
+} tree_t;
+
+static inline int node_height(node_t *node) {
+    return 1 + (node->lheight > node->rheight ? node->lheight : node->rheight);
+}
+
+static inline int node_balance(node_t *node) {
+    return node->lheight - node->rheight;
+}
+
+static inline size_t node_size(node_t *node) {
+    return sizeof(node_t) + node->name_len + node->value_len + 2;
+}
+
+static inline int node_frozen(tree_t *t, node_t *node) {
+    return node->gen <= t->snap_gen;
+}
+
+/* Compares name (name_len bytes) with the node's name, as strcmp would. */
+static inline int name_cmp(const char *name, int name_len, node_t *node) {
+    int cmp = memcmp(name, node->name,
+                     name_len < node->name_len ? name_len : node->name_len);
+
+    return cmp != 0 ? cmp : name_len - node->name_len;
+}
+
+static node_t *node_constructor(tree_t *t, const char *arg_name,
+                                int name_len, const char *arg_value,
+                                int val_len, node_t *arg_left,
+                                node_t *arg_right) {
+    if (name_len > MAXLEN || val_len > MAXLEN) return 0;
+
+    node_t *new_node =
+        (node_t *)slab_alloc(sizeof(node_t) + name_len + val_len + 2);
+
+    if (new_node == 0) return 0;
+
+    new_node->name_len = name_len;
+    new_node->value_len = val_len;
+    new_node->gen = t->gen;
+    memcpy(new_node->name, arg_name, name_len);
+    new_node->name[name_len] = '\0';
+    memcpy(node_value(new_node), arg_value, val_len);
+    node_value(new_node)[val_len] = '\0';
+
+    new_node->lchild = arg_left;
+    new_node->rchild = arg_right;
+    new_node->lheight = arg_left ? node_height(arg_left) : 0;
+    new_node->rheight = arg_right ? node_height(arg_right) : 0;
+    return new_node;
+}
+
+static void node_destructor(void *arg) {
+    node_t *node = arg;
+
+    slab_free(node, node_size(node));
+}
+
+static void node_discard(node_t *node) {
+    if (node != 0) node_destructor(node);
+}
+
+/* Returns a private copy of node. */
+static node_t *node_clone(tree_t *t, node_t *node) {
+    node_t *copy = (node_t *)slab_alloc(node_size(node));
+
+    if (copy != 0) {
+        memcpy(copy, node, node_size(node));
+        copy->gen = t->gen;
+    }
+    return copy;
+}
+
+/* Hands a node that has been unlinked or replaced over to be freed once no
+ * reader can still be looking at it, or, if it is frozen, once the snapshot
+ * is released as well. */
+static void node_retire(tree_t *t, node_t *node) {
+    if (node_frozen(t, node)) {
+        if (t->ndropped == t->dropped_cap) {
+            size_t cap = t->dropped_cap ? t->dropped_cap * 2 : 1024;
+            node_t **dropped =
+                (node_t **)realloc(t->dropped, cap * sizeof(node_t *));
+
+            if (dropped == 0) return;  // out of memory: it is never freed
+            t->dropped = dropped;
+            t->dropped_cap = cap;
+        }
+        t->dropped[t->ndropped++] = node;
+        return;
+    }
+    epoch_retire(node, node_destructor);
+}
+
+/* Returns the node holding name, or 0. Must be called from within an epoch
+ * critical section, and the node may only be used until it is left. */
+static node_t *search(tree_t *t, const char *name, int name_len) {
+    node_t *node = rcu_dereference(t->head->rchild);
+
+    while (node != 0) {
+        int cmp = name_cmp(name, name_len, node);
+
+        if (cmp == 0) break;
+        node = cmp < 0 ? rcu_dereference(node->lchild)
+                       : rcu_dereference(node->rchild);
+    }
+    return node;
+}
+
+static int tree_query(void *db, const char *name, int name_len, char *result,
+                      int len) {
+    node_t *target;
+    int found = 0;
+
+    epoch_enter();
+
+    if ((target = search(db, name, name_len)) != 0) {
+        db_copy_value(result, len, node_value(target), target->value_len);
+        found = 1;
+    }
+
+    epoch_exit();
+    return found;
+}
+
+static void tree_query_many(void *db, int n, char **names, char **results,
+                            int len, int *found) {
+    node_t *target;
+
+    epoch_enter();
+
+    for (int i = 0; i < n; i++) {
+        target = search(db, names[i], strlen(names[i]));
+        if ((found[i] = target != 0)) {
+            db_copy_value(results[i], len, node_value(target),
+                          target->value_len);
+        }
+    }
+
+    epoch_exit();
+}
+
+/* Returns the node with the smallest name after name (or equal to it, if
+ * inclusive), or 0. Same rules as search. */
+static node_t *search_next(tree_t *t, const char *name, int name_len,
+                           int inclusive) {
+    node_t *node = rcu_dereference(t->head->rchild);
+    node_t *next = 0;
+
+    while (node != 0) {
+        int cmp = name_cmp(name, name_len, node);
+
+        if (cmp == 0 && inclusive) return node;
+        if (cmp < 0) {
+            next = node;
+            node = rcu_dereference(node->lchild);
+        } else {
+            node = rcu_dereference(node->rchild);
+        }
+    }
+    return next;
+}
+
+/* Each pair is found by a fresh descent from the root, which sees every
+ * name that is present throughout, whatever rotations go on meanwhile. */
+static int tree_scan(void *db, char *from, char *to, int n, char **names,
+                     char **values, int len) {
+    node_t *node;
+    int m = 0;
+
+    epoch_enter();
+
+    for (node = search_next(db, from, strlen(from), 1);
+         node != 0 && m < n && (to == 0 || strcmp(node->name, to) < 0);
+         node = search_next(db, node->name, node->name_len, 0)) {
+        db_copy_value(names[m], len, node->name, node->name_len);
+        db_copy_value(values[m++], len, node_value(node), node->value_len);
+    }
+
+    epoch_exit();
+    return m;
+}
+
+/*
+ * The tree is kept AVL-balanced so that its height stays within about
+ * 1.44 log2(n) no matter in what order names arrive. Every node records the
+ * heights of its two subtrees. Writers note the path they took from head
+ * and walk it back up afterwards to fix heights and rotate where needed.
+ */
+
+#define MAXDEPTH 64  // far above the height of any AVL tree that fits in memory
+
+typedef struct path {
+    node_t *node[MAXDEPTH];  // node[0] is head
+    int dir[MAXDEPTH];       // 0 if we went left from node[i], 1 if right
+    int len;
+} path_t;
+
+/* Points parent's child on side dir at child, publishing it to readers. */
+static inline void set_child(node_t *parent, int dir, node_t *child) {
+    if (dir)
+        rcu_assign_pointer(parent->rchild, child);
+    else
+        rcu_assign_pointer(parent->lchild, child);
+}
+
+static inline node_t *get_child(node_t *parent, int dir) {
+    return dir ? parent->rchild : parent->lchild;
+}
+
+static void path_push(path_t *p, node_t *node) {
+    assert(p->len < MAXDEPTH);
+    p->node[p->len++] = node;
+}
+
+/* Replaces the frozen nodes among node[1..n-1] with copies, so that they
+ * can be changed in place. Returns 0 if memory runs out; the path is still
+ * valid then, only part of it may have been copied. */
+static int path_own(tree_t *t, path_t *p, int n) {
+    for (int i = 1; i < n; i++) {
+        node_t *node = p->node[i];
+        node_t *copy;
+
+        if (!node_frozen(t, node)) continue;
+        if ((copy = node_clone(t, node)) == 0) return 0;
+        set_child(p->node[i - 1], p->dir[i - 1], copy);
+        p->node[i] = copy;
+        node_retire(t, node);
+    }
+    return 1;
+}
+
+/*
+ * The rotations below return the new root of the rotated subtree, built
+ * from copies, and retire the nodes the copies replace; the caller links
+ * the new root into the parent. If memory runs out the subtree is returned
+ * as it was (still a valid tree, just out of balance).
+ */
+
+static node_t *rotate_right(tree_t *t, node_t *node) {
+    node_t *l = node->lchild;
+    node_t *new_l = node_clone(t, l);
+    node_t *new_node = node_clone(t, node);
+
+    if (new_l == 0 || new_node == 0) {
+        node_discard(new_l);
+        node_discard(new_node);
+        return node;
+    }
+
+    new_node->lchild = l->rchild;
+    new_node->lheight = l->rheight;
+    new_l->rchild = new_node;
+    new_l->rheight = node_height(new_node);
+
+    node_retire(t, l);
+    node_retire(t, node);
+    return new_l;
+}
+
+static node_t *rotate_left(tree_t *t, node_t *node) {
+    node_t *r = node->rchild;
+    node_t *new_r = node_clone(t, r);
+    node_t *new_node = node_clone(t, node);
+
+    if (new_r == 0 || new_node == 0) {
+        node_discard(new_r);
+        node_discard(new_node);
+        return node;
+    }
+
+    new_node->rchild = r->lchild;
+    new_node->rheight = r->lheight;
+    new_r->lchild = new_node;
+    new_r->lheight = node_height(new_node);
+
+    node_retire(t, r);
+    node_retire(t, node);
+    return new_r;
+}
+
+/* The left child's right child g becomes the root of the subtree, with the
+ * left child and node as its children. */
+static node_t *rotate_left_right(tree_t *t, node_t *node) {
+    node_t *l = node->lchild;
+    node_t *g = l->rchild;
+    node_t *new_l = node_clone(t, l);
+    node_t *new_node = node_clone(t, node);
+    node_t *new_g = node_clone(t, g);
+
+    if (new_l == 0 || new_node == 0 || new_g == 0) {
+        node_discard(new_l);
+        node_discard(new_node);
+        node_discard(new_g);
+        return node;
+    }
+
+    new_l->rchild = g->lchild;
+    new_l->rheight = g->lheight;
+    new_node->lchild = g->rchild;
+    new_node->lheight = g->rheight;
+    new_g->lchild = new_l;
+    new_g->lheight = node_height(new_l);
+    new_g->rchild = new_node;
+    new_g->rheight = node_height(new_node);
+
+    node_retire(t, l);
+    node_retire(t, g);
+    node_retire(t, node);
+    return new_g;
+}
+
+/* Mirror image of rotate_left_right. */
+static node_t *rotate_right_left(tree_t *t, node_t *node) {
+    node_t *r = node->rchild;
+    node_t *g = r->lchild;
+    node_t *new_r = node_clone(t, r);
+    node_t *new_node = node_clone(t, node);
+    node_t *new_g = node_clone(t, g);
+
+    if (new_r == 0 || new_node == 0 || new_g == 0) {
+        node_discard(new_r);
+        node_discard(new_node);
+        node_discard(new_g);
+        return node;
+    }
+
+    new_r->lchild = g->rchild;
+    new_r->lheight = g->rheight;
+    new_node->rchild = g->lchild;
+    new_node->rheight = g->lheight;
+    new_g->rchild = new_r;
+    new_g->rheight = node_height(new_r);
+    new_g->lchild = new_node;
+    new_g->lheight = node_height(new_node);
+
+    node_retire(t, r);
+    node_retire(t, g);
+    node_retire(t, node);
+    return new_g;
+}
+
+/* Restores the balance of node, which is out by two, and returns the new
+ * root of its subtree. */
+static node_t *rebalance(tree_t *t, node_t *node) {
+    if (node_balance(node) > 1) {
+        if (node_balance(node->lchild) < 0) return rotate_left_right(t, node);
+        return rotate_right(t, node);
+    } else {
+        if (node_balance(node->rchild) > 0) return rotate_right_left(t, node);
+        return rotate_left(t, node);
+    }
+}
+
+/* Walks back up the path after the subtree hanging off node[i] (on side
+ * dir[i]) changed to height h, fixing heights and rotating where needed,
+ * until a node's height comes out unchanged. The nodes on the path must
+ * not be frozen (see path_own). */
+static void retrace(tree_t *t, path_t *p, int i, int h) {
+    for (; i >= 0; i--) {
+        node_t *node = p->node[i];
+        int *side = p->dir[i] ? &node->rheight : &node->lheight;
+
+        if (*side == h) return;
+        *side = h;
+
+        if (i == 0) return;  // head
+
+        if (node_balance(node) > 1 || node_balance(node) < -1) {
+            node_t *root = rebalance(t, node);
+            if (root != node) set_child(p->node[i - 1], p->dir[i - 1], root);
+            h = node_height(root);
+        } else {
+            h = node_height(node);
+        }
+    }
+}
+
+/* Adds the pair. The caller holds t->write_mutex. */
+static int tree_insert(tree_t *t, const char *name, int name_len,
+                       const char *value, int value_len) {
+    path_t p;
+    node_t *node;
+    node_t *next;
+    node_t *newnode;
+    int cmp;
+
+    p.len = 0;
+    path_push(&p, t->head);
+
+    for (node = t->head;; node = next) {
+        cmp = name_cmp(name, name_len, node);
+        if (cmp == 0 && node != t->head) return (0);
+
+        p.dir[p.len - 1] = cmp >= 0;
+        if ((next = get_child(node, cmp >= 0)) == 0) break;
+        path_push(&p, next);
+    }
+
+    if (!path_own(t, &p, p.len) ||
+        (newnode = node_constructor(t, name, name_len, value, value_len, 0,
+                                    0)) == 0)
+        return (0);
+
+    set_child(p.node[p.len - 1], p.dir[p.len - 1], newnode);
+    retrace(t, &p, p.len - 1, 1);
+    t->count++;
+    db_log(LOAD_ADD, newnode->name, node_value(newnode));
+
+    return (1);
+}
+
+static int tree_add(void *db, const char *name, int name_len,
+                    const char *value, int value_len) {
+    tree_t *t = db;
+    int added;
+
+    stats_mutex_lock(&t->write_mutex);
+    added = tree_insert(t, name, name_len, value, value_len);
+    pthread_mutex_unlock(&t->write_mutex);
+
+    return added;
+}
+
+static void tree_add_many(void *db, int n, char **names, char **values,
+                          int *added) {
+    tree_t *t = db;
+
+    stats_mutex_lock(&t->write_mutex);
+    for (int i = 0; i < n; i++) {
+        added[i] = tree_insert(t, names[i], strlen(names[i]), values[i],
+                               strlen(values[i]));
+    }
+    pthread_mutex_unlock(&t->write_mutex);
+}
+
+/* Removes name. The caller holds t->write_mutex. */
+static int tree_delete(tree_t *t, const char *name, int name_len) {
+    path_t p;
+    node_t *node;
+    node_t *dnode;
+    node_t *next;
+    node_t *newtop;
+    int cmp;
+    int d;  // index of dnode in the path
+    int s;  // index of its successor
+
+    p.len = 0;
+    path_push(&p, t->head);
+
+    // first, find the node to be removed
+    for (node = t->head;; node = next) {
+        cmp = name_cmp(name, name_len, node);
+        p.dir[p.len - 1] = cmp >= 0;
+
+        if ((next = get_child(node, cmp >= 0)) == 0) {
+            // it's not there
+            return (0);
+        }
+
+        path_push(&p, next);
+        if (name_cmp(name, name_len, next) == 0) break;
+    }
+
+    dnode = next;
+    d = p.len - 1;
+    if (!path_own(t, &p, d)) return (0);
+
+    // We found it, if the node is missing a child, then we can merely replace
+    // its parent's pointer to it with the other child.
+
+    if (dnode->rchild == 0 || dnode->lchild == 0) {
+        node_t *child = dnode->rchild ? dnode->rchild : dnode->lchild;
+        int h = dnode->rchild ? dnode->rheight : dnode->lheight;
+
+        set_child(p.node[d - 1], p.dir[d - 1], child);
+        retrace(t, &p, d - 1, h);
+        t->count--;
+        db_log(LOAD_DELETE, dnode->name, 0);
+
+        // done with dnode
+        node_retire(t, dnode);
+        return (1);
+    }
+
+    // Find the lexicographically smallest node in the right subtree and
+    // replace the node to be deleted with that node. This new node thus is
+    // lexicographically smaller than all nodes in its right subtree, and
+    // greater than all nodes in its left subtree
+    //
+    // Moving the successor up must look atomic to readers, or a search for
+    // its name could miss it on the way down. So dnode, and every node on
+    // the way from dnode to the successor, is replaced by a copy; the copies
+    // form a new subtree in which the successor sits in dnode's place, and
+    // that subtree is published with a single pointer store.
+
+    p.dir[d] = 1;
+    next = dnode->rchild;
+    path_push(&p, next);
+
+    while (next->lchild != 0) {
+        // work our way down the lchild chain, finding the smallest node
+        // in the subtree.
+        p.dir[p.len - 1] = 0;
+        next = next->lchild;
+        path_push(&p, next);
+    }
+
+    s = p.len - 1;
+
+    // the successor's name and value move into a new node in dnode's place
+    newtop = node_constructor(t, next->name, next->name_len, node_value(next),
+                              next->value_len, dnode->lchild, dnode->rchild);
+    if (newtop == 0) return (0);
+    p.node[d] = newtop;
+
+    for (int i = d + 1; i < s; i++) {
+        if ((p.node[i] = node_clone(t, p.node[i])) == 0) {
+            // out of memory; nothing has been published yet
+            while (--i >= d) node_discard(p.node[i]);
+            return (0);
+        }
+    }
+
+    for (int i = d; i < s - 1; i++) {
+        set_child(p.node[i], p.dir[i], p.node[i + 1]);
+    }
+    set_child(p.node[s - 1], p.dir[s - 1], next->rchild);
+
+    set_child(p.node[d - 1], p.dir[d - 1], newtop);
+    retrace(t, &p, s - 1, next->rheight);
+    t->count--;
+    db_log(LOAD_DELETE, dnode->name, 0);
+
+    // Readers that started before the swap may still be in the old nodes.
+    for (node = dnode->rchild; node != next; node = node->lchild) {
+        node_retire(t, node);
+    }
+    node_retire(t, next);
+    node_retire(t, dnode);
+
+    return (1);
+}
+
+static int tree_remove(void *db, const char *name, int name_len) {
+    tree_t *t = db;
+    int removed;
+
+    stats_mutex_lock(&t->write_mutex);
+    removed = tree_delete(t, name, name_len);
+    pthread_mutex_unlock(&t->write_mutex);
+
+    return removed;
+}
+
+static void tree_remove_many(void *db, int n, char **names, int *removed) {
+    tree_t *t = db;
+
+    stats_mutex_lock(&t->write_mutex);
+    for (int i = 0; i < n; i++) {
+        removed[i] = tree_delete(t, names[i], strlen(names[i]));
+    }
+    pthread_mutex_unlock(&t->write_mutex);
+}
+
+static int tree_count(void *db) {
+    tree_t *t = db;
+    int n;
+
+    stats_mutex_lock(&t->write_mutex);
+    n = t->count;
+    pthread_mutex_unlock(&t->write_mutex);
+    return n;
+}
+
+/* Returns the height of the tree (0 when empty). */
+static int tree_height(void *db) {
+    tree_t *t = db;
+    int h;
+
+    stats_mutex_lock(&t->write_mutex);
+    h = t->head->rheight;
+    pthread_mutex_unlock(&t->write_mutex);
+    return h;
+}
+
+static void *tree_create(void) {
+    tree_t *t = (tree_t *)calloc(1, sizeof(tree_t));
+
+    if (t == 0) return 0;
+
+    t->gen = 1;  // so that nothing is frozen without a snapshot
+    if ((t->head = node_constructor(t, "", 0, "", 0, 0, 0)) == 0) {
+        free(t);
+        return 0;
+    }
+    if (pthread_mutex_init(&t->write_mutex, 0) != 0 ||
+        pthread_mutex_init(&t->snapshot_mutex, 0) != 0) {
+        node_destructor(t->head);
+        free(t);
+        return 0;
+    }
+    return t;
+}
+
+/* Takes a snapshot of the tree and returns its root, or 0 if it is empty;
+ * *count is set to the number of entries. The subtree stays exactly as it
+ * is until tree_snapshot_release, whatever writers do meanwhile; it can be
+ * walked without locks or epochs. A second snapshot waits for the first
+ * to be released. */
+static node_t *tree_snapshot(tree_t *t, int *count) {
+    node_t *root;
+
+    pthread_mutex_lock(&t->snapshot_mutex);
+    stats_mutex_lock(&t->write_mutex);
+    root = t->head->rchild;
+    *count = t->count;
+    t->snap_gen = t->gen++;
+    pthread_mutex_unlock(&t->write_mutex);
+    return root;
+}
+
+static void tree_snapshot_release(tree_t *t) {
+    stats_mutex_lock(&t->write_mutex);
+    t->snap_gen = 0;
+    for (size_t i = 0; i < t->ndropped; i++) {
+        epoch_retire(t->dropped[i], node_destructor);
+    }
+    t->ndropped = 0;
+    pthread_mutex_unlock(&t->write_mutex);
+    pthread_mutex_unlock(&t->snapshot_mutex);
+}
+
+static inline void print_spaces(int lvl, FILE *out) {
+    for (int i = 0; i < lvl; i++) {
+        fprintf(out, " ");
+    }
+}
+
+/* Recursively traverses the database tree and prints nodes
+ * pre-order. */
+static void tree_print_recurs(node_t *node, int lvl, FILE *out) {
+    // print spaces to differentiate levels
+    print_spaces(lvl, out);
+
+    // print out the current node
+    if (node == NULL) {
+        fprintf(out, "(null)\n");
+        return;
+    }
+
+    if (lvl == 0) {
+        fprintf(out, "(root)\n");
+    } else {
+        fprintf(out, "%s %s\n", node->name, node_value(node));
+    }
+
+    tree_print_recurs(node->lchild, lvl + 1, out);
+    tree_print_recurs(node->rchild, lvl + 1, out);
+}
+
+/* Prints a snapshot, so the dump shows a single state of the tree while
+ * writers and lookups carry on. */
+static void tree_print(void *db, FILE *out) {
+    tree_t *t = db;
+    node_t head;
+    int count;
+
+    memset(&head, 0, sizeof(head));
+    head.rchild = tree_snapshot(t, &count);
+    tree_print_recurs(&head, 0, out);
+    tree_snapshot_release(t);
+}
+
+/* Recursively destroys node and all its children. */
+static void tree_cleanup_recurs(node_t *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    tree_cleanup_recurs(node->lchild);
+    tree_cleanup_recurs(node->rchild);
+
+    node_destructor(node);
+}
+
+/* Destroys all nodes in the database other than the head.
+ * No threads should be using the database when this is called. */
+static void tree_clear(void *db) {
+    tree_t *t = db;
+
+    tree_cleanup_recurs(t->head->lchild);
+    tree_cleanup_recurs(t->head->rchild);
+    t->head->lchild = t->head->rchild = NULL;
+    t->head->lheight = t->head->rheight = 0;
+    t->count = 0;
+}
+
+static void tree_destroy(void *db) {
+    tree_t *t = db;
+
+    tree_clear(t);
+    node_destructor(t->head);
+    pthread_mutex_destroy(&t->write_mutex);
+    pthread_mutex_destroy(&t->snapshot_mutex);
+    free(t->dropped);
+    free(t);
+}
+
+/*
+ * Bulk loading. A load at least as big as the tree rebuilds it: the pairs
+ * already there and the changes are merged in name order into a fresh,
+ * perfectly balanced tree, which replaces the old one with a single pointer
+ * store, and the old nodes are retired. Smaller loads are applied one name
+ * at a time. Either way the write lock is taken once.
+ */
+
+/* Appends the nodes of the subtree, in order, to nodes. */
+static void tree_collect(node_t *node, node_t **nodes, int *n) {
+    if (node == NULL) {
+        return;
+    }
+
+    tree_collect(node->lchild, nodes, n);
+    nodes[(*n)++] = node;
+    tree_collect(node->rchild, nodes, n);
+}
+
+/* Builds a balanced tree out of the pairs lo..hi-1, which are sorted by
+ * name. Sets *failed (and returns 0) if memory runs out. */
+static node_t *tree_build(tree_t *t, char **names, char **values, int lo,
+                          int hi, int *failed) {
+    node_t *left, *right, *node;
+    int mid = lo + (hi - lo) / 2;
+
+    if (lo >= hi) return 0;
+
+    left = tree_build(t, names, values, lo, mid, failed);
+    right = tree_build(t, names, values, mid + 1, hi, failed);
+    if (!*failed &&
+        (node = node_constructor(t, names[mid], strlen(names[mid]),
+                                 values[mid], strlen(values[mid]), left,
+                                 right)) != 0)
+        return node;
+
+    *failed = 1;
+    tree_cleanup_recurs(left);
+    tree_cleanup_recurs(right);
+    return 0;
+}
+
+/* Replaces the tree with one holding its current pairs merged with the
+ * changes. Returns 0, leaving the tree alone, if memory runs out. The
+ * caller holds t->write_mutex. */
+static int tree_rebuild(tree_t *t, int n, char **names, char **values,
+                        int *ops) {
+    node_t **old = (node_t **)malloc((t->count + 1) * sizeof(node_t *));
+    char **new_names = (char **)malloc((t->count + n + 1) * sizeof(char *));
+    char **new_values = (char **)malloc((t->count + n + 1) * sizeof(char *));
+    int *done = (int *)malloc((n + 1) * sizeof(int));  // for db_log
+    node_t *root = 0;
+    int nold = 0, m = 0, failed = 0;
+
+    if (old == 0 || new_names == 0 || new_values == 0 || done == 0) {
+        failed = 1;
+        goto out;
+    }
+
+    tree_collect(t->head->rchild, old, &nold);
+
+    for (int i = 0, j = 0; i < nold || j < n;) {
+        int cmp = i == nold ? 1 : j == n ? -1 : strcmp(old[i]->name, names[j]);
+
+        if (cmp >= 0) {
+            // what the change comes to, given whether name is there
+            done[j] = cmp == 0 ? (ops[j] == LOAD_ADD ? -1 : ops[j])
+                               : (ops[j] == LOAD_DELETE ? -1 : LOAD_ADD);
+        }
+
+        if (cmp < 0 || (cmp == 0 && ops[j] == LOAD_ADD)) {
+            new_names[m] = old[i]->name;
+            new_values[m++] = node_value(old[i]);
+        } else if (ops[j] != LOAD_DELETE) {
+            new_names[m] = names[j];
+            new_values[m++] = values[j];
+        }
+        if (cmp <= 0) i++;
+        if (cmp >= 0) j++;
+    }
+
+    if ((root = tree_build(t, new_names, new_values, 0, m, &failed)) != 0 ||
+        !failed) {
+        rcu_assign_pointer(t->head->rchild, root);
+        t->head->rheight = root ? node_height(root) : 0;
+        t->count = m;
+        for (int j = 0; j < n; j++) {
+            if (done[j] >= 0) db_log(done[j], names[j], values[j]);
+        }
+        for (int i = 0; i < nold; i++) {
+            node_retire(t, old[i]);
+        }
+    }
+
+out:
+    free(old);
+    free(new_names);
+    free(new_values);
+    free(done);
+    return !failed;
+}
+
+static void tree_load(void *db, int n, char **names, char **values,
+                      int *ops) {
+    tree_t *t = db;
+
+    stats_mutex_lock(&t->write_mutex);
+
+    if (n < t->count || !tree_rebuild(t, n, names, values, ops)) {
+        for (int i = 0; i < n; i++) {
+            int name_len = strlen(names[i]);
+
+            if (ops[i] != LOAD_ADD) tree_delete(t, names[i], name_len);
+            if (ops[i] != LOAD_DELETE)
+                tree_insert(t, names[i], name_len, values[i],
+                            strlen(values[i]));
+        }
+    }
+
+    pthread_mutex_unlock(&t->write_mutex);
+}
+
+/* The view points into the nodes of a snapshot, which it holds until
+ * tree_release. */
+static int tree_view(void *db, db_view_t *view) {
+    tree_t *t = db;
+    node_t **nodes, *root;
+    int count, n = 0;
+
+    root = tree_snapshot(t, &count);
+
+    nodes = (node_t **)malloc((count + 1) * sizeof(node_t *));
+    view->names = (char **)malloc((count + 1) * sizeof(char *));
+    view->values = (char **)malloc((count + 1) * sizeof(char *));
+    if (nodes == 0 || view->names == 0 || view->values == 0) {
+        tree_snapshot_release(t);
+        free(nodes);
+        free(view->names);
+        free(view->values);
+        return -1;
+    }
+
+    tree_collect(root, nodes, &n);
+    for (int i = 0; i < n; i++) {
+        view->names[i] = nodes[i]->name;
+        view->values[i] = node_value(nodes[i]);
+    }
+    free(nodes);
+    view->n = n;
+    view->handle = 0;
+    return 0;
+}
+
+static void tree_release(void *db, db_view_t *view) {
+    tree_snapshot_release(db);
+    free(view->names);
+    free(view->values);
+}
+
+const db_engine_t tree_engine = {
+    .name = "tree",
+    .create = tree_create,
+    .query = tree_query,
+    .add = tree_add,
+    .remove = tree_remove,
+    .query_many = tree_query_many,
+    .add_many = tree_add_many,
+    .remove_many = tree_remove_many,
+    .scan = tree_scan,
+    .load = tree_load,
+    .view = tree_view,
+    .release = tree_release,
+    .print = tree_print,
+    .clear = tree_clear,
+    .destroy = tree_destroy,
+    .height = tree_height,
+    .count = tree_count,
+};
@@ -0,0 +1,174 @@
+#include "./epoch.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Classic three-epoch scheme. A global epoch counter only moves forward
+ * once every thread inside a critical section has observed its current
+ * value. Anything retired while the global epoch was e can therefore no
+ * longer be referenced once the counter reaches e + 2, so each thread keeps
+ * three limbo lists, one per epoch modulo 3, and empties a list when it is
+ * about to reuse it for a newer epoch.
+ *
+ * Per-thread records are never freed. A thread's record (together with
+ * any garbage still in its limbo lists) is handed to the next thread that
+ * registers after it exits, so the number of records stays bounded by the
+ * number of threads alive at once.
+ */
+
+#define NLIMBO 3
+#define ADVANCE_INTERVAL 64  // retirements between attempts to advance
+
+typedef struct retired {
+    void *ptr;
+    void (*destructor)(void *);
+} retired_t;
+
+typedef struct limbo {
+    unsigned long epoch;
+    size_t count;
+    size_t capacity;
+    retired_t *items;
+} limbo_t;
+
+typedef struct epoch_rec {
+    // (epoch << 1) | 1 while the owner is in a critical section, else 0
+    unsigned long state;
+    int nesting;
+    int in_use;
+    unsigned int retired;  // retirements since the last advance attempt
+    limbo_t limbo[NLIMBO];
+    struct epoch_rec *next;
+} epoch_rec_t;
+
+static unsigned long global_epoch = NLIMBO;
+
+static epoch_rec_t *records;  // append-only list of all records
+static pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rec_key;
+static __thread epoch_rec_t *self;
+
+/* Called when a registered thread exits (or is canceled). */
+static void epoch_unregister(void *arg) {
+    epoch_rec_t *rec = arg;
+
+    rec->nesting = 0;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    int err;
+
+    if ((err = pthread_key_create(&rec_key, epoch_unregister)) != 0) {
+        fprintf(stderr, "epoch: pthread_key_create failed (%d)\n", err);
+        abort();
+    }
+}
+
+static epoch_rec_t *epoch_register(void) {
+    epoch_rec_t *rec;
+
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&records_mutex);
+
+    for (rec = records; rec != NULL; rec = rec->next) {
+        if (!__atomic_load_n(&rec->in_use, __ATOMIC_ACQUIRE)) break;
+    }
+
+    if (rec == NULL) {
+        if ((rec = (epoch_rec_t *)calloc(1, sizeof(epoch_rec_t))) == NULL) {
+            perror("epoch: calloc");
+            abort();
+        }
+        rec->next = records;
+        rcu_assign_pointer(records, rec);
+    }
+    rec->in_use = 1;
+
+    pthread_mutex_unlock(&records_mutex);
+
+    pthread_setspecific(rec_key, rec);
+    self = rec;
+    return rec;
+}
+
+void epoch_enter(void) {
+    epoch_rec_t *rec = self ? self : epoch_register();
+
+    if (rec->nesting++ > 0) return;
+
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->state, (e << 1) | 1, __ATOMIC_RELAXED);
+    // the announcement must be visible before any shared pointer is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    epoch_rec_t *rec = self;
+
+    if (--rec->nesting > 0) return;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+/* Moves the global epoch forward if every thread in a critical section
+ * has caught up with it. */
+static void epoch_try_advance(void) {
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (epoch_rec_t *rec = rcu_dereference(records); rec != NULL;
+         rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && (state >> 1) != e) return;
+    }
+
+    __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0, __ATOMIC_ACQ_REL,
+                                __ATOMIC_RELAXED);
+}
+
+static void limbo_free(limbo_t *l) {
+    for (size_t i = 0; i < l->count; i++) {
+        l->items[i].destructor(l->items[i].ptr);
+    }
+    l->count = 0;
+}
+
+void epoch_retire(void *ptr, void (*destructor)(void *)) {
+    epoch_rec_t *rec = self ? self : epoch_register();
+
+    // the unlinking store must be ordered before we read the epoch
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    limbo_t *l = &rec->limbo[e % NLIMBO];
+
+    // whatever is in this list was retired three or more epochs ago
+    if (l->epoch != e) {
+        limbo_free(l);
+        l->epoch = e;
+    }
+
+    if (l->count == l->capacity) {
+        size_t capacity = l->capacity ? l->capacity * 2 : 64;
+        retired_t *items =
+            (retired_t *)realloc(l->items, capacity * sizeof(retired_t));
+        if (items == NULL) {
+            perror("epoch: realloc");
+            abort();
+        }
+        l->items = items;
+        l->capacity = capacity;
+    }
+    l->items[l->count].ptr = ptr;
+    l->items[l->count].destructor = destructor;
+    l->count++;
+
+    if (++rec->retired >= ADVANCE_INTERVAL) {
+        rec->retired = 0;
+        epoch_try_advance();
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/*
+ * Epoch-based reclamation, for data structures that are read without locks.
+ *
+ * Readers bracket every traversal with epoch_enter()/epoch_exit(). Writers
+ * unlink an object so that no new reader can reach it, then hand it to
+ * epoch_retire(), which frees it only once every reader that might still
+ * be looking at it has left its critical section. Critical sections may
+ * nest, must not block for long (a reader stuck inside one holds back all
+ * reclamation) and are per thread.
+ */
+
+/* Loads a pointer that a writer may concurrently replace. */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/* Publishes a pointer to a fully initialized object to readers. */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+extern void epoch_enter(void);
+extern void epoch_exit(void);
+extern void epoch_retire(void *ptr, void (*destructor)(void *));
+
+#endif  // EPOCH_H_
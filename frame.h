@@ -0,0 +1,51 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stdint.h>
+
+/*
+ * Binary protocol. A client that starts its connection with the byte
+ * FRAME_MAGIC speaks it for the rest of the connection; any other first
+ * byte means the line-based text protocol.
+ *
+ * A request is a header followed by the key and the value, each with a
+ * terminating NUL that the lengths do not count (the value is empty for
+ * everything but FRAME_ADD; neither may contain whitespace, as in the text
+ * protocol):
+ *
+ *     opcode | 0 | key_len | value_len | key \0 | value \0
+ *
+ * so the server can pass both strings to the database where they lie in
+ * its receive buffer, without parsing or copying them. A reply is a header
+ * whose opcode field holds a status, followed by value_len bytes of value
+ * (no NUL), which only a successful FRAME_QUERY has. Lengths are in
+ * network byte order.
+ */
+
+#define FRAME_MAGIC 0xB1
+
+#define FRAME_MAX_STRING 255  // longest key or value, as in the text protocol
+
+// Opcodes, the same characters as the text commands
+#define FRAME_QUERY 'q'
+#define FRAME_ADD 'a'
+#define FRAME_DELETE 'd'
+#define FRAME_FILE 'f'  // key is the file name
+
+// Reply statuses
+#define FRAME_OK 0         // found / added / removed / file processed
+#define FRAME_NOT_FOUND 1  // not found / already in / not in / bad file name
+#define FRAME_ILL_FORMED 2
+
+typedef struct frame_header {
+    uint8_t opcode;  // or status, in a reply
+    uint8_t reserved;
+    uint16_t key_len;
+    uint32_t value_len;
+} frame_header_t;
+
+#define FRAME_REQUEST_MAX \
+    (sizeof(frame_header_t) + 2 * (FRAME_MAX_STRING + 1))
+#define FRAME_REPLY_MAX (sizeof(frame_header_t) + FRAME_MAX_STRING + 1)
+
+#endif  // FRAME_H_
@@ -0,0 +1,141 @@
+#include "./gate.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DRAIN_CHECK_NS 1000000  // longest a drain waits before rescanning
+
+typedef struct gate_rec {
+    int inside;  // the owner is between gate_enter and gate_exit
+    int in_use;
+    struct gate_rec *next;
+} __attribute__((aligned(64))) gate_rec_t;  // a cache line each
+
+static int closed;    // read by every command, written by stop and go
+static int draining;  // a stop is waiting for the commands inside
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t opened = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t left = PTHREAD_COND_INITIALIZER;
+
+static gate_rec_t *records;  // every record ever created
+static pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rec_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread gate_rec_t *self;
+
+static void gate_unregister(void *arg) {
+    gate_rec_t *rec = arg;
+
+    __atomic_store_n(&rec->inside, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    if (pthread_key_create(&rec_key, gate_unregister) != 0) {
+        fprintf(stderr, "gate: pthread_key_create failed\n");
+        abort();
+    }
+}
+
+static gate_rec_t *gate_register(void) {
+    gate_rec_t *rec;
+
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&records_mutex);
+
+    for (rec = records; rec != NULL; rec = rec->next) {
+        if (!__atomic_load_n(&rec->in_use, __ATOMIC_ACQUIRE)) break;
+    }
+
+    if (rec == NULL) {
+        if ((rec = (gate_rec_t *)aligned_alloc(64, sizeof(gate_rec_t))) ==
+            NULL) {
+            perror("gate: aligned_alloc");
+            abort();
+        }
+        memset(rec, 0, sizeof(*rec));
+        rec->next = records;
+        records = rec;
+    }
+    rec->in_use = 1;
+
+    pthread_mutex_unlock(&records_mutex);
+
+    pthread_setspecific(rec_key, rec);
+    self = rec;
+    return rec;
+}
+
+void gate_enter(void) {
+    gate_rec_t *rec = self ? self : gate_register();
+
+    while (1) {
+        // the mark must be visible before the gate is looked at (hence the
+        // exchange, a full barrier): either gate_stop sees this thread
+        // inside, or this thread sees the gate closed
+        __atomic_exchange_n(&rec->inside, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&closed, __ATOMIC_ACQUIRE)) return;
+
+        gate_exit();
+        pthread_mutex_lock(&gate_mutex);
+        while (closed) pthread_cond_wait(&opened, &gate_mutex);
+        pthread_mutex_unlock(&gate_mutex);
+    }
+}
+
+void gate_exit(void) {
+    __atomic_store_n(&self->inside, 0, __ATOMIC_RELEASE);
+
+    // Without a fence the store above may not be visible yet when a stop
+    // that has just begun scans the records, and the stop may not see
+    // draining set here. It rescans every DRAIN_CHECK_NS instead, which
+    // costs a stop a millisecond at worst rather than every command a
+    // fence.
+    if (__atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&gate_mutex);
+        pthread_cond_broadcast(&left);
+        pthread_mutex_unlock(&gate_mutex);
+    }
+}
+
+/* Returns 1 if any thread is between gate_enter and gate_exit. */
+static int gate_busy(void) {
+    gate_rec_t *rec;
+
+    pthread_mutex_lock(&records_mutex);
+    for (rec = records; rec != NULL; rec = rec->next) {
+        if (__atomic_load_n(&rec->inside, __ATOMIC_SEQ_CST)) break;
+    }
+    pthread_mutex_unlock(&records_mutex);
+    return rec != NULL;
+}
+
+void gate_stop(void) {
+    pthread_mutex_lock(&gate_mutex);
+    __atomic_store_n(&closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
+
+    while (gate_busy()) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += DRAIN_CHECK_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&left, &gate_mutex, &deadline);
+    }
+
+    __atomic_store_n(&draining, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+void gate_go(void) {
+    pthread_mutex_lock(&gate_mutex);
+    __atomic_store_n(&closed, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&opened);
+    pthread_mutex_unlock(&gate_mutex);
+}
@@ -0,0 +1,24 @@
+#ifndef GATE_H_
+#define GATE_H_
+
+/*
+ * The gate that stops and releases the clients (s and g at the server's
+ * console). Every command is run between gate_enter() and gate_exit().
+ * gate_stop() closes the gate and only returns once every command that
+ * was already past it has finished, so whatever the console does next (a
+ * checkpoint, a print) sees the database at rest; gate_go() opens it
+ * again and wakes up every thread waiting at it.
+ *
+ * Each thread marks itself as inside in a record of its own (recycled
+ * when the thread exits), so passing an open gate takes no lock and
+ * writes no shared cache line: an exchange on the thread's own record
+ * and a load of the gate's state, which only changes on stop and go.
+ * gate_enter and gate_exit do not nest.
+ */
+
+extern void gate_enter(void);
+extern void gate_exit(void);
+extern void gate_stop(void);
+extern void gate_go(void);
+
+#endif  // GATE_H_
@@ -0,0 +1,795 @@
+/*
+ * Load generator: keeps a server busy from a number of connections and
+ * reports throughput and the distribution of response times, instead of
+ * printing every response as client does.
+ *
+ * Usage: ./loadgen [-t threads] [-c connections] [-w depth] [-r rate]
+ *                  [-d seconds] [-b] [-H]
+ *                  [-x read%] [-k keys] [-D uniform|zipf|seq] [-z theta] [-P]
+ *                  [-s <script>[,<script>...]]
+ *                  <servername> <port>
+ *
+ * Each of the threads (-t, default 1) drives its share of the connections
+ * (-c, default one per thread) without blocking, and keeps up to depth
+ * commands in flight on each of them (-w, default 1). The text protocol is
+ * used unless -b asks for the binary one (see frame.h).
+ *
+ * Without -r the load is closed-loop: a connection sends its next command
+ * as soon as a reply leaves room in its window. With -r the commands are
+ * issued at that many per second in all, evenly spaced on every connection,
+ * whether or not the server keeps up; a command's latency is then counted
+ * from the moment it was due, not from when there was room to send it, so
+ * a server that falls behind shows it in the latencies (and the commands
+ * never sent by the end are reported).
+ *
+ * The commands are generated unless -s is given: names key00000000 ...
+ * from a keyspace of -k names (default 100000), picked uniformly (the
+ * default), by a Zipfian distribution with exponent -z (default 0.99, the
+ * lower names the hotter) or sequentially, each connection starting at its
+ * own part of the keyspace. -x percent of them are queries (default 90),
+ * the rest an add or a delete of the name, equally likely. -P adds every
+ * name of the keyspace before the measurement starts.
+ *
+ * With -s each connection replays a script file instead, connection i the
+ * i-th of the comma-separated scripts modulo their number. Without -d
+ * every connection runs its script once; with -d the scripts are repeated
+ * until the time is up. Generated load runs for -d seconds (default 10).
+ *
+ * Latencies are kept in log-linear histograms (as HdrHistogram does, with
+ * 64 buckets per power of two, so within 1.6% of the value) for reads (q,
+ * mq, r and p) and writes separately. -H also prints the whole
+ * distribution in HdrHistogram's percentile format, for plotting.
+ */
+#define _GNU_SOURCE  // ppoll
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "./frame.h"
+
+#define BUFSIZE 32768  // room for any response, as in client.c
+#define REQMAX 1024    // room for any generated request
+#define MAXSCRIPTS 16
+
+/*
+ * Log-linear histogram of nanoseconds: values below 128 have a bucket
+ * each, and every power of two above is split into 64 buckets. A value
+ * with its highest bit at 6 + shift (shift > 0) falls in bucket
+ * 64 * shift + (value >> shift); the last shift covers about 18 minutes.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SHIFTS 40
+#define HIST_BUCKETS (HIST_SUB * (HIST_SHIFTS + 2))
+
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} histogram_t;
+
+static int hist_index(uint64_t v) {
+    int shift = v < 2 * HIST_SUB ? 0 : 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+
+    if (shift > HIST_SHIFTS) return HIST_BUCKETS - 1;
+    return HIST_SUB * shift + (int)(v >> shift);
+}
+
+/* The largest value that falls in bucket i. */
+static uint64_t hist_value(int i) {
+    int shift = i < 2 * HIST_SUB ? 0 : i / HIST_SUB - 1;
+
+    return ((uint64_t)(i - HIST_SUB * shift + 1) << shift) - 1;
+}
+
+static void hist_record(histogram_t *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_add(histogram_t *to, const histogram_t *from) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) to->counts[i] += from->counts[i];
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->max > to->max) to->max = from->max;
+}
+
+/* The value below which the given fraction of the values lie. */
+static uint64_t hist_percentile(const histogram_t *h, double fraction) {
+    uint64_t rank = (uint64_t)ceil(fraction * h->total), seen = 0;
+    int i;
+
+    if (rank == 0) rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if ((seen += h->counts[i]) >= rank) {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Prints the distribution the way HdrHistogram's .hgrm files have it. */
+static void hist_print_distribution(const histogram_t *h) {
+    uint64_t seen = 0;
+    int i;
+
+    printf("%12s %14s %10s %14s\n\n", "Value(us)", "Percentile", "TotalCount",
+           "1/(1-Percentile)");
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        double p;
+
+        if (h->counts[i] == 0) continue;
+        seen += h->counts[i];
+        p = (double)seen / h->total;
+        if (seen < h->total) {
+            printf("%12.3f %14.12f %10lu %14.2f\n", hist_value(i) / 1e3, p,
+                   (unsigned long)seen, 1 / (1 - p));
+        } else {
+            printf("%12.3f %14.12f %10lu\n", h->max / 1e3, p,
+                   (unsigned long)seen);
+        }
+    }
+}
+
+/*
+ * Zipfian ranks in [0, n), by the method of Gray et al., "Quickly
+ * generating billion-record synthetic databases" (as YCSB does it).
+ */
+typedef struct zipf {
+    long n;
+    double theta, alpha, zetan, eta;
+} zipf_t;
+
+static void zipf_init(zipf_t *z, long n, double theta) {
+    double zeta2 = 1 + pow(0.5, theta);
+    long i;
+
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    for (z->zetan = 0, i = 1; i <= n; i++) z->zetan += pow(i, -theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static long zipf_next(const zipf_t *z, double u) {
+    double uz = u * z->zetan;
+    long rank;
+
+    if (uz < 1) return 0;
+    if (uz < 1 + pow(0.5, z->theta)) return 1;
+    rank = (long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+/* A script, each line ready to send in the protocol in use. */
+typedef struct script {
+    char **reqs;
+    int *lens;
+    char *ops;  // the command letter of each line (see load_script)
+    long nlines;
+} script_t;
+
+typedef struct conn {
+    int fd;
+    int index;  // among all connections
+    char *wbuf;  // requests not yet sent
+    size_t wlen, woff;
+    char rbuf[BUFSIZE];
+    size_t rlen;
+    double *due;  // of the commands in flight, oldest first
+    char *ops;
+    int oldest, in_flight;
+    double next_due;  // of the next command, with -r
+    uint64_t rng;
+    long next;  // next name (sequential, preload) or script line
+    long last;  // end of the preload range
+    script_t *script;
+    int done;  // no more commands to send
+} conn_t;
+
+typedef struct worker {
+    pthread_t thread;
+    conn_t *conns;
+    int nconns;
+    histogram_t reads, writes;
+    uint64_t ill_formed, queries, found;
+    double finish;  // when the last reply came in
+} worker_t;
+
+enum { DIST_UNIFORM, DIST_ZIPF, DIST_SEQ };
+
+static const char *server;
+static const char *port;
+static int nthreads = 1;
+static int nconns;
+static int depth = 1;
+static double rate;  // commands per second in all, 0 for closed-loop
+static double duration;
+static int binary;
+static int read_percent = 90;
+static long nkeys = 100000;
+static int dist = DIST_UNIFORM;
+static double theta = 0.99;
+static int preload;
+static script_t scripts[MAXSCRIPTS];
+static int nscripts;
+static size_t reqmax = REQMAX;  // room for any request, script lines too
+
+static zipf_t zipf;
+static pthread_barrier_t barrier;
+static double start, end;  // of the measurement
+static volatile int measuring;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, one state per connection. */
+static uint64_t next_random(conn_t *c) {
+    c->rng ^= c->rng >> 12;
+    c->rng ^= c->rng << 25;
+    c->rng ^= c->rng >> 27;
+    return c->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Writes the command with the given letter to buf, in the protocol in use.
+ * The value is only used by adds. Returns its length.
+ */
+static int encode(char *buf, int op, const char *name, const char *value) {
+    frame_header_t h;
+    size_t key_len = strlen(name), value_len;
+
+    if (!binary) {
+        if (op == 'a') return sprintf(buf, "a %s %s\n", name, value);
+        return sprintf(buf, "%c %s\n", op, name);
+    }
+
+    if (op != FRAME_ADD) value = "";
+    value_len = strlen(value);
+    memset(&h, 0, sizeof(h));
+    h.opcode = op;
+    h.key_len = htons(key_len);
+    h.value_len = htonl(value_len);
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), name, key_len + 1);
+    memcpy(buf + sizeof(h) + key_len + 1, value, value_len + 1);
+    return sizeof(h) + key_len + 1 + value_len + 1;
+}
+
+/*
+ * Reads a script file and encodes each of its lines, skipping blank ones.
+ * Lines that are not well-formed commands are sent anyway.
+ * Returns 0, or -1 if the file could not be read.
+ */
+static int load_script(script_t *script, const char *path) {
+    char line[BUFSIZE], name[FRAME_MAX_STRING + 1], value[FRAME_MAX_STRING + 1];
+    long cap = 1024;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL) return -1;
+    script->reqs = malloc(cap * sizeof(char *));
+    script->lens = malloc(cap * sizeof(int));
+    script->ops = malloc(cap);
+    script->nlines = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t len = strlen(line);
+        char *req;
+
+        if (line[0] == '\n' || line[0] == '\0') continue;
+        if (line[len - 1] != '\n') line[len++] = '\n', line[len] = '\0';
+        if (script->nlines == cap) {
+            cap *= 2;
+            script->reqs = realloc(script->reqs, cap * sizeof(char *));
+            script->lens = realloc(script->lens, cap * sizeof(int));
+            script->ops = realloc(script->ops, cap);
+        }
+
+        if (binary) {
+            name[0] = value[0] = '\0';
+            sscanf(&line[1], "%255s %255s", name, value);
+            req = malloc(FRAME_REQUEST_MAX);
+            script->lens[script->nlines] = encode(req, line[0], name, value);
+        } else {
+            req = strdup(line);
+            script->lens[script->nlines] = len;
+        }
+        if ((size_t)script->lens[script->nlines] > reqmax)
+            reqmax = script->lens[script->nlines];
+        // batches go by their second letter, in upper case
+        script->reqs[script->nlines] = req;
+        script->ops[script->nlines++] =
+            line[0] == 'm' && line[1] >= 'a' && line[1] <= 'z' ? line[1] - 32
+                                                               : line[0];
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Opens a TCP connection to the server, as client.c does.
+ * Returns the file descriptor, or -1.
+ */
+static int get_socket(void) {
+    struct addrinfo hints, *result, *res;
+    int sock = -1, one = 1, err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) break;
+        close(sock);
+    }
+    freeaddrinfo(result);
+    if (res == NULL) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", server);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+/*
+ * Queues the connection's next command for sending. Returns its command
+ * letter, or 0 (marking the connection done) if it has no more.
+ */
+static int next_command(conn_t *c) {
+    char name[32], value[32], *buf = c->wbuf + c->wlen;
+    long key;
+    int op;
+
+    if (!measuring) {
+        // preloading its part of the keyspace
+        if (c->next == c->last) return c->done = 1, 0;
+        key = c->next++;
+        op = 'a';
+    } else if (c->script != NULL) {
+        if (c->next == c->script->nlines) {
+            if (duration == 0) return c->done = 1, 0;
+            c->next = 0;
+        }
+        memcpy(buf, c->script->reqs[c->next], c->script->lens[c->next]);
+        c->wlen += c->script->lens[c->next];
+        return c->script->ops[c->next++];
+    } else {
+        uint64_t r = next_random(c);
+
+        if (dist == DIST_SEQ) {
+            key = c->next++ % nkeys;
+        } else if (dist == DIST_ZIPF) {
+            key = zipf_next(&zipf, (next_random(c) >> 11) * 0x1.0p-53);
+        } else {
+            key = next_random(c) % nkeys;
+        }
+        op = (int)(r % 100) < read_percent ? 'q' : r & (1 << 20) ? 'a' : 'd';
+    }
+
+    sprintf(name, "key%08ld", key);
+    sprintf(value, "value%ld", key);
+    c->wlen += encode(buf, op, name, value);
+    return op;
+}
+
+/* Fills the connection's window with the commands that are due. */
+static void fill(conn_t *c, double t) {
+    while (!c->done && c->in_flight < depth) {
+        double due = t;
+        int op;
+
+        if (measuring && rate > 0) {
+            if (c->next_due > t || c->next_due >= end) break;
+            due = c->next_due;
+        } else if (measuring && duration > 0 && t >= end) {
+            break;
+        }
+        if ((op = next_command(c)) == 0) break;
+        if (measuring && rate > 0) c->next_due += nconns / rate;
+
+        int slot = (c->oldest + c->in_flight++) % depth;
+        c->due[slot] = due;
+        c->ops[slot] = op;
+    }
+    if (measuring && duration > 0 && t >= end) c->done = 1;
+}
+
+/* Sends what the socket takes of the queued requests, and moves the rest
+ * to the front of the buffer. Unsent requests are all in flight, so the
+ * buffer never holds more than depth of them. */
+static void flush(conn_t *c) {
+    while (c->woff < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            fprintf(stderr, "No connection!\n");
+            exit(1);
+        }
+        c->woff += n;
+    }
+    memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+    c->wlen -= c->woff;
+    c->woff = 0;
+}
+
+/*
+ * Returns the length of the reply at the start of buf, 0 if it has not
+ * all arrived yet. *status is set to its outcome: FRAME_OK,
+ * FRAME_NOT_FOUND or FRAME_ILL_FORMED.
+ */
+static size_t reply_length(const char *buf, size_t len, int *status) {
+    if (binary) {
+        frame_header_t h;
+
+        if (len < sizeof(h)) return 0;
+        memcpy(&h, buf, sizeof(h));
+        if (len < sizeof(h) + ntohl(h.value_len)) return 0;
+        *status = h.opcode;
+        return sizeof(h) + ntohl(h.value_len);
+    } else {
+        const char *nl = memchr(buf, '\n', len);
+
+        if (nl == NULL) return 0;
+        *status = strncmp(buf, "ill-formed command\n", nl - buf + 1) == 0
+                      ? FRAME_ILL_FORMED
+                  : strncmp(buf, "not found\n", nl - buf + 1) == 0
+                      ? FRAME_NOT_FOUND
+                      : FRAME_OK;
+        return nl - buf + 1;
+    }
+}
+
+/* Reads what has arrived on the connection and times the replies in it. */
+static void receive(worker_t *w, conn_t *c) {
+    size_t off = 0, len;
+    ssize_t n;
+    double t;
+    int status;
+
+    if ((n = recv(c->fd, c->rbuf + c->rlen, BUFSIZE - c->rlen,
+                  MSG_DONTWAIT)) <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        fprintf(stderr, "Connection terminated.\n");
+        exit(1);
+    }
+    c->rlen += n;
+    t = now();
+
+    while (c->in_flight > 0 &&
+           (len = reply_length(c->rbuf + off, c->rlen - off, &status)) > 0) {
+        int op = c->ops[c->oldest];
+
+        if (measuring) {
+            uint64_t ns = (t - c->due[c->oldest]) * 1e9;
+            int read = op == 'q' || op == 'Q' || op == 'r' || op == 'p';
+
+            hist_record(read ? &w->reads : &w->writes, ns);
+            if (op == 'q') {
+                w->queries++;
+                w->found += status == FRAME_OK;
+            }
+            w->ill_formed += status == FRAME_ILL_FORMED;
+        }
+        off += len;
+        c->oldest = (c->oldest + 1) % depth;
+        c->in_flight--;
+        w->finish = t;
+    }
+    memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+    c->rlen -= off;
+}
+
+/*
+ * Runs the connections of a worker until all of them are done and every
+ * reply is in.
+ */
+static void run(worker_t *w) {
+    struct pollfd pfds[w->nconns];
+    conn_t *polled[w->nconns];
+    int i, busy = 1;
+
+    while (busy) {
+        double t = now(), wake = 0;
+        int npfds = 0;
+
+        busy = 0;
+        for (i = 0; i < w->nconns; i++) {
+            conn_t *c = &w->conns[i];
+
+            fill(c, t);
+            flush(c);
+            if (!c->done && measuring && rate > 0 && c->in_flight < depth &&
+                (wake == 0 || c->next_due < wake)) {
+                wake = c->next_due;
+            }
+            if (c->done && c->in_flight == 0) continue;
+            busy = 1;
+            polled[npfds] = c;
+            pfds[npfds].fd = c->fd;
+            pfds[npfds].events = POLLIN | (c->woff < c->wlen ? POLLOUT : 0);
+            pfds[npfds++].revents = 0;
+        }
+        if (!busy) break;
+
+        // wake up for the next command due, or the end of the run
+        if (measuring && duration > 0 && t < end && (wake == 0 || end < wake)) {
+            wake = end;
+        }
+        if (wake > 0) {
+            struct timespec ts;
+            double dt = wake > t ? wake - t : 0;
+
+            ts.tv_sec = (time_t)dt;
+            ts.tv_nsec = (long)((dt - ts.tv_sec) * 1e9);
+            if (ppoll(pfds, npfds, &ts, NULL) < 0 && errno != EINTR) {
+                perror("ppoll");
+                exit(1);
+            }
+        } else if (poll(pfds, npfds, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+
+        for (i = 0; i < npfds; i++) {
+            if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                receive(w, polled[i]);
+            }
+        }
+    }
+}
+
+static void *work(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    int i;
+
+    if (preload) {
+        run(w);
+        for (i = 0; i < w->nconns; i++) w->conns[i].done = 0;
+    }
+
+    // the measurement starts when every connection is ready
+    if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        start = now();
+        end = start + duration;
+        measuring = 1;
+    }
+    pthread_barrier_wait(&barrier);
+
+    for (i = 0; i < w->nconns; i++) {
+        conn_t *c = &w->conns[i];
+
+        if (rate > 0) c->next_due = start + c->index / rate;
+        if (c->script != NULL) c->next = 0;
+        else if (dist == DIST_SEQ) c->next = nkeys * c->index / nconns;
+    }
+    w->finish = start;
+    run(w);
+    return NULL;
+}
+
+static void print_latencies(const char *label, const histogram_t *h) {
+    if (h->total == 0) return;
+    printf("%-9s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", label,
+           (unsigned long)h->total, h->sum / h->total / 1e3,
+           hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+           hist_percentile(h, 0.999) / 1e3, hist_percentile(h, 0.9999) / 1e3,
+           h->max / 1e3);
+}
+
+static void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-c connections] [-w depth] [-r rate] "
+            "[-d seconds] [-b] [-H]\n"
+            "       [-x read%%] [-k keys] [-D uniform|zipf|seq] [-z theta] "
+            "[-P]\n"
+            "       [-s <script>[,<script>...]] <servername> <port>\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    worker_t *workers;
+    static histogram_t reads, writes, all;
+    uint64_t ill_formed = 0, queries = 0, found = 0, unsent = 0;
+    double finish = 0, elapsed;
+    char *paths = NULL;
+    int i, opt, distribution = 0;
+
+    while ((opt = getopt(argc, argv, "t:c:w:r:d:bHx:k:D:z:Ps:")) != -1) {
+        switch (opt) {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'c':
+                nconns = atoi(optarg);
+                break;
+            case 'w':
+                depth = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'b':
+                binary = 1;
+                break;
+            case 'H':
+                distribution = 1;
+                break;
+            case 'x':
+                read_percent = atoi(optarg);
+                break;
+            case 'k':
+                nkeys = atol(optarg);
+                break;
+            case 'D':
+                if (strcmp(optarg, "uniform") == 0) {
+                    dist = DIST_UNIFORM;
+                } else if (strcmp(optarg, "zipf") == 0) {
+                    dist = DIST_ZIPF;
+                } else if (strcmp(optarg, "seq") == 0) {
+                    dist = DIST_SEQ;
+                } else {
+                    usage_error(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'z':
+                theta = atof(optarg);
+                break;
+            case 'P':
+                preload = 1;
+                break;
+            case 's':
+                paths = optarg;
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+    if (nconns == 0) nconns = nthreads;
+    if (argc - optind != 2 || nthreads < 1 || nconns < nthreads ||
+        depth < 1 || rate < 0 || duration < 0 || read_percent < 0 ||
+        read_percent > 100 || nkeys < 1 || theta <= 0 || theta >= 1) {
+        usage_error(argv[0]);
+        return 1;
+    }
+    server = argv[optind];
+    port = argv[optind + 1];
+
+    if (paths != NULL) {
+        char *path;
+
+        for (path = strtok(paths, ","); path != NULL;
+             path = strtok(NULL, ",")) {
+            if (nscripts == MAXSCRIPTS || load_script(&scripts[nscripts++],
+                                                      path) < 0) {
+                fprintf(stderr, "Error opening script file %s\n", path);
+                return 1;
+            }
+        }
+        if (rate > 0 && duration == 0) {
+            fprintf(stderr, "-r needs -d with scripts\n");
+            return 1;
+        }
+    } else {
+        if (duration == 0) duration = 10;
+        if (dist == DIST_ZIPF) zipf_init(&zipf, nkeys, theta);
+    }
+
+    // connections are dealt out to the threads in turn
+    workers = calloc(nthreads, sizeof(worker_t));
+    for (i = 0; i < nthreads; i++) {
+        workers[i].conns = calloc(nconns / nthreads + 1, sizeof(conn_t));
+    }
+    for (i = 0; i < nconns; i++) {
+        worker_t *w = &workers[i % nthreads];
+        conn_t *c = &w->conns[w->nconns++];
+
+        if ((c->fd = get_socket()) == -1) return 1;
+        if (binary && send(c->fd, "\xb1", 1, MSG_NOSIGNAL) != 1) {
+            fprintf(stderr, "No connection!\n");
+            return 1;
+        }
+        c->index = i;
+        c->wbuf = malloc((size_t)depth * reqmax);
+        c->due = malloc(depth * sizeof(double));
+        c->ops = malloc(depth);
+        c->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        c->next = nkeys * i / nconns;
+        c->last = nkeys * (i + 1) / nconns;
+        if (nscripts > 0) c->script = &scripts[i % nscripts];
+    }
+
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    memset(&reads, 0, sizeof(reads));
+    memset(&writes, 0, sizeof(writes));
+    for (i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        int j;
+
+        pthread_join(w->thread, NULL);
+        hist_add(&reads, &w->reads);
+        hist_add(&writes, &w->writes);
+        ill_formed += w->ill_formed;
+        queries += w->queries;
+        found += w->found;
+        if (w->finish > finish) finish = w->finish;
+        for (j = 0; j < w->nconns; j++) {
+            conn_t *c = &w->conns[j];
+
+            // the commands that fell due before the end but were never sent
+            if (rate > 0 && c->next_due < end) {
+                unsent += (uint64_t)ceil((end - c->next_due) * rate / nconns);
+            }
+            close(c->fd);
+        }
+    }
+    all = reads;
+    hist_add(&all, &writes);
+
+    elapsed = finish - start;
+    printf("%lu commands in %.2f s: %.0f/s", (unsigned long)all.total,
+           elapsed, elapsed > 0 ? all.total / elapsed : 0);
+    if (rate > 0) {
+        printf(" (%.0f/s asked for, %lu not sent)", rate,
+               (unsigned long)unsent);
+    }
+    printf("\n%d connections on %d threads, up to %d in flight each, %s "
+           "protocol\n",
+           nconns, nthreads, depth, binary ? "binary" : "text");
+    if (queries > 0) {
+        printf("%.1f%% of %lu queries found, ", 100.0 * found / queries,
+               (unsigned long)queries);
+    }
+    printf("%lu ill-formed\n", (unsigned long)ill_formed);
+
+    printf("\nlatency (us)   count      mean       p50       p99      p999"
+           "     p9999       max\n");
+    print_latencies("read", &reads);
+    print_latencies("write", &writes);
+    print_latencies("all", &all);
+    if (distribution && all.total > 0) {
+        printf("\n");
+        hist_print_distribution(&all);
+    }
+    return 0;
+}
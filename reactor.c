@@ -0,0 +1,672 @@
+#define _GNU_SOURCE  // accept4
+#include "./reactor.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./frame.h"
+#include "./stats.h"
+
+#define WBUF_HIGH 65536   // stop reading while this much output is queued
+#define READS_PER_TURN 16 // reads before a busy connection goes to the back
+#define MAX_EVENTS 64
+#define TASK_REQUESTS 32  // requests an executor runs before the next turn
+#define RUNQ_SIZE 256     // connections an executor can hold back
+
+typedef struct conn {
+    int fd;
+    int epfd;  // epoll instance of the reactor that accepted it
+    int mode;  // COMM_TEXT, COMM_FRAME or COMM_UNKNOWN, see comm.h
+
+    char rbuf[RBUFLEN + 1];  // + a terminator after a command that fills it
+    size_t rstart;  // first byte of rbuf not yet executed
+    size_t rlen;
+    int eof;   // the client is done sending; close once all is answered
+    int more;  // requests are left that an executor stopped short of
+
+    char *wbuf;   // responses not yet written to the socket
+    size_t woff;  // first byte of wbuf not yet written
+    size_t wlen;
+    size_t wcap;
+
+    struct conn *next_ready;  // work queue
+
+    // For the list of all connections
+    struct conn *prev;
+    struct conn *next;
+} conn_t;
+
+/* Connections with pending events, waiting for a worker. */
+typedef struct work_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t nonempty;
+    conn_t *head;
+    conn_t *tail;
+} work_queue_t;
+
+/*
+ * An executor (steal mode) and its run queue, a ring of connections that
+ * still have requests to run: only the owner adds them, at the tail, and
+ * the owner and every idle executor take them from the head. The owner
+ * takes the oldest rather than the newest (as Chase-Lev deques would), so
+ * that the connections it holds take turns.
+ */
+typedef struct executor {
+    uint32_t head;  // advanced with a compare-and-swap by whoever takes
+    uint32_t tail;  // only written by the owner
+    conn_t *runq[RUNQ_SIZE];
+    int index;
+} __attribute__((aligned(64))) executor_t;
+
+static int reactor_port;
+static int reactor_nlisteners;
+static int reactor_steal;
+static executor_t *executors;
+static int nexecutors;
+static int idle;  // executors asleep on queue.nonempty
+static command_handler_t handler;
+static frame_handler_t frame_handler;
+
+static work_queue_t queue = {PTHREAD_MUTEX_INITIALIZER,
+                             PTHREAD_COND_INITIALIZER, NULL, NULL};
+
+static conn_t *conn_list_head;
+static pthread_mutex_t conn_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *reactor(void *arg);
+static void *worker(void *arg);
+static void *executor(void *arg);
+
+pthread_t start_reactor(int port, int nlisteners, int nworkers, int steal,
+                        command_handler_t h, frame_handler_t fh) {
+    pthread_t first = 0, tid;
+    int err;
+
+    reactor_port = port;
+    reactor_nlisteners = nlisteners;
+    reactor_steal = steal;
+    handler = h;
+    frame_handler = fh;
+
+    if (steal) {
+        if ((executors = (executor_t *)aligned_alloc(
+                 64, nworkers * sizeof(executor_t))) == NULL) {
+            perror("aligned_alloc");
+            exit(1);
+        }
+        memset(executors, 0, nworkers * sizeof(executor_t));
+        nexecutors = nworkers;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        if (steal) {
+            executors[i].index = i;
+            err = pthread_create(&tid, 0, executor, &executors[i]);
+        } else {
+            err = pthread_create(&tid, 0, worker, NULL);
+        }
+        if (err) handle_error_en(err, "pthread_create");
+        if ((err = pthread_detach(tid))) handle_error_en(err, "pthread_detach");
+    }
+
+    for (intptr_t i = 0; i < nlisteners; i++) {
+        if ((err = pthread_create(&tid, 0, reactor, (void *)i)))
+            handle_error_en(err, "pthread_create");
+        if ((err = pthread_detach(tid))) handle_error_en(err, "pthread_detach");
+        if (i == 0) first = tid;
+    }
+
+    return first;
+}
+
+static void queue_push(conn_t *c) {
+    pthread_mutex_lock(&queue.mutex);
+    c->next_ready = NULL;
+    if (queue.tail == NULL) {
+        queue.head = c;
+    } else {
+        queue.tail->next_ready = c;
+    }
+    queue.tail = c;
+    pthread_cond_signal(&queue.nonempty);
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+/* Takes the first connection in the queue, if any, without waiting. */
+static conn_t *queue_trypop(void) {
+    conn_t *c;
+
+    pthread_mutex_lock(&queue.mutex);
+    if ((c = queue.head) != NULL && (queue.head = c->next_ready) == NULL) {
+        queue.tail = NULL;
+    }
+    pthread_mutex_unlock(&queue.mutex);
+
+    return c;
+}
+
+static conn_t *queue_pop(void) {
+    conn_t *c;
+
+    pthread_mutex_lock(&queue.mutex);
+    while (queue.head == NULL) {
+        pthread_cond_wait(&queue.nonempty, &queue.mutex);
+    }
+    c = queue.head;
+    if ((queue.head = c->next_ready) == NULL) queue.tail = NULL;
+    pthread_mutex_unlock(&queue.mutex);
+
+    return c;
+}
+
+static void conn_unlink(conn_t *c) {
+    pthread_mutex_lock(&conn_list_mutex);
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        conn_list_head = c->next;
+    }
+    if (c->next != NULL) c->next->prev = c->prev;
+    pthread_mutex_unlock(&conn_list_mutex);
+}
+
+/* Registers a freshly accepted socket. Returns 0, or -1 if the
+ * connection could not be set up (the socket is then closed). */
+static int conn_constructor(int epfd, int fd) {
+    conn_t *c;
+    struct epoll_event ev;
+
+    if ((c = (conn_t *)calloc(1, sizeof(conn_t))) == NULL) {
+        perror("calloc");
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    c->epfd = epfd;
+    c->mode = COMM_UNKNOWN;
+
+    pthread_mutex_lock(&conn_list_mutex);
+    c->next = conn_list_head;
+    if (conn_list_head != NULL) conn_list_head->prev = c;
+    conn_list_head = c;
+    pthread_mutex_unlock(&conn_list_mutex);
+    stats_connection(1);
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        conn_unlink(c);
+        stats_connection(-1);
+        close(fd);
+        free(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Closes the connection and frees it. Only the worker that owns the
+ * connection may call this. */
+static void conn_destructor(conn_t *c) {
+    conn_unlink(c);
+    stats_connection(-1);
+
+    // closing the socket also removes it from the epoll set
+    if (close(c->fd) < 0) perror("close");
+    free(c->wbuf);
+    free(c);
+
+    fprintf(stderr, "client connection terminated\n");
+}
+
+/* Hands the connection back to the reactor, which passes it to a worker
+ * again once one of the given events occurs. Once the client is done
+ * sending, its half-close is not an event any more (it would fire again
+ * and again while the replies wait for room). */
+static int conn_arm(conn_t *c, unsigned int events) {
+    struct epoll_event ev;
+
+    ev.events = events | (c->eof ? 0 : EPOLLRDHUP) | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/* Makes room for n more bytes of output. Returns where they go, or NULL
+ * if out of memory. */
+static char *conn_reserve(conn_t *c, size_t n) {
+    if (c->wlen + n > c->wcap) {
+        size_t cap = c->wcap ? c->wcap : RESPLEN;
+        char *wbuf;
+
+        while (c->wlen + n > cap) cap *= 2;
+        if ((wbuf = (char *)realloc(c->wbuf, cap)) == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        c->wbuf = wbuf;
+        c->wcap = cap;
+    }
+    return c->wbuf + c->wlen;
+}
+
+/* Writes as much queued output as the socket accepts. Returns 0, or -1
+ * if the connection is broken. */
+static int conn_flush(conn_t *c) {
+    while (c->woff < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->woff += n;
+    }
+    c->woff = c->wlen = 0;
+    return 0;
+}
+
+/* Executes the complete commands in the read buffer (see
+ * comm_line_length), up to *budget of them, counting them off. If eof is
+ * set, a final line without a newline is executed too. Commands are
+ * executed where they lie, and their replies are written straight into the
+ * output buffer. Returns where the next command starts, or -1 if the
+ * connection has to be closed. */
+static int conn_execute_text(conn_t *c, size_t start, int eof, int *budget) {
+    size_t len;
+
+    while (*budget > 0 &&
+           (len = comm_line_length(c->rbuf + start, c->rlen - start, eof)) >
+               0) {
+        char *command = c->rbuf + start;
+        char *reply, saved;
+        size_t n;
+
+        if ((reply = conn_reserve(c, RESPLEN)) == NULL) return -1;
+
+        // terminate the line in place, then put back the byte after it
+        saved = command[len];
+        command[len] = '\0';
+        reply[0] = '\0';
+        handler(command, reply, RESPLEN);
+        command[len] = saved;
+        start += len;
+        (*budget)--;
+
+        if ((n = strlen(reply)) > 0) {
+            reply[n] = '\n';
+            c->wlen += n + 1;
+        }
+    }
+
+    return start;
+}
+
+/* Executes the complete request frames in the read buffer, up to *budget
+ * of them. They are handled where they lie, and their replies are written
+ * straight into the output buffer. */
+static int conn_execute_frames(conn_t *c, size_t start, int *budget) {
+    ssize_t len = 0;
+
+    while (*budget > 0 &&
+           (len = comm_frame_length(c->rbuf + start, c->rlen - start)) > 0) {
+        char *reply;
+
+        if ((reply = conn_reserve(c, FRAME_REPLY_MAX)) == NULL) return -1;
+        c->wlen += frame_handler(c->rbuf + start, reply);
+        start += len;
+        (*budget)--;
+    }
+
+    return len < 0 ? -1 : (int)start;  // start is within rbuf
+}
+
+/* Executes up to budget of the complete requests the read buffer holds,
+ * in the protocol the client picked with its first byte. Returns 1 if it
+ * stopped for the budget, 0 if it ran out of requests, or -1 if the
+ * connection has to be closed. */
+static int conn_execute(conn_t *c, int eof, int budget) {
+    int start = c->rstart;
+
+    if (c->mode == COMM_UNKNOWN && c->rlen > (size_t)start) {
+        if ((unsigned char)c->rbuf[start] == FRAME_MAGIC) {
+            c->mode = COMM_FRAME;
+            start++;
+        } else {
+            c->mode = COMM_TEXT;
+        }
+    }
+
+    if (c->mode == COMM_FRAME) {
+        start = conn_execute_frames(c, start, &budget);
+    } else if (c->mode == COMM_TEXT) {
+        start = conn_execute_text(c, start, eof, &budget);
+    }
+    if (start < 0) return -1;
+
+    c->rstart = start;
+    return budget == 0;
+}
+
+/* Moves the unexecuted input to the front of the read buffer, to make
+ * room for more. */
+static void conn_compact(conn_t *c) {
+    memmove(c->rbuf, c->rbuf + c->rstart, c->rlen - c->rstart);
+    c->rlen -= c->rstart;
+    c->rstart = 0;
+}
+
+/* Serves a connection until it would block, then re-arms it. Called by
+ * the one worker that currently owns the connection. */
+static void conn_run(conn_t *c) {
+    int reads = 0;
+
+    while (1) {
+        ssize_t n;
+
+        if (c->wlen > 0) {
+            if (conn_flush(c) < 0) break;
+            // wait for the client to read what it asked for
+            if (c->wlen >= WBUF_HIGH || (c->eof && c->wlen > 0)) {
+                if (conn_arm(c, EPOLLOUT) < 0) break;
+                return;
+            }
+        }
+        if (c->eof) break;  // and every reply has been sent
+
+        if (reads++ == READS_PER_TURN) {
+            // let other connections have a turn
+            if (conn_arm(c, c->wlen > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN) < 0)
+                break;
+            return;
+        }
+
+        conn_compact(c);
+        n = recv(c->fd, c->rbuf + c->rlen, RBUFLEN - c->rlen, 0);
+        if (n > 0) {
+            c->rlen += n;
+            if (conn_execute(c, 0, INT_MAX) < 0) break;
+        } else if (n == 0) {
+            // the client is done; answer what it sent, and hang up once
+            // the replies are out
+            c->eof = 1;
+            if (conn_execute(c, 1, INT_MAX) < 0) break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (conn_flush(c) < 0) break;
+            if (conn_arm(c, c->wlen > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN) < 0)
+                break;
+            return;
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+
+    conn_destructor(c);
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    while (1) {
+        conn_run(queue_pop());
+    }
+    return NULL;
+}
+
+/* Adds a connection to the executor's run queue. Only the owner may call
+ * this. Returns 0, or -1 if the queue is full. */
+static int runq_push(executor_t *e, conn_t *c) {
+    uint32_t tail = e->tail;
+
+    if (tail - __atomic_load_n(&e->head, __ATOMIC_ACQUIRE) == RUNQ_SIZE) {
+        return -1;
+    }
+    __atomic_store_n(&e->runq[tail % RUNQ_SIZE], c, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->tail, tail + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/* Takes the oldest connection from an executor's run queue, or returns
+ * NULL if it is empty. Any executor may call this. */
+static conn_t *runq_take(executor_t *e) {
+    uint32_t head = __atomic_load_n(&e->head, __ATOMIC_ACQUIRE);
+
+    while (head != __atomic_load_n(&e->tail, __ATOMIC_SEQ_CST)) {
+        // the slot may be reused once head moves on, in which case the
+        // compare-and-swap fails and what was read is thrown away
+        conn_t *c = __atomic_load_n(&e->runq[head % RUNQ_SIZE],
+                                    __ATOMIC_RELAXED);
+
+        if (__atomic_compare_exchange_n(&e->head, &head, head + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/* Returns 1 if any executor has connections in its run queue. */
+static int runqs_nonempty(void) {
+    for (int i = 0; i < nexecutors; i++) {
+        executor_t *e = &executors[i];
+
+        if (__atomic_load_n(&e->head, __ATOMIC_SEQ_CST) !=
+            __atomic_load_n(&e->tail, __ATOMIC_SEQ_CST)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns the next connection the executor should run requests of,
+ * waiting for one if there are none: first new work from the reactors,
+ * so that a busy connection cannot hold up the rest, then its own run
+ * queue, then the other executors' run queues. */
+static conn_t *executor_next(executor_t *self) {
+    conn_t *c;
+
+    while (1) {
+        if (__atomic_load_n(&queue.head, __ATOMIC_RELAXED) != NULL &&
+            (c = queue_trypop()) != NULL) {
+            return c;
+        }
+        if ((c = runq_take(self)) != NULL) return c;
+        for (int i = 1; i < nexecutors; i++) {
+            if ((c = runq_take(&executors[(self->index + i) % nexecutors]))) {
+                return c;
+            }
+        }
+
+        // Nothing anywhere. Whoever adds to a run queue afterwards sees
+        // that an executor is idle and wakes it up.
+        pthread_mutex_lock(&queue.mutex);
+        __atomic_add_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+        while (queue.head == NULL && !runqs_nonempty()) {
+            pthread_cond_wait(&queue.nonempty, &queue.mutex);
+        }
+        __atomic_sub_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&queue.mutex);
+    }
+}
+
+/* Runs a turn's worth of a connection's requests and sends the replies.
+ * If it has more, it goes to the back of the executor's run queue, where
+ * idle executors can steal it; otherwise it goes back to its reactor,
+ * which reads the next requests. */
+static void conn_work(executor_t *self, conn_t *c) {
+    int more;
+
+    if ((more = conn_execute(c, c->eof, TASK_REQUESTS)) < 0 ||
+        (c->wlen > 0 && conn_flush(c) < 0)) {
+        conn_destructor(c);
+        return;
+    }
+
+    if (more && c->wlen < WBUF_HIGH) {
+        if (runq_push(self, c) < 0) {
+            queue_push(c);
+        } else if (__atomic_load_n(&idle, __ATOMIC_SEQ_CST) > 0) {
+            pthread_mutex_lock(&queue.mutex);
+            pthread_cond_signal(&queue.nonempty);
+            pthread_mutex_unlock(&queue.mutex);
+        }
+        return;
+    }
+
+    c->more = more;
+    if (!more && c->eof && c->wlen == 0) {
+        // everything the client sent is answered, and the answers sent
+        conn_destructor(c);
+    } else if (conn_arm(c, c->eof          ? EPOLLOUT
+                           : c->wlen > 0 ? EPOLLIN | EPOLLOUT
+                                         : EPOLLIN) < 0) {
+        conn_destructor(c);
+    }
+}
+
+static void *executor(void *arg) {
+    executor_t *self = (executor_t *)arg;
+
+    while (1) {
+        conn_work(self, executor_next(self));
+    }
+    return NULL;
+}
+
+/* Steal mode: sends what output the socket takes and reads what has
+ * arrived, on the reactor thread, then hands the connection to the
+ * executors if it has requests to run, or re-arms it. */
+static void conn_io(conn_t *c) {
+    int got = 0;
+
+    if (c->wlen > 0) {
+        if (conn_flush(c) < 0) goto drop;
+        // wait for the client to read what it asked for
+        if (c->wlen >= WBUF_HIGH) {
+            if (conn_arm(c, EPOLLOUT) < 0) goto drop;
+            return;
+        }
+    }
+    if (c->eof && !c->more) {
+        // everything is answered: close once the replies are out
+        if (c->wlen == 0 || conn_arm(c, EPOLLOUT) < 0) goto drop;
+        return;
+    }
+
+    conn_compact(c);
+    while (!c->eof && c->rlen < RBUFLEN) {
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, RBUFLEN - c->rlen, 0);
+
+        if (n > 0) {
+            c->rlen += n;
+            got = 1;
+        } else if (n == 0) {
+            c->eof = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            goto drop;
+        }
+    }
+
+    if (got || c->eof || c->more) {
+        queue_push(c);
+        return;
+    }
+    if (conn_arm(c, c->wlen > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN) == 0) return;
+
+drop:
+    conn_destructor(c);
+}
+
+/* Accepts every pending connection on the listening socket. */
+static void accept_all(int epfd, int lsock) {
+    while (1) {
+        int csock;
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        if ((csock = accept4(lsock, (struct sockaddr *)&client_addr,
+                             &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+
+        fprintf(stderr, "received connection from %s#%hu\n",
+                inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+
+        conn_constructor(epfd, csock);
+    }
+}
+
+static void *reactor(void *arg) {
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    int epfd, lsock;
+
+    if (reactor_nlisteners > 1) comm_pin_to_cpu((intptr_t)arg);
+    lsock = comm_bind(reactor_port, reactor_nlisteners > 1);
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    if (fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(1);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // the listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno != EINTR) perror("epoll_wait");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_all(epfd, lsock);
+            } else if (reactor_steal) {
+                conn_io((conn_t *)events[i].data.ptr);
+            } else {
+                queue_push((conn_t *)events[i].data.ptr);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Disconnects every client. Each socket is shut down rather than closed,
+ * so that its owner (or the next worker to pick it up, since shutting it
+ * down wakes up epoll) sees the end of the stream and frees it. */
+void reactor_drop_clients(void) {
+    pthread_mutex_lock(&conn_list_mutex);
+    for (conn_t *c = conn_list_head; c != NULL; c = c->next) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn_list_mutex);
+}
@@ -0,0 +1,47 @@
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <pthread.h>
+
+/*
+ * Event-driven alternative to the thread-per-connection listener in
+ * comm.c. A reactor thread waits on every socket with epoll and hands the
+ * connections that have something to read (or, after a short write, room
+ * to write) to a fixed pool of worker threads. With several reactors, each
+ * one accepts on its own SO_REUSEPORT socket, is pinned to a CPU and
+ * watches only the connections it accepted; they share the workers.
+ * Sockets are non-blocking and each connection owns a read and a write
+ * buffer, so an idle client costs a few kilobytes instead of a thread
+ * stack.
+ * Each connection speaks either the text protocol or, if its first byte
+ * says so, the binary one (see frame.h).
+ *
+ * A connection is owned by at most one worker at a time (its epoll
+ * registration is one-shot and only re-armed once the worker is done with
+ * it), so its commands are executed and answered strictly in order.
+ *
+ * With steal set, the reactor threads read the requests themselves, and
+ * the workers become executors that only run them: a connection with
+ * requests goes to a queue shared by the executors, and an executor runs
+ * at most a few dozen of them before the connection goes to the back of
+ * its own run queue, from which idle executors steal. A client that sends
+ * many requests at once, or a slow one, then only holds up the executor
+ * it is on for one turn, and the others take over what it had queued.
+ * Replies are still sent in order, by the executor, as soon as a turn is
+ * done; the reactor only sends what the socket would not take at once.
+ */
+
+/* Executes one command line and writes up to len-1 bytes of the reply to
+ * response, like interpret_command. */
+typedef void (*command_handler_t)(char *command, char *response, int len);
+
+/* Executes one binary request and writes the reply, at most
+ * FRAME_REPLY_MAX bytes, to reply; returns its length. See frame.h. */
+typedef int (*frame_handler_t)(char *frame, char *reply);
+
+extern pthread_t start_reactor(int port, int nlisteners, int nworkers,
+                               int steal, command_handler_t handler,
+                               frame_handler_t frame_handler);
+extern void reactor_drop_clients(void);
+
+#endif  // REACTOR_H_
@@ -0,0 +1,247 @@
+#include "./scan.h"
+#include <stdint.h>
+#include <string.h>
+
+/* Plain C, for any CPU. Comparing is left to the C library's memcmp. */
+
+static inline int is_space(unsigned char ch) {
+    return ch == ' ' || (unsigned char)(ch - '\t') <= '\r' - '\t';
+}
+
+static const char *space_scalar(const char *p, const char *end) {
+    while (p < end && !is_space(*p)) p++;
+    return p;
+}
+
+static const char *line_scalar(const char *p, const char *end) {
+    while (p < end && *p != '\n' && *p != '\0') p++;
+    return p;
+}
+
+static const scan_kernels_t scalar_kernels = {
+    "scalar", space_scalar, line_scalar, memcmp,
+};
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* Compares 8 bytes as big-endian numbers, which order like the bytes. */
+static inline int compare8(const unsigned char *a, const unsigned char *b) {
+    uint64_t x, y;
+
+    memcpy(&x, a, 8);
+    memcpy(&y, b, 8);
+    if (x == y) return 0;
+    return __builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1;
+}
+
+static inline int compare4(const unsigned char *a, const unsigned char *b) {
+    uint32_t x, y;
+
+    memcpy(&x, a, 4);
+    memcpy(&y, b, 4);
+    if (x == y) return 0;
+    return __builtin_bswap32(x) < __builtin_bswap32(y) ? -1 : 1;
+}
+
+/* Compares fewer than 16 bytes with two loads of 8 (or 4) that overlap
+ * as much as they have to: the first bytes and the last. */
+static inline int compare_short(const unsigned char *a, const unsigned char *b,
+                                size_t n) {
+    int cmp;
+
+    if (n >= 8) {
+        if ((cmp = compare8(a, b)) != 0) return cmp;
+        return compare8(a + n - 8, b + n - 8);
+    }
+    if (n >= 4) {
+        if ((cmp = compare4(a, b)) != 0) return cmp;
+        return compare4(a + n - 4, b + n - 4);
+    }
+    for (; n > 0; a++, b++, n--) {
+        if (*a != *b) return *a - *b;
+    }
+    return 0;
+}
+
+/* The index of the first of the 16 bytes at a and b that differ, or -1. */
+static inline int mismatch16(const unsigned char *a, const unsigned char *b) {
+    unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)a), _mm_loadu_si128((const __m128i *)b)));
+
+    return m == 0xffff ? -1 : __builtin_ctz(~m);
+}
+
+/* One bit per byte of v that is whitespace: ' ', or '\t' to '\r', which
+ * are the bytes that are at most 4 once '\t' is taken off (unsigned). */
+static inline unsigned int space_mask_sse2(__m128i v) {
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i ctl =
+        _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t);
+
+    return _mm_movemask_epi8(
+        _mm_or_si128(ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))));
+}
+
+static inline unsigned int line_mask_sse2(__m128i v) {
+    return _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+}
+
+static const char *space_sse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        unsigned int m = space_mask_sse2(_mm_loadu_si128((const __m128i *)p));
+
+        if (m != 0) return p + __builtin_ctz(m);
+    }
+    return space_scalar(p, end);
+}
+
+static const char *line_sse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        unsigned int m = line_mask_sse2(_mm_loadu_si128((const __m128i *)p));
+
+        if (m != 0) return p + __builtin_ctz(m);
+    }
+    return line_scalar(p, end);
+}
+
+/* Compares n bytes 16 at a time; the last (partial) block is loaded so
+ * that it ends at the last byte, overlapping the one before. */
+static int compare_sse2(const void *a, const void *b, size_t n) {
+    const unsigned char *x = a, *y = b;
+    int i;
+
+    if (n < 16) return compare_short(x, y, n);
+    for (; n > 16; x += 16, y += 16, n -= 16) {
+        if ((i = mismatch16(x, y)) >= 0) return x[i] - y[i];
+    }
+    x += n - 16;
+    y += n - 16;
+    if ((i = mismatch16(x, y)) >= 0) return x[i] - y[i];
+    return 0;
+}
+
+static const scan_kernels_t sse2_kernels = {
+    "sse2", space_sse2, line_sse2, compare_sse2,
+};
+
+/* The same 32 bytes at a time. What is left over is done here as well,
+ * 16 bytes at a time with the SSE2 masks (inlined, so in AVX encoding):
+ * calling the SSE2 kernels for it would switch between AVX and legacy SSE
+ * code with the upper halves of the registers dirty, which can cost more
+ * than the whole comparison. */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline unsigned int space_mask_avx2(__m256i v) {
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i ctl =
+        _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t);
+
+    return _mm256_movemask_epi8(
+        _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))));
+}
+
+AVX2 static inline unsigned int line_mask_avx2(__m256i v) {
+    return _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+}
+
+AVX2 static const char *space_avx2(const char *p, const char *end) {
+    unsigned int m;
+
+    for (; end - p >= 32; p += 32) {
+        m = space_mask_avx2(_mm256_loadu_si256((const __m256i *)p));
+        if (m != 0) return p + __builtin_ctz(m);
+    }
+    if (end - p >= 16) {
+        m = space_mask_sse2(_mm_loadu_si128((const __m128i *)p));
+        if (m != 0) return p + __builtin_ctz(m);
+        p += 16;
+    }
+    while (p < end && !is_space(*p)) p++;
+    return p;
+}
+
+AVX2 static const char *line_avx2(const char *p, const char *end) {
+    unsigned int m;
+
+    for (; end - p >= 32; p += 32) {
+        m = line_mask_avx2(_mm256_loadu_si256((const __m256i *)p));
+        if (m != 0) return p + __builtin_ctz(m);
+    }
+    if (end - p >= 16) {
+        m = line_mask_sse2(_mm_loadu_si128((const __m128i *)p));
+        if (m != 0) return p + __builtin_ctz(m);
+        p += 16;
+    }
+    while (p < end && *p != '\n' && *p != '\0') p++;
+    return p;
+}
+
+/* The index of the first of the 32 bytes at a and b that differ, or -1. */
+AVX2 static inline int mismatch32(const unsigned char *a,
+                                  const unsigned char *b) {
+    unsigned int m = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)a),
+                          _mm256_loadu_si256((const __m256i *)b)));
+
+    return m == 0xffffffff ? -1 : __builtin_ctz(~m);
+}
+
+AVX2 static int compare_avx2(const void *a, const void *b, size_t n) {
+    const unsigned char *x = a, *y = b;
+    int i;
+
+    if (n < 16) return compare_short(x, y, n);
+    if (n <= 32) {
+        if ((i = mismatch16(x, y)) >= 0) return x[i] - y[i];
+        x += n - 16;
+        y += n - 16;
+        if ((i = mismatch16(x, y)) >= 0) return x[i] - y[i];
+        return 0;
+    }
+    for (; n > 32; x += 32, y += 32, n -= 32) {
+        if ((i = mismatch32(x, y)) >= 0) return x[i] - y[i];
+    }
+    x += n - 32;
+    y += n - 32;
+    if ((i = mismatch32(x, y)) >= 0) return x[i] - y[i];
+    return 0;
+}
+
+static const scan_kernels_t avx2_kernels = {
+    "avx2", space_avx2, line_avx2, compare_avx2,
+};
+#endif  // __x86_64__
+
+scan_kernels_t scan_kernels = {
+    "scalar", space_scalar, line_scalar, memcmp,
+};
+
+int scan_use(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        scan_kernels = scalar_kernels;
+        return 0;
+    }
+#if defined(__x86_64__)
+    if (strcmp(name, "sse2") == 0) {
+        scan_kernels = sse2_kernels;
+        return 0;
+    }
+    __builtin_cpu_init();  // we may run before the C library has
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        scan_kernels = avx2_kernels;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+/* Picks the best kernels before main runs, so that no caller has to. */
+__attribute__((constructor)) static void scan_init(void) {
+    if (scan_use("avx2") < 0) scan_use("sse2");
+}
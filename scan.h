@@ -0,0 +1,50 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stddef.h>
+
+/*
+ * Byte-scanning kernels: finding the end of a line or of a word (the f
+ * loader's parser uses them), and comparing names. Each comes as AVX2,
+ * SSE2 and plain C; the best the CPU supports is picked when the program
+ * starts (SSE2 is always there on x86-64, elsewhere only plain C is
+ * built). The engines still compare names with memcmp: the C library
+ * picks a vector version of its own, which scan_bench finds as fast as
+ * these on short names and faster on long ones.
+ *
+ * The kernels never read outside p..end-1 (or the n bytes compared), so
+ * the buffers need no padding and no terminator: a block of 32 or 16
+ * bytes is only loaded where it lies wholly inside them.
+ */
+
+typedef struct scan_kernels {
+    const char *name;  // "avx2", "sse2" or "scalar"
+    // the first byte of p..end-1 that is whitespace (isspace in the C
+    // locale), or end
+    const char *(*space)(const char *p, const char *end);
+    // the first '\n' or '\0' in p..end-1, or end
+    const char *(*line)(const char *p, const char *end);
+    // memcmp
+    int (*compare)(const void *a, const void *b, size_t n);
+} scan_kernels_t;
+
+extern scan_kernels_t scan_kernels;  // the ones in use
+
+/* Switches to the named kernels ("avx2", "sse2" or "scalar"), for
+ * benchmarks. Returns 0, or -1 if they are not built or the CPU lacks
+ * them. */
+extern int scan_use(const char *name);
+
+static inline const char *scan_space(const char *p, const char *end) {
+    return scan_kernels.space(p, end);
+}
+
+static inline const char *scan_line(const char *p, const char *end) {
+    return scan_kernels.line(p, end);
+}
+
+static inline int scan_compare(const void *a, const void *b, size_t n) {
+    return scan_kernels.compare(a, b, n);
+}
+
+#endif  // SCAN_H_
@@ -0,0 +1,231 @@
+/*
+ * Measures the scanning kernels (see scan.h) on script files, with each
+ * set of kernels the CPU supports in turn.
+ *
+ * Usage: ./scan_bench [-k prefix_len] [-t seconds] <script>...
+ *
+ * parse: every line is split into words the way the f loader reads it,
+ * with scan_line for the end of each line and scan_space for the end of
+ * each word; reported in bytes of script per second.
+ *
+ * lookup: every name (the second word of a line) is looked up by binary
+ * search in the sorted names of the script, each step comparing the
+ * bytes both names have with scan_compare and then their lengths, as the
+ * tree does; reported in comparisons per second. The names in the scripts
+ * are short; -k puts the same prefix_len bytes in front of every one, to
+ * see how the kernels do on long keys that share a prefix (paths, URLs).
+ *
+ * Each measurement is repeated for at least -t seconds (default 0.5).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./db.h"
+#include "./scan.h"
+
+typedef struct name {
+    const char *p;
+    size_t len;
+} name_t;
+
+static const char *const kernels[] = {"scalar", "sse2", "avx2"};
+#define NKERNELS 3
+
+static double min_seconds = 0.5;
+static volatile size_t sink;  // keeps the work from being optimized out
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int name_cmp(const name_t *x, const name_t *y) {
+    size_t n = x->len < y->len ? x->len : y->len;
+    int cmp = scan_compare(x->p, y->p, n);
+
+    if (cmp != 0) return cmp;
+    return x->len < y->len ? -1 : x->len > y->len;
+}
+
+static int name_qsort_cmp(const void *a, const void *b) {
+    return name_cmp(a, b);
+}
+
+/* Splits buf..end-1 into lines and words; returns the number of words. */
+static size_t parse(const char *buf, const char *end) {
+    size_t words = 0;
+
+    for (const char *p = buf; p < end;) {
+        const char *eol = scan_line(p, end);
+
+        while (p < eol) {
+            while (p < eol && (*p == ' ' || (unsigned char)(*p - '\t') <= 4))
+                p++;
+            if (p == eol) break;
+            p = scan_space(p, eol);
+            words++;
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    return words;
+}
+
+/* Looks up every name in sorted[0..n-1]; returns the comparisons made. */
+static size_t lookup(const name_t *names, size_t nnames,
+                     const name_t *sorted, size_t n) {
+    size_t compares = 0;
+
+    for (size_t i = 0; i < nnames; i++) {
+        size_t lo = 0, hi = n;
+
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            int cmp = name_cmp(&names[i], &sorted[mid]);
+
+            compares++;
+            if (cmp == 0) break;
+            if (cmp < 0) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+    }
+    return compares;
+}
+
+/* Reads a whole file into a buffer of exactly its size. */
+static char *read_file(const char *path, size_t *size) {
+    FILE *in;
+    char *buf;
+    long len;
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+    fseek(in, 0, SEEK_END);
+    len = ftell(in);
+    rewind(in);
+    if ((buf = malloc(len > 0 ? len : 1)) == NULL ||
+        fread(buf, 1, len, in) != (size_t)len) {
+        perror(path);
+        free(buf);
+        fclose(in);
+        return NULL;
+    }
+    fclose(in);
+    *size = len;
+    return buf;
+}
+
+/* The second word of every line, behind prefix_len bytes of 'k', copied
+ * into a store of their own. Returns how many there are. */
+static size_t collect_names(const char *buf, size_t size, int prefix_len,
+                            name_t **names, char **store) {
+    const char *end = buf + size;
+    size_t n = 0, used = 0;
+    char *s;
+
+    *names = malloc((size / 2 + 1) * sizeof(name_t));
+    *store = s = malloc(size + (size / 2 + 1) * prefix_len + 1);
+
+    for (const char *p = buf; p < end;) {
+        const char *eol = scan_line(p, end);
+        const char *w = p + 1;
+
+        while (w < eol && (*w == ' ' || *w == '\t')) w++;
+        if (p < eol && w < eol && w > p + 1) {
+            size_t len = scan_space(w, eol) - w;
+
+            memset(s + used, 'k', prefix_len);
+            memcpy(s + used + prefix_len, w, len);
+            (*names)[n].p = s + used;
+            (*names)[n++].len = prefix_len + len;
+            used += prefix_len + len;
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    return n;
+}
+
+static void bench_file(const char *path, int prefix_len) {
+    name_t *names, *sorted;
+    char *buf, *store;
+    size_t size, nnames, nsorted = 0;
+
+    if ((buf = read_file(path, &size)) == NULL) return;
+    nnames = collect_names(buf, size, prefix_len, &names, &store);
+
+    sorted = malloc((nnames + 1) * sizeof(name_t));
+    memcpy(sorted, names, nnames * sizeof(name_t));
+    qsort(sorted, nnames, sizeof(name_t), name_qsort_cmp);
+    for (size_t i = 0; i < nnames; i++) {
+        if (nsorted == 0 || name_cmp(&sorted[nsorted - 1], &sorted[i]) != 0)
+            sorted[nsorted++] = sorted[i];
+    }
+
+    for (int k = 0; k < NKERNELS; k++) {
+        double start, parse_s, lookup_s;
+        size_t bytes = 0, compares = 0;
+
+        if (scan_use(kernels[k]) < 0) continue;
+
+        start = now();
+        do {
+            sink = parse(buf, buf + size);
+            bytes += size;
+        } while ((parse_s = now() - start) < min_seconds);
+
+        start = now();
+        do {
+            compares += lookup(names, nnames, sorted, nsorted);
+        } while ((lookup_s = now() - start) < min_seconds && nnames > 0);
+
+        printf("%-24s %-8s %12.1f %16.0f\n", path, kernels[k],
+               bytes / parse_s / 1e6, compares / lookup_s);
+    }
+
+    free(sorted);
+    free(names);
+    free(store);
+    free(buf);
+}
+
+static void usage_error(const char *cmd) {
+    fprintf(stderr, "Usage: %s [-k prefix_len] [-t seconds] <script>...\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    int prefix_len = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:t:")) != -1) {
+        switch (opt) {
+            case 'k':
+                prefix_len = atoi(optarg);
+                break;
+            case 't':
+                min_seconds = atof(optarg);
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || prefix_len < 0 || prefix_len > MAXLEN) {
+        usage_error(argv[0]);
+        return 1;
+    }
+
+    printf("%-24s %-8s %12s %16s\n", "script", "kernels", "parse MB/s",
+           "lookup cmp/s");
+    for (int i = optind; i < argc; i++) {
+        bench_file(argv[i], prefix_len);
+    }
+    return 0;
+}
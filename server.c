@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -13,10 +14,21 @@
 #include <unistd.h>
 #include "./comm.h"
 #include "./db.h"
+#include "./gate.h"
+#include "./reactor.h"
+#include "./stats.h"
+#include "./uring.h"
 #ifdef __APPLE__
 #include "pthread_OSX.h"
 #endif
 
+#define CLIENT_THREADS 256  // client threads in thread mode, unless -w
+#define CLIENT_BACKLOG 256  // connections that may wait for one, unless -q
+
+// The answer to a connection that neither a client thread nor the backlog
+// has room for, before it is closed
+static const char server_busy[] = "server busy\n";
+
 /*
  * Use the variables in this struct to synchronize your main thread with client
  * threads. Note that all client threads must have terminated before you clean
@@ -28,29 +40,36 @@ typedef struct server_control {
     int num_client_threads;
 } server_control_t;
 
-/*
- * Controls when the clients in the client thread list should be stopped and
- * let go.
- */
-typedef struct client_control {
-    pthread_mutex_t go_mutex;
-    pthread_cond_t go;
-    int stopped;
-} client_control_t;
-
 /*
  * The encapsulation of a client thread, i.e., the thread that handles
  * commands from clients.
  */
 typedef struct client {
     pthread_t thread;
-    FILE *cxstr;  // File stream for input and output
+    comm_conn_t *cxn;  // Connection to read commands from and answer on
+    int dropped;       // set by delete_all: stop serving at the next command
 
     // For client list
     struct client *prev;
     struct client *next;
 } client_t;
 
+/*
+ * Clients accepted in thread mode that wait for a client thread: a ring
+ * the listener adds to. Up to capacity of them may wait on top of the ones
+ * an idle thread is about to take; any more are turned away.
+ */
+typedef struct client_backlog {
+    pthread_mutex_t mutex;
+    pthread_cond_t nonempty;
+    client_t **ring;  // room for every thread's client and capacity more
+    int size;
+    int capacity;
+    int idle;  // client threads waiting for a client
+    int head;  // oldest waiting client
+    int len;
+} client_backlog_t;
+
 /*
  * The encapsulation of a thread that handles signals sent to the server.
  * When SIGINT is sent to the server all client threads should be destroyed.
@@ -60,10 +79,22 @@ typedef struct sig_handler {
     pthread_t thread;
 } sig_handler_t;
 
+/*
+ * How client connections are served: a thread per connection (the listener
+ * in comm.c), a fixed pool of workers driven by epoll (reactor.c), the
+ * same with the reading done by the epoll threads and the requests run by
+ * work-stealing executors (reactor.c), or a few io_uring threads
+ * (uring.c).
+ */
+typedef enum { MODE_THREAD, MODE_EPOLL, MODE_STEAL, MODE_URING } server_mode_t;
+
+static server_mode_t server_mode = MODE_THREAD;
+
 client_t *thread_list_head;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void *run_client(void *arg);
+void *client_thread(void *arg);
 void *monitor_signal(void *arg);
 void thread_cleanup(void *arg);
 
@@ -73,45 +104,43 @@ server_control_t  sct = {
 	0
 };
 
-client_control_t cct = {
+client_backlog_t backlog = {
 	PTHREAD_MUTEX_INITIALIZER,
 	PTHREAD_COND_INITIALIZER,
-	0
+	NULL, 0, 0, 0, 0, 0
 };
 
-// Called by client threads to wait until progress is permitted
-void client_control_wait() {
-    // TODO: Block the calling thread until the main thread calls
-    // client_control_release(). See the client_control_t struct.
-	pthread_mutex_lock (&(cct.go_mutex));
-	while(cct.stopped != 0) {
-		pthread_cond_wait (&(cct.go),&(cct.go_mutex));
-	}
-	pthread_mutex_unlock (&(cct.go_mutex));
-}
+// Starts the client threads of thread mode, nthreads of them, and lets up
+// to nbacklog accepted clients wait for one. The threads are created up
+// front so that a connection does not wait for one to be created, and so
+// that a burst of connections cannot make the server run out of them.
+void start_client_threads(int nthreads, int nbacklog) {
+    backlog.size = nthreads + nbacklog;
+    backlog.ring = (client_t **)malloc(backlog.size * sizeof(client_t *));
+    if (backlog.ring == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    backlog.capacity = nbacklog;
+    backlog.idle = nthreads;  // counted as idle before they even start
 
-// Called by main thread to stop client threads
-void client_control_stop() {
-    // TODO: Ensure that the next time client threads call client_control_wait()
-    // at the top of the event loop in run_client, they will block.
-	pthread_mutex_lock (&(cct.go_mutex));
-	cct.stopped = 1;
-	pthread_cond_signal (&(cct.go));
-	pthread_mutex_unlock (&(cct.go_mutex));
-}
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t thread;
 
-// Called by main thread to resume client threads
-void client_control_release() {
-    // TODO: Allow clients that are blocked within client_control_wait()
-    // to continue. See the client_control_t struct.
-	pthread_mutex_lock (&(cct.go_mutex));
-	cct.stopped = 0;
-	pthread_cond_signal (&(cct.go));
-	pthread_mutex_unlock (&(cct.go_mutex));
+        int err1 = pthread_create(&thread, 0, client_thread, NULL);
+        if (err1 != 0) {
+            handle_error_en(err1, "pthread_create");
+        }
+
+        int err2 = pthread_detach(thread);
+        if (err2 != 0) {
+            handle_error_en(err2, "pthread_detach");
+        }
+    }
 }
 
-// Called by listener (in comm.c) to create a new client thread
-void client_constructor(FILE *cxstr) {
+// Called by listener (in comm.c) to hand a new client to a client thread
+void client_constructor(comm_conn_t *cxn) {
     // You should create a new client_t struct here and initialize ALL
     // of its fields. Remember that these initializations should be
     // error-checked.
@@ -121,30 +150,79 @@ void client_constructor(FILE *cxstr) {
     // to the input argument.
     client_t *new_client = (client_t *)malloc(sizeof(client_t));
     if (new_client == 0) {
+      comm_shutdown(cxn);
       return;
     }
 
-	new_client->cxstr = cxstr;
-    // Step 2: Create the new client thread running the run_client routine.
-    pthread_t thread;
+	new_client->cxn = cxn;
+    new_client->dropped = 0;
+
+    // Step 2: Queue it for the next free client thread, or turn it away if
+    // too many are waiting already.
+    pthread_mutex_lock(&backlog.mutex);
+    if (backlog.len >= backlog.idle + backlog.capacity) {
+        pthread_mutex_unlock(&backlog.mutex);
+        send(cxn->fd, server_busy, sizeof(server_busy) - 1,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+        comm_shutdown(cxn);
+        free(new_client);
+        stats_refused();
+        return;
+    }
+    backlog.ring[(backlog.head + backlog.len++) % backlog.size] = new_client;
+    pthread_cond_signal(&backlog.nonempty);
+    pthread_mutex_unlock(&backlog.mutex);
+}
 
-    int err1 = pthread_create(&thread, 0, run_client, new_client);
-    if (err1 != 0){
-        handle_error_en(err1, "pthread_create");
+// Code executed by the client threads: serve one client after the other
+void *client_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&backlog.mutex);
+    while (1) {
+        client_t *client;
+
+        while (backlog.len == 0) {
+            pthread_cond_wait(&backlog.nonempty, &backlog.mutex);
+        }
+        client = backlog.ring[backlog.head];
+        backlog.head = (backlog.head + 1) % backlog.size;
+        backlog.len--;
+        backlog.idle--;
+        pthread_mutex_unlock(&backlog.mutex);
+
+        run_client(client);
+
+        pthread_mutex_lock(&backlog.mutex);
+        backlog.idle++;
     }
+    return NULL;
+}
 
-    int err2 = pthread_detach(thread);
-    if (err2 != 0) {
-		handle_error_en(err2, "pthread_detach");
-	}
+// Called by reactor workers (in reactor.c) for every command received
+void serve_command(char *command, char *response, int len) {
+    gate_enter();
+    interpret_command(command, response, len);
+    gate_exit();
+}
 
+// Called by reactor workers for every binary request received
+int serve_frame(char *frame, char *reply) {
+    int len;
+
+    gate_enter();
+    len = interpret_frame(frame, reply);
+    gate_exit();
+    return len;
 }
 
 void client_destructor(client_t *client) {
     // TODO: Free all resources associated with a client.
     // Whatever was malloc'd in client_constructor should
     // be freed here!
+    comm_shutdown(client->cxn);
     free(client);
+    stats_connection(-1);
 
 	// decrease client threads.
 	pthread_mutex_lock (&(sct.server_mutex));
@@ -157,7 +235,7 @@ void client_destructor(client_t *client) {
 	pthread_mutex_unlock (&(sct.server_mutex));
 }
 
-// Code executed by a client thread
+// Code executed by a client thread for each client it serves
 void *run_client(void *arg) {
     // TODO:
     // Step 1: Make sure that the server is still accepting clients.
@@ -165,8 +243,7 @@ void *run_client(void *arg) {
     new_client->thread = pthread_self();
     
 	pthread_mutex_lock (&thread_list_mutex);
-    // Step 2: Add client to the client list and push thread_cleanup to remove
-    //       it if the thread is canceled.
+    // Step 2: Add client to the client list, where delete_all can find it.
 	new_client->thread = pthread_self();
     	if(thread_list_head == NULL) {
 		thread_list_head = new_client;
@@ -179,13 +256,12 @@ void *run_client(void *arg) {
 		new_client->prev = NULL;
 		thread_list_head = new_client;
 	}
-    pthread_cleanup_push(thread_cleanup, new_client);
-
 	pthread_mutex_unlock (&thread_list_mutex);
 	// Increase the number of client threads.
 	pthread_mutex_lock (&(sct.server_mutex));
 	sct.num_client_threads++;
 	pthread_mutex_unlock (&(sct.server_mutex));
+	stats_connection(1);
     // Step 3: Loop comm_serve (in comm.c) to receive commands and output
     //       responses. Note that the client may terminate the connection at
     //       any moment, in which case reading/writing to the connection stream
@@ -193,46 +269,78 @@ void *run_client(void *arg) {
     //       ensure that the server doesn't crash when this happens!
 	signal(SIGPIPE, SIG_IGN);
   
-    char response[1024];
-	char command[1024];
-  
+	char *request, *reply;
+	int reply_len = 0;  // nothing to answer before the first command
+	int kind;
+
 	while(1) {
-		client_control_wait();
-		if(comm_serve(new_client->cxstr, response, command) == 0) {
-			// got a command.
-			interpret_command(command, response, 1024);
+		kind = comm_serve(new_client->cxn, reply_len, &request, &reply);
+		if(kind < 0) {
+			break;
 		}
-		else {
+
+		// wait here while the server is stopped (see gate.h)
+		gate_enter();
+		if (__atomic_load_n(&new_client->dropped, __ATOMIC_RELAXED)) {
+			gate_exit();
 			break;
 		}
+		if(kind == COMM_TEXT) {
+			// got a command; it is answered straight into the
+			// connection's output buffer
+			interpret_command(request, reply, MAXRESP);
+			reply_len = strlen(reply);
+		}
+		else {
+			// got a binary request (see frame.h)
+			reply_len = interpret_frame(request, reply);
+		}
+		gate_exit();
 	}
-	return NULL;
 
-    // Step 4: When the client is done sending commands, exit the thread
-    //       cleanly.
-	client_destructor(new_client);
-    // Keep the signal handler thread in mind when writing this function!
-	pthread_cleanup_pop(1);
+    // Step 4: When the client is done sending commands, thread_cleanup
+    //       unlinks the client and destroys it, and the thread is free for
+    //       the next one.
+	thread_cleanup(new_client);
     return NULL;
 }
 
 void delete_all() {
-    // TODO: Cancel every thread in the client thread list with the
-    // pthread_cancel function.
+    // Client threads are not cancelled, since they serve the next clients
+    // afterwards: every client in the list is marked as dropped and its
+    // socket shut down, which wakes up a thread blocked on it, and the
+    // clients still waiting for a thread are closed.
 
 	pthread_mutex_lock (&thread_list_mutex);
   
 	client_t* client = thread_list_head;
   
 	while(client != NULL) {
-		pthread_cancel(client->thread);
+		__atomic_store_n(&client->dropped, 1, __ATOMIC_RELAXED);
+		shutdown(client->cxn->fd, SHUT_RDWR);
 		client = client->next;
 	}
   
 	pthread_mutex_unlock (&thread_list_mutex);
+
+    pthread_mutex_lock(&backlog.mutex);
+    while (backlog.len > 0) {
+        client = backlog.ring[backlog.head];
+        backlog.head = (backlog.head + 1) % backlog.size;
+        backlog.len--;
+        comm_shutdown(client->cxn);
+        free(client);
+    }
+    pthread_mutex_unlock(&backlog.mutex);
+
+	if (server_mode == MODE_EPOLL || server_mode == MODE_STEAL) {
+		reactor_drop_clients();
+	} else if (server_mode == MODE_URING) {
+		uring_drop_clients();
+	}
 }
 
-// Cleanup routine for client threads, called on cancels and exit.
+// Cleanup routine for client threads, called when a client is done.
 void thread_cleanup(void *arg) {
     // TODO: Remove the client object from thread list and call
     // client_destructor. This function must be thread safe! The client must
@@ -242,10 +350,11 @@ void thread_cleanup(void *arg) {
 	client_t* client = (client_t*)arg;
     if(client == thread_list_head) {
 		thread_list_head = client->next;
-		thread_list_head->prev = NULL;
 	}
 	else {
 		client->prev->next = client->next;
+	}
+	if(client->next != NULL) {
 		client->next->prev = client->prev;
 	}
     pthread_mutex_unlock (&thread_list_mutex);
@@ -306,14 +415,158 @@ void sig_handler_destructor(sig_handler_t *sighandler) {
     free(sighandler);
 }
 
-// The arguments to the server should be the port number.
+void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-e tree|hash] [-n shards] "
+            "[-m thread|epoll|steal|uring] [-l listeners] [-w workers] "
+            "[-q backlog] [-s snapshot] "
+            "[-j log [-c window-us]] <port>\n",
+            cmd);
+}
+
+// The arguments to the server should be the port number, optionally preceded
+// by the storage engine to use (-e, see db_engine.h) and the number of
+// shards to split the names over (-n, see db_shard.c), how connections are
+// served (-m), the number of threads accepting connections (-l, see
+// start_listener in comm.c) and, for epoll, the number of worker threads
+// (-w, defaults to one per CPU; with -m steal, the number of executors;
+// with -m uring, the number of io_uring threads, which accept connections
+// as well; with -m thread, the number of client threads, CLIENT_THREADS by
+// default, which -q more clients may wait for). With -s the database starts
+// out as the given snapshot (see snapshot.h), served while it is promoted
+// into the engine. With -j it is kept in a write-ahead log (see wal.h) that
+// is replayed at startup, after the snapshot; -c sets how many microseconds
+// a change may wait for others to share its sync.
 int main(int argc, char *argv[]) {
+    char *engine = NULL;
+    char *journal = NULL;
+    char *snapshot = NULL;
+    long commit_window = 0;
+    int nshards = 1;
+    int nlisteners = 1;
+    int nworkers = 0;  // the mode's default
+    int nbacklog = CLIENT_BACKLOG;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:e:j:l:m:n:q:s:w:")) != -1) {
+        switch (opt) {
+            case 'c':
+                if ((commit_window = atol(optarg)) < 0) {
+                    usage_error(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'e':
+                engine = optarg;
+                break;
+            case 'j':
+                journal = optarg;
+                break;
+            case 'l':
+                if ((nlisteners = atoi(optarg)) < 1) {
+                    usage_error(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "thread") == 0) {
+                    server_mode = MODE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    server_mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "steal") == 0) {
+                    server_mode = MODE_STEAL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    server_mode = MODE_URING;
+                } else {
+                    usage_error(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'n':
+                nshards = atoi(optarg);
+                if (nshards < 1 || nshards > MAXSHARDS) {
+                    usage_error(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'q':
+                if ((nbacklog = atoi(optarg)) < 1) {
+                    usage_error(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                snapshot = optarg;
+                break;
+            case 'w':
+                if ((nworkers = atoi(optarg)) < 1) {
+                    usage_error(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage_error(argv[0]);
+        return 1;
+    }
+    if (nworkers == 0) {
+        nworkers = server_mode == MODE_THREAD ? CLIENT_THREADS
+                                              : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    stats_init();
+    if (db_init(engine, nshards) < 0) {
+        fprintf(stderr, "%s: unknown storage engine '%s'\n", argv[0], engine);
+        return 1;
+    }
+
+    if (snapshot != NULL) {
+        if (db_restore(snapshot) < 0) {
+            perror(snapshot);
+            return 1;
+        }
+        fprintf(stderr, "serving %d entries from %s\n", db_count(), snapshot);
+    }
+
+    if (journal != NULL) {
+        if (db_journal(journal, commit_window) < 0) {
+            perror(journal);
+            return 1;
+        }
+        fprintf(stderr, "restored %d entries from %s\n", db_count(), journal);
+    }
+
     // TODO:
     // Step 1: Set up the signal handler.
     sig_handler_t *sighandler = sig_handler_constructor();
 
-    // Step 2: Start a listener thread for clients (see start_listener in comm.c).
-    pthread_t listener = start_listener(atoi(argv[1]),client_constructor);
+    // Step 2: Start the client threads and a listener thread for clients
+    // (see start_listener in comm.c),
+    // or the epoll reactor and its workers (see start_reactor in reactor.c),
+    // or the io_uring threads (see start_uring in uring.c), falling back to
+    // epoll if the kernel can't run them.
+    pthread_t listener;
+    if (server_mode == MODE_URING &&
+        start_uring(atoi(argv[optind]), nworkers, serve_command, serve_frame,
+                    &listener) < 0) {
+        perror("io_uring");
+        fprintf(stderr, "io_uring unavailable, serving with epoll\n");
+        server_mode = MODE_EPOLL;
+    }
+    if (server_mode == MODE_EPOLL || server_mode == MODE_STEAL) {
+        listener = start_reactor(atoi(argv[optind]), nlisteners, nworkers,
+                                 server_mode == MODE_STEAL, serve_command,
+                                 serve_frame);
+    } else if (server_mode == MODE_THREAD) {
+        start_client_threads(nworkers, nbacklog);
+        listener = start_listener(atoi(argv[optind]), nlisteners,
+                                  client_constructor);
+    }
 
     // Step 3: Loop for command line input and handle accordingly until EOF.
     while(1){
@@ -327,7 +580,7 @@ int main(int argc, char *argv[]) {
 			exit(1);
 		}
 		
-        size_t input = getline(&buffer, &bufsize, stdin);
+        ssize_t input = getline(&buffer, &bufsize, stdin);
 
         if (input == 0) {
                 return 0;
@@ -341,23 +594,28 @@ int main(int argc, char *argv[]) {
          else if (input > 0) {
             // char *cmd = (char*)buffer[0];
             char *cmd = (char*)buffer;
-            if(strncmp(cmd,"s", 1)==0){
-                client_control_stop();
+            if(strncmp(cmd,"stats",5)==0){
+                stats_print(stdout, db_count(), db_height());
+            }
+            else if(strncmp(cmd,"s", 1)==0){
+                gate_stop();
             }
             else if(strncmp(cmd,"g",1)==0){
-                client_control_release();
+                gate_go();
             }
-            else if(strncmp(cmd,"p",1)==0){
-                
-                if((strchr(cmd, 'p') + 1)!=NULL){
-                    cmd= strchr(cmd, 'p') + 1;
-                    C(cmd);
-                }
-                else{
-                    db_print(NULL);
+            else if(strncmp(cmd,"c",1)==0){
+                char path[1024];
+
+                if (sscanf(cmd + 1, "%1023s", path) != 1) {
+                    fprintf(stderr, "usage: c <snapshot file>\n");
+                } else if (db_checkpoint(path) < 0) {
+                    fprintf(stderr, "checkpoint: could not be started\n");
                 }
-                
-                
+            }
+            else if(strncmp(cmd,"p",1)==0){
+                // what follows the p names the file, if anything does
+                cmd[strcspn(cmd, "\n")] = '\0';
+                db_print(cmd + 1);
             }
         }
     }
@@ -0,0 +1,212 @@
+#include "./slab.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define BATCH 32              // objects moved to or from the depot at once
+#define CACHE_MAX (2 * BATCH)  // free objects a thread keeps per class
+
+static const size_t class_size[] = {32,  48,  64,  80,  96,  128, 160,
+                                    192, 256, 320, 384, 512, 640};
+#define NCLASSES (sizeof(class_size) / sizeof(class_size[0]))
+
+typedef struct free_obj {
+    struct free_obj *next;
+} free_obj_t;
+
+typedef struct class_cache {
+    free_obj_t *free;
+    int nfree;
+    char *bump;  // uncarved remainder of the current chunk
+    char *end;
+} class_cache_t;
+
+/* Per-thread state. Like epoch records, these are recycled rather than
+ * freed when their thread exits, together with any cached objects. */
+typedef struct slab_cache {
+    class_cache_t classes[NCLASSES];
+    slab_stats_t stats;  // only written by the owning thread
+    int in_use;
+    struct slab_cache *next;
+} slab_cache_t;
+
+typedef struct depot {
+    pthread_mutex_t mutex;
+    free_obj_t *free;
+    int nfree;
+} depot_t;
+
+static depot_t depots[NCLASSES];
+static pthread_once_t depots_once = PTHREAD_ONCE_INIT;
+
+static slab_cache_t *caches;  // all per-thread caches ever created
+static pthread_mutex_t caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t cache_key;
+static __thread slab_cache_t *self;
+
+static void slab_release(void *arg) {
+    slab_cache_t *cache = arg;
+
+    __atomic_store_n(&cache->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void slab_setup(void) {
+    for (size_t i = 0; i < NCLASSES; i++) {
+        pthread_mutex_init(&depots[i].mutex, 0);
+    }
+    if (pthread_key_create(&cache_key, slab_release) != 0) {
+        fprintf(stderr, "slab: pthread_key_create failed\n");
+        abort();
+    }
+}
+
+static slab_cache_t *slab_register(void) {
+    slab_cache_t *cache;
+
+    pthread_once(&depots_once, slab_setup);
+    pthread_mutex_lock(&caches_mutex);
+
+    for (cache = caches; cache != NULL; cache = cache->next) {
+        if (!__atomic_load_n(&cache->in_use, __ATOMIC_ACQUIRE)) break;
+    }
+
+    if (cache == NULL) {
+        if ((cache = (slab_cache_t *)calloc(1, sizeof(slab_cache_t))) ==
+            NULL) {
+            perror("slab: calloc");
+            abort();
+        }
+        cache->next = caches;
+        caches = cache;
+    }
+    cache->in_use = 1;
+
+    pthread_mutex_unlock(&caches_mutex);
+
+    pthread_setspecific(cache_key, cache);
+    self = cache;
+    return cache;
+}
+
+static int class_of(size_t size) {
+    for (size_t i = 0; i < NCLASSES; i++) {
+        if (size <= class_size[i]) return i;
+    }
+    return -1;
+}
+
+/* Moves up to BATCH objects from the depot into the thread's cache. */
+static void depot_take(depot_t *depot, class_cache_t *cc) {
+    pthread_mutex_lock(&depot->mutex);
+    while (depot->free != NULL && cc->nfree < BATCH) {
+        free_obj_t *obj = depot->free;
+        depot->free = obj->next;
+        depot->nfree--;
+        obj->next = cc->free;
+        cc->free = obj;
+        cc->nfree++;
+    }
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+/* Hands BATCH objects from the thread's cache back to the depot. */
+static void depot_give(depot_t *depot, class_cache_t *cc) {
+    free_obj_t *first = cc->free;
+    free_obj_t *last = first;
+
+    for (int i = 1; i < BATCH; i++) last = last->next;
+    cc->free = last->next;
+    cc->nfree -= BATCH;
+
+    pthread_mutex_lock(&depot->mutex);
+    last->next = depot->free;
+    depot->free = first;
+    depot->nfree += BATCH;
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+void *slab_alloc(size_t size) {
+    slab_cache_t *cache = self ? self : slab_register();
+    int c = class_of(size);
+    class_cache_t *cc;
+    void *obj;
+
+    cache->stats.allocs++;
+
+    if (c < 0) {
+        if ((obj = malloc(size)) != NULL) {
+            cache->stats.system_allocs++;
+            cache->stats.bytes_reserved += size;
+            cache->stats.bytes_in_use += size;
+        }
+        return obj;
+    }
+
+    cc = &cache->classes[c];
+    if (cc->free == NULL) depot_take(&depots[c], cc);
+
+    if (cc->free != NULL) {
+        obj = cc->free;
+        cc->free = cc->free->next;
+        cc->nfree--;
+    } else {
+        if (cc->bump == NULL || cc->bump + class_size[c] > cc->end) {
+            if ((cc->bump = (char *)malloc(CHUNK_SIZE)) == NULL) {
+                cc->end = NULL;
+                return NULL;
+            }
+            cc->end = cc->bump + CHUNK_SIZE;
+            cache->stats.system_allocs++;
+            cache->stats.bytes_reserved += CHUNK_SIZE;
+        }
+        obj = cc->bump;
+        cc->bump += class_size[c];
+    }
+
+    cache->stats.bytes_in_use += class_size[c];
+    return obj;
+}
+
+void slab_free(void *ptr, size_t size) {
+    slab_cache_t *cache = self ? self : slab_register();
+    int c = class_of(size);
+    class_cache_t *cc;
+    free_obj_t *obj = ptr;
+
+    if (ptr == NULL) return;
+
+    cache->stats.frees++;
+
+    if (c < 0) {
+        cache->stats.bytes_in_use -= size;
+        free(ptr);
+        return;
+    }
+
+    cc = &cache->classes[c];
+    obj->next = cc->free;
+    cc->free = obj;
+    if (++cc->nfree > CACHE_MAX) depot_give(&depots[c], cc);
+
+    // may wrap for a thread that mostly frees; the sum over threads is exact
+    cache->stats.bytes_in_use -= class_size[c];
+}
+
+/* Adds up the counters of every thread. The result is only approximate
+ * while other threads are allocating. */
+void slab_stats(slab_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&caches_mutex);
+    for (slab_cache_t *cache = caches; cache != NULL; cache = cache->next) {
+        stats->allocs += cache->stats.allocs;
+        stats->frees += cache->stats.frees;
+        stats->system_allocs += cache->stats.system_allocs;
+        stats->bytes_reserved += cache->stats.bytes_reserved;
+        stats->bytes_in_use += cache->stats.bytes_in_use;
+    }
+    pthread_mutex_unlock(&caches_mutex);
+}
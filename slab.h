@@ -0,0 +1,30 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+
+/*
+ * Size-class allocator for the small, short-lived blocks the storage
+ * engines create (a node and its strings, a hash entry). Each thread
+ * allocates from its own per-class free lists and carves fresh objects out
+ * of 64KB chunks, so the common case takes no lock; free lists that grow
+ * too long spill into a shared per-class depot that other threads refill
+ * from. Memory is never returned to the system.
+ *
+ * slab_free must be given the same size that was passed to slab_alloc.
+ * Requests larger than the largest class go straight to malloc.
+ */
+
+typedef struct slab_stats {
+    unsigned long allocs;          // slab_alloc calls
+    unsigned long frees;           // slab_free calls
+    unsigned long system_allocs;   // mallocs made by the allocator itself
+    unsigned long bytes_reserved;  // obtained from the system
+    unsigned long bytes_in_use;    // handed out and not yet freed
+} slab_stats_t;
+
+extern void *slab_alloc(size_t size);
+extern void slab_free(void *ptr, size_t size);
+extern void slab_stats(slab_stats_t *stats);
+
+#endif  // SLAB_H_
@@ -0,0 +1,165 @@
+#include "./snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Writes the n pairs, which are sorted by name, as a snapshot to path.
+ * Returns 0 on success, -1 (with errno set) on failure, in which case the
+ * file at path is left as it was. */
+int snapshot_write(const char *path, int n, char **names, char **values) {
+    snapshot_header_t header;
+    char tmp[4096], *dir;
+    uint64_t offset;
+    FILE *out;
+    int err = 0, dfd;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((out = fopen(tmp, "w")) == 0) return -1;
+    setvbuf(out, 0, _IOFBF, 1 << 20);
+
+    offset = sizeof(header) + (uint64_t)n * sizeof(uint64_t);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.count = n;
+    header.size = offset;
+    for (int i = 0; i < n; i++) {
+        header.size += strlen(names[i]) + strlen(values[i]) + 2;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+
+    for (int i = 0; i < n; i++) {
+        fwrite(&offset, sizeof(offset), 1, out);
+        offset += strlen(names[i]) + strlen(values[i]) + 2;
+    }
+    for (int i = 0; i < n; i++) {
+        fwrite(names[i], strlen(names[i]) + 1, 1, out);
+        fwrite(values[i], strlen(values[i]) + 1, 1, out);
+    }
+
+    if (fflush(out) != 0 || fsync(fileno(out)) < 0) err = errno;
+    if (fclose(out) != 0 && err == 0) err = errno;
+    if (err == 0 && rename(tmp, path) < 0) err = errno;
+    if (err != 0) {
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+
+    // make sure the new directory entry is on disk too
+    if ((dir = strdup(path)) != 0) {
+        if ((dfd = open(dirname(dir), O_RDONLY)) >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
+    }
+    return 0;
+}
+
+/* Checks the offsets and records of a mapped snapshot: every offset must
+ * lie inside the file, where the record before it ends (snapshot_write
+ * lays them out back to back), and start a name and a value that are both
+ * terminated inside the file, with the names in order. Returns 0, or -1 at
+ * the first one that is not. */
+static int snapshot_check(const char *map, size_t size, uint64_t count) {
+    const uint64_t *offsets =
+        (const uint64_t *)(map + sizeof(snapshot_header_t));
+    uint64_t next = sizeof(snapshot_header_t) + count * sizeof(uint64_t);
+    const char *prev = 0, *name, *end;
+
+    for (uint64_t i = 0; i < count; i++) {
+        if (offsets[i] != next || offsets[i] >= size) return -1;
+        name = map + offsets[i];
+        if ((end = memchr(name, '\0', size - offsets[i])) == 0 ||
+            end + 1 == map + size ||
+            (end = memchr(end + 1, '\0', map + size - (end + 1))) == 0)
+            return -1;
+        if (prev != 0 && strcmp(prev, name) >= 0) return -1;
+        prev = name;
+        next = end + 1 - map;
+    }
+    return next == size ? 0 : -1;
+}
+
+/* Maps the snapshot at path into memory and checks it (see snapshot_check)
+ * in one sequential pass, which also leaves it in the page cache for the
+ * lookups that follow. Returns 0 (with errno set) on failure, EINVAL if
+ * the file is not a well-formed snapshot. */
+snapshot_t *snapshot_open(const char *path) {
+    snapshot_header_t header;
+    snapshot_t *s;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return 0;
+    errno = 0;
+    if (fstat(fd, &st) < 0 ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header.size != (uint64_t)st.st_size ||
+        header.count > (header.size - sizeof(header)) / sizeof(uint64_t)) {
+        if (errno == 0) errno = EINVAL;  // not a snapshot
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    if (snapshot_check(map, st.st_size, header.count) < 0) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    if ((s = (snapshot_t *)malloc(sizeof(snapshot_t))) == 0) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    s->map = map;
+    s->size = st.st_size;
+    s->count = header.count;
+    s->offsets = (const uint64_t *)((char *)map + sizeof(header));
+    return s;
+}
+
+/* Returns the index of the first pair whose name is not below name (count
+ * if there is none). */
+long snapshot_lower_bound(const snapshot_t *s, const char *name) {
+    long lo = 0, hi = s->count;
+
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+
+        if (strcmp(snapshot_name(s, mid), name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Returns the index of the pair with the given name, or -1. */
+long snapshot_find(const snapshot_t *s, const char *name) {
+    long i = snapshot_lower_bound(s, name);
+
+    return i < s->count && strcmp(snapshot_name(s, i), name) == 0 ? i : -1;
+}
+
+void snapshot_close(snapshot_t *s) {
+    munmap((void *)s->map, s->size);
+    free(s);
+}
@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Snapshot files: every pair of the database as of one moment, sorted by
+ * name, laid out so that it can be searched where it lies once the file is
+ * mapped into memory:
+ *
+ *     header | offsets[count] | records
+ *
+ * offsets[i] is where the i-th record starts, from the start of the file,
+ * and a record is the name and the value, each NUL-terminated. Numbers are
+ * 64-bit, in host byte order. A snapshot is written to a temporary file
+ * that is synced and then renamed over the old one, so a file with the
+ * right name is always complete.
+ */
+
+#define SNAPSHOT_MAGIC "DBSNAP1"
+
+typedef struct snapshot_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t size;  // of the whole file
+} snapshot_header_t;
+
+typedef struct snapshot {
+    const char *map;
+    size_t size;
+    long count;
+    const uint64_t *offsets;
+} snapshot_t;
+
+#define snapshot_name(s, i) ((s)->map + (s)->offsets[i])
+
+static inline const char *snapshot_value(const snapshot_t *s, long i) {
+    const char *name = snapshot_name(s, i);
+
+    return name + strlen(name) + 1;
+}
+
+extern int snapshot_write(const char *path, int n, char **names,
+                          char **values);
+extern snapshot_t *snapshot_open(const char *path);
+extern long snapshot_lower_bound(const snapshot_t *s, const char *name);
+extern long snapshot_find(const snapshot_t *s, const char *name);
+extern void snapshot_close(snapshot_t *s);
+
+#endif  // SNAPSHOT_H_
@@ -0,0 +1,301 @@
+#include "./stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include "./slab.h"
+
+/*
+ * Durations are kept in stats_now() ticks. Values below 16 have a bucket
+ * each; above, every power of two is split into 8 buckets, a value with
+ * its highest bit at 3 + shift falling in bucket 8 * shift +
+ * (value >> shift). The last covers a few hours at a few GHz.
+ */
+#define SUB_BITS 3
+#define SUB (1 << SUB_BITS)
+#define SHIFTS 40
+#define NBUCKETS (SUB * (SHIFTS + 2))
+
+// Kinds of commands counted, by letter; anything else is "other"
+static const char verbs[] = "qadfmrp";
+static const char *const verb_names[] = {"q", "a", "d", "f",
+                                         "m", "r", "p", "other"};
+#define NVERBS 8
+
+typedef struct verb_stats {
+    uint64_t count;
+    uint64_t ticks;  // in all
+    uint64_t buckets[NBUCKETS];
+} verb_stats_t;
+
+/* Per-thread counters, only written by the owning thread. Recycled rather
+ * than freed when their thread exits, counts and all, so the totals never
+ * go down. */
+typedef struct stats_record {
+    verb_stats_t verbs[NVERBS];
+    uint64_t lock_waits;
+    uint64_t lock_wait_ticks;
+    int in_use;
+    struct stats_record *next;
+} stats_record_t;
+
+static stats_record_t *records;  // every record ever created
+static pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static __thread stats_record_t *self;
+
+static int connections;
+static uint64_t connections_total;
+static uint64_t connections_refused;
+
+// when the statistics were set up, for the uptime and to tell how long a
+// tick is
+static uint64_t started_ns;
+static uint64_t started_ticks;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Microseconds per stats_now() tick, measured over the uptime. */
+static double us_per_tick(void) {
+    uint64_t ticks = stats_now() - started_ticks;
+
+    return ticks > 0 ? (monotonic_ns() - started_ns) / 1e3 / ticks : 0;
+}
+
+static void stats_release(void *arg) {
+    stats_record_t *record = arg;
+
+    __atomic_store_n(&record->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_setup(void) {
+    if (pthread_key_create(&record_key, stats_release) != 0) {
+        fprintf(stderr, "stats: pthread_key_create failed\n");
+        abort();
+    }
+    started_ns = monotonic_ns();
+    started_ticks = stats_now();
+}
+
+void stats_init(void) {
+    pthread_once(&record_once, stats_setup);
+}
+
+static stats_record_t *stats_register(void) {
+    stats_record_t *record;
+
+    pthread_once(&record_once, stats_setup);
+    pthread_mutex_lock(&records_mutex);
+
+    for (record = records; record != NULL; record = record->next) {
+        if (!__atomic_load_n(&record->in_use, __ATOMIC_ACQUIRE)) break;
+    }
+
+    if (record == NULL) {
+        if ((record = (stats_record_t *)calloc(1, sizeof(stats_record_t))) ==
+            NULL) {
+            perror("stats: calloc");
+            abort();
+        }
+        record->next = records;
+        records = record;
+    }
+    record->in_use = 1;
+
+    pthread_mutex_unlock(&records_mutex);
+
+    pthread_setspecific(record_key, record);
+    self = record;
+    return record;
+}
+
+static int bucket_of(uint64_t ticks) {
+    int shift = ticks < 2 * SUB ? 0 : 63 - __builtin_clzll(ticks) - SUB_BITS;
+
+    if (shift > SHIFTS) return NBUCKETS - 1;
+    return SUB * shift + (int)(ticks >> shift);
+}
+
+/* The largest value that falls in bucket i. */
+static uint64_t bucket_value(int i) {
+    int shift = i < 2 * SUB ? 0 : i / SUB - 1;
+
+    return ((uint64_t)(i - SUB * shift + 1) << shift) - 1;
+}
+
+static int verb_of(int command) {
+    const char *verb = command != '\0' ? strchr(verbs, command) : NULL;
+
+    return verb != NULL ? verb - verbs : NVERBS - 1;
+}
+
+void stats_command(int command, uint64_t start) {
+    stats_record_t *record = self ? self : stats_register();
+    verb_stats_t *v = &record->verbs[verb_of(command)];
+    uint64_t ticks = stats_now() - start;
+
+    v->count++;
+    v->ticks += ticks;
+    v->buckets[bucket_of(ticks)]++;
+}
+
+void stats_lock_wait(uint64_t ticks) {
+    stats_record_t *record = self ? self : stats_register();
+
+    record->lock_waits++;
+    record->lock_wait_ticks += ticks;
+}
+
+void stats_connection(int delta) {
+    pthread_once(&record_once, stats_setup);
+    __atomic_add_fetch(&connections, delta, __ATOMIC_RELAXED);
+    if (delta > 0) __atomic_add_fetch(&connections_total, 1, __ATOMIC_RELAXED);
+}
+
+void stats_refused(void) {
+    __atomic_add_fetch(&connections_refused, 1, __ATOMIC_RELAXED);
+}
+
+void stats_mutex_wait(pthread_mutex_t *mutex) {
+    uint64_t start = stats_now();
+
+    pthread_mutex_lock(mutex);
+    stats_lock_wait(stats_now() - start);
+}
+
+void stats_rdlock_wait(pthread_rwlock_t *lock) {
+    uint64_t start = stats_now();
+
+    pthread_rwlock_rdlock(lock);
+    stats_lock_wait(stats_now() - start);
+}
+
+void stats_wrlock_wait(pthread_rwlock_t *lock) {
+    uint64_t start = stats_now();
+
+    pthread_rwlock_wrlock(lock);
+    stats_lock_wait(stats_now() - start);
+}
+
+// The totals over every thread's record
+typedef struct totals {
+    verb_stats_t verbs[NVERBS];
+    uint64_t lock_waits;
+    uint64_t lock_wait_ticks;
+} totals_t;
+
+static totals_t totals;  // too big for a reactor worker's stack
+static pthread_mutex_t totals_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Adds up every record into t. The caller holds totals_mutex. */
+static void add_up(totals_t *t) {
+    stats_record_t *record;
+
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_lock(&records_mutex);
+    for (record = records; record != NULL; record = record->next) {
+        for (int i = 0; i < NVERBS; i++) {
+            verb_stats_t *from = &record->verbs[i], *to = &t->verbs[i];
+
+            to->count += from->count;
+            to->ticks += from->ticks;
+            for (int b = 0; b < NBUCKETS; b++) {
+                to->buckets[b] += from->buckets[b];
+            }
+        }
+        t->lock_waits += record->lock_waits;
+        t->lock_wait_ticks += record->lock_wait_ticks;
+    }
+    pthread_mutex_unlock(&records_mutex);
+}
+
+/* The latency in ticks below which the given fraction of the commands
+ * counted in v took. */
+static uint64_t percentile(const verb_stats_t *v, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * v->count + 0.999999), seen = 0;
+
+    if (rank == 0) rank = 1;
+    for (int b = 0; b < NBUCKETS; b++) {
+        if ((seen += v->buckets[b]) >= rank) return bucket_value(b);
+    }
+    return bucket_value(NBUCKETS - 1);
+}
+
+int stats_format(char *buf, int len, int entries, int height) {
+    totals_t *t = &totals;
+    slab_stats_t slab;
+    double us;
+    int n;
+
+    pthread_once(&record_once, stats_setup);
+    slab_stats(&slab);
+    pthread_mutex_lock(&totals_mutex);
+    add_up(t);
+    us = us_per_tick();
+
+    n = snprintf(buf, len,
+                 "uptime_s %.0f\tconnections %d\tconnections_total %lu\t"
+                 "connections_refused %lu\tentries %d\theight %d\tslab_bytes_in_use %lu\t"
+                 "lock_waits %lu\tlock_wait_us %.0f",
+                 (monotonic_ns() - started_ns) / 1e9,
+                 __atomic_load_n(&connections, __ATOMIC_RELAXED),
+                 (unsigned long)connections_total,
+                 (unsigned long)connections_refused, entries, height,
+                 slab.bytes_in_use, (unsigned long)t->lock_waits,
+                 t->lock_wait_ticks * us);
+    for (int i = 0; i < NVERBS && n < len; i++) {
+        const verb_stats_t *v = &t->verbs[i];
+        const char *name = verb_names[i];
+
+        if (v->count == 0) continue;
+        n += snprintf(buf + n, len - n,
+                      "\t%s_count %lu\t%s_mean_us %.1f\t%s_p50_us %.1f"
+                      "\t%s_p99_us %.1f\t%s_p999_us %.1f",
+                      name, (unsigned long)v->count, name,
+                      v->ticks * us / v->count, name,
+                      percentile(v, 0.5) * us, name, percentile(v, 0.99) * us,
+                      name, percentile(v, 0.999) * us);
+    }
+
+    pthread_mutex_unlock(&totals_mutex);
+    return n < len ? n : len - 1;
+}
+
+void stats_print(FILE *out, int entries, int height) {
+    totals_t *t = &totals;
+    slab_stats_t slab;
+    double us;
+
+    pthread_once(&record_once, stats_setup);
+    slab_stats(&slab);
+    pthread_mutex_lock(&totals_mutex);
+    add_up(t);
+    us = us_per_tick();
+
+    fprintf(out,
+            "up %.0f s, %d clients connected (%lu in all, %lu turned away), "
+            "%d entries, height %d, %lu bytes of slab memory in use\n",
+            (monotonic_ns() - started_ns) / 1e9,
+            __atomic_load_n(&connections, __ATOMIC_RELAXED),
+            (unsigned long)connections_total,
+            (unsigned long)connections_refused, entries, height,
+            slab.bytes_in_use);
+    fprintf(out, "%lu waits for a lock, %.0f us in all\n",
+            (unsigned long)t->lock_waits, t->lock_wait_ticks * us);
+    fprintf(out, "%-7s %12s %10s %10s %10s %10s\n", "command", "count",
+            "mean us", "p50 us", "p99 us", "p999 us");
+    for (int i = 0; i < NVERBS; i++) {
+        const verb_stats_t *v = &t->verbs[i];
+
+        if (v->count == 0) continue;
+        fprintf(out, "%-7s %12lu %10.1f %10.1f %10.1f %10.1f\n", verb_names[i],
+                (unsigned long)v->count, v->ticks * us / v->count,
+                percentile(v, 0.5) * us, percentile(v, 0.99) * us,
+                percentile(v, 0.999) * us);
+    }
+
+    pthread_mutex_unlock(&totals_mutex);
+}
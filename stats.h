@@ -0,0 +1,75 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Server statistics: how many commands of each kind were run and how long
+ * they took, how long threads waited for the engines' locks, and how many
+ * clients are connected.
+ *
+ * Every thread counts into a record of its own (recycled, like the slab
+ * caches, when the thread exits), so counting takes no lock and shares no
+ * cache line; the totals are added up when asked for, and are only
+ * approximate while commands are running. Latencies go into log-linear
+ * histograms with 8 buckets per power of two (within 12.5%).
+ */
+
+/* A timestamp for timing a command or a wait: the time stamp counter
+ * where there is one, which takes a few nanoseconds to read where
+ * clock_gettime takes tens; the ticks are only turned into time when the
+ * totals are reported. Elsewhere, nanoseconds on the monotonic clock. */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline uint64_t stats_now(void) {
+    return __rdtsc();
+}
+#else
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* Starts the clock the uptime is counted from; call it at startup. */
+extern void stats_init(void);
+/* Counts a command (by its letter, see interpret_command) that started at
+ * the given stats_now() and has just been answered. */
+extern void stats_command(int command, uint64_t start);
+/* Counts a wait for a lock, as the difference of two stats_now(). */
+extern void stats_lock_wait(uint64_t ticks);
+/* Counts a client connecting (delta 1) or leaving (delta -1). */
+extern void stats_connection(int delta);
+/* Counts a client turned away because the server was too busy. */
+extern void stats_refused(void);
+
+extern void stats_mutex_wait(pthread_mutex_t *mutex);
+extern void stats_rdlock_wait(pthread_rwlock_t *lock);
+extern void stats_wrlock_wait(pthread_rwlock_t *lock);
+
+/* Take the lock, timing the wait only if it is not free right away. */
+static inline void stats_mutex_lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) != 0) stats_mutex_wait(mutex);
+}
+
+static inline void stats_rdlock(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_tryrdlock(lock) != 0) stats_rdlock_wait(lock);
+}
+
+static inline void stats_wrlock(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_trywrlock(lock) != 0) stats_wrlock_wait(lock);
+}
+
+/* Writes the totals as "name value" pairs, tab-separated, on one line
+ * (the answer to the stats command), given the database's entry count and
+ * height. Returns the length written. */
+extern int stats_format(char *buf, int len, int entries, int height);
+/* Prints the totals as a table, for the server's console. */
+extern void stats_print(FILE *out, int entries, int height);
+
+#endif  // STATS_H_
@@ -0,0 +1,660 @@
+#define _GNU_SOURCE
+#include "./uring.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./frame.h"
+#include "./stats.h"
+
+#define RING_ENTRIES 1024  // submission queue slots (twice that for results)
+#define NBUFS 1024         // receive buffers per ring, a power of two
+#define BUFSIZE 8192       // bytes per receive buffer, at most RBUFLEN - BUFLEN
+#define BGID 0             // the receive buffers' group
+#define WBUF_HIGH 65536    // stop reading while this much output is queued
+
+// What a completion is for, kept in the low bits of its user_data
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_CLOSE 3
+#define OP_MASK 3
+
+typedef struct ring {
+    int fd;
+    int lsock;
+    intptr_t index;
+
+    // the queues' mappings
+    char *map;
+    size_t map_size;
+    size_t sqes_size;
+
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;
+
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // receive buffers: the ring the kernel takes them from, and the memory
+    // (each buffer has a spare byte after it, see conn_execute)
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *bufs;
+} ring_t;
+
+typedef struct uconn {
+    int fd;
+    int mode;  // COMM_TEXT, COMM_FRAME or COMM_UNKNOWN, see comm.h
+    ring_t *ring;
+
+    int recv_armed;  // a receive is in flight
+    int sending;     // a send is in flight
+    int closing;     // no more input will be read
+    int closed;      // the close has been submitted
+
+    char *rbuf;  // the start of a command cut by a buffer's end, if any
+    size_t rlen;
+
+    char *out;  // replies gathered for the next send
+    size_t olen;
+    size_t ocap;
+    char *sbuf;  // replies being sent
+    size_t slen;
+    size_t soff;
+    size_t scap;
+
+    // For the list of all connections
+    struct uconn *prev;
+    struct uconn *next;
+} uconn_t;
+
+static int uring_port;
+static int uring_nrings;
+static command_handler_t handler;
+static frame_handler_t frame_handler;
+
+static uconn_t *conn_list_head;
+static pthread_mutex_t conn_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *ring_loop(void *arg);
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg,
+                                 unsigned n) {
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* Returns whether the ring supports every operation the server uses. */
+static int ring_has_ops(ring_t *r) {
+    static const int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV,
+                                 IORING_OP_SEND, IORING_OP_CLOSE};
+    struct io_uring_probe *probe;
+    int ok = 1;
+
+    probe = (struct io_uring_probe *)calloc(
+        1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) return 0;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op ||
+            !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    }
+    free(probe);
+    return ok;
+}
+
+/* Hands receive buffer bid (back) to the kernel. */
+static void buf_return(ring_t *r, unsigned short bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (NBUFS - 1)];
+
+    b->addr = (uintptr_t)(r->bufs + (size_t)bid * (BUFSIZE + 1));
+    b->len = BUFSIZE;
+    b->bid = bid;
+    __atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Undoes ring_init, as far as it got. */
+static void ring_fini(ring_t *r) {
+    if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (r->map != MAP_FAILED) munmap(r->map, r->map_size);
+    if (r->fd >= 0) close(r->fd);  // which unregisters the buffer ring
+    free(r->br);
+    free(r->bufs);
+}
+
+/* Sets up an io_uring instance and its receive buffers. Returns 0, or -1
+ * with errno set (ENOSYS if the kernel is too old), having undone what
+ * it did. */
+static int ring_init(ring_t *r) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t cq_size;
+    void *br;
+    int err;
+
+    r->bufs = NULL;
+    r->map = MAP_FAILED;
+    r->sqes = MAP_FAILED;
+    r->br = NULL;
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = sys_io_uring_setup(RING_ENTRIES, &p)) < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP) || !ring_has_ops(r)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    // one mapping holds both queues' indexes and the results
+    r->map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > r->map_size) r->map_size = cq_size;
+    r->map = mmap(0, r->map_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->map == MAP_FAILED) goto fail;
+    r->sq_head = (unsigned *)(r->map + p.sq_off.head);
+    r->sq_tail = (unsigned *)(r->map + p.sq_off.tail);
+    r->sq_array = (unsigned *)(r->map + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(r->map + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(r->map + p.cq_off.head);
+    r->cq_tail = (unsigned *)(r->map + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(r->map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(r->map + p.cq_off.cqes);
+    r->to_submit = 0;
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(0, r->sqes_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r->fd,
+                                          IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    if (posix_memalign(&br, sysconf(_SC_PAGESIZE),
+                       NBUFS * sizeof(struct io_uring_buf)) != 0) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    memset(br, 0, NBUFS * sizeof(struct io_uring_buf));
+    r->br = (struct io_uring_buf_ring *)br;
+    if ((r->bufs = (char *)malloc((size_t)NBUFS * (BUFSIZE + 1))) == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)br;
+    reg.ring_entries = NBUFS;
+    reg.bgid = BGID;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) <
+        0) {
+        if (errno == EINVAL) errno = ENOSYS;  // before 5.19
+        goto fail;
+    }
+    r->br_tail = 0;
+    for (int i = 0; i < NBUFS; i++) buf_return(r, i);
+    return 0;
+
+fail:
+    err = errno;
+    ring_fini(r);
+    errno = err;
+    return -1;
+}
+
+int start_uring(int port, int nrings, command_handler_t h,
+                frame_handler_t fh, pthread_t *first) {
+    ring_t *rings;
+    pthread_t tid;
+    int err;
+
+    if ((rings = (ring_t *)calloc(nrings, sizeof(ring_t))) == NULL) return -1;
+    for (int i = 0; i < nrings; i++) {
+        if (ring_init(&rings[i]) < 0) {
+            err = errno;
+            while (i-- > 0) ring_fini(&rings[i]);
+            free(rings);
+            errno = err;
+            return -1;
+        }
+        rings[i].index = i;
+    }
+
+    uring_port = port;
+    uring_nrings = nrings;
+    handler = h;
+    frame_handler = fh;
+
+    for (int i = 0; i < nrings; i++) {
+        if ((err = pthread_create(&tid, 0, ring_loop, &rings[i])))
+            handle_error_en(err, "pthread_create");
+        if ((err = pthread_detach(tid))) handle_error_en(err, "pthread_detach");
+        if (i == 0) *first = tid;
+    }
+    return 0;
+}
+
+/* Returns a cleared submission queue entry for the next request, which
+ * goes to the kernel at the next io_uring_enter. Nothing is read from the
+ * queue before then (there is no polling thread), so the entry can be
+ * filled in after its slot is published. If the queue is full, what is
+ * queued is handed over until the kernel has taken some of it; ring_loop
+ * keeps cq_head up to date, so the kernel has room for the completions. */
+static struct io_uring_sqe *ring_sqe(ring_t *r) {
+    unsigned tail = *r->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+           r->sq_entries) {
+        int n = sys_io_uring_enter(r->fd, r->to_submit, 0, 0);
+
+        if (n > 0) {
+            r->to_submit -= n;
+        } else if (n < 0 && errno != EINTR && errno != EAGAIN &&
+                   errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+
+    sqe = &r->sqes[tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+static void arm_accept(ring_t *r) {
+    struct io_uring_sqe *sqe = ring_sqe(r);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->lsock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void arm_recv(uconn_t *c) {
+    struct io_uring_sqe *sqe = ring_sqe(c->ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = BUFSIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->user_data = (uintptr_t)c | OP_RECV;
+    c->recv_armed = 1;
+}
+
+/* Sends the rest of sbuf; if link is set, the connection is closed as soon
+ * as the send completes. */
+static void submit_send(uconn_t *c, int link) {
+    struct io_uring_sqe *sqe = ring_sqe(c->ring);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)(c->sbuf + c->soff);
+    sqe->len = c->slen - c->soff;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;  // no short sends
+    sqe->user_data = (uintptr_t)c | OP_SEND;
+    if (link) sqe->flags = IOSQE_IO_LINK;
+    c->sending = 1;
+}
+
+static void conn_unlink(uconn_t *c) {
+    pthread_mutex_lock(&conn_list_mutex);
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        conn_list_head = c->next;
+    }
+    if (c->next != NULL) c->next->prev = c->prev;
+    pthread_mutex_unlock(&conn_list_mutex);
+}
+
+/* Queues the close of the connection's socket (after its last send, if
+ * that is linked to it). The connection leaves the list first: once the
+ * close completes, the fd number may belong to another connection or
+ * file, which uring_drop_clients must not shut down. */
+static void submit_close(uconn_t *c) {
+    struct io_uring_sqe *sqe;
+
+    conn_unlink(c);
+    sqe = ring_sqe(c->ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = c->fd;
+    sqe->user_data = (uintptr_t)c | OP_CLOSE;
+    c->closed = 1;
+}
+
+static void conn_constructor(ring_t *r, int fd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    uconn_t *c;
+
+    if ((c = (uconn_t *)calloc(1, sizeof(uconn_t))) == NULL) {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->mode = COMM_UNKNOWN;
+    c->ring = r;
+
+    pthread_mutex_lock(&conn_list_mutex);
+    c->next = conn_list_head;
+    if (conn_list_head != NULL) conn_list_head->prev = c;
+    conn_list_head = c;
+    pthread_mutex_unlock(&conn_list_mutex);
+    stats_connection(1);
+
+    if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) == 0) {
+        fprintf(stderr, "received connection from %s#%hu\n",
+                inet_ntoa(addr.sin_addr), addr.sin_port);
+    } else {
+        fprintf(stderr, "received connection\n");
+    }
+    arm_recv(c);
+}
+
+/* Frees a connection whose socket is closed (and which submit_close took
+ * off the list). */
+static void conn_destructor(uconn_t *c) {
+    stats_connection(-1);
+    free(c->rbuf);
+    free(c->out);
+    free(c->sbuf);
+    free(c);
+
+    fprintf(stderr, "client connection terminated\n");
+}
+
+/* Makes room for n more bytes of output. Returns where they go, or NULL
+ * if out of memory. */
+static char *conn_reserve(uconn_t *c, size_t n) {
+    if (c->olen + n > c->ocap) {
+        size_t cap = c->ocap ? c->ocap : RESPLEN;
+        char *out;
+
+        while (c->olen + n > cap) cap *= 2;
+        if ((out = (char *)realloc(c->out, cap)) == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        c->out = out;
+        c->ocap = cap;
+    }
+    return c->out + c->olen;
+}
+
+/* Executes every complete command in buf[0..len), where they lie (buf[len]
+ * must be writable), with the replies written straight into the output.
+ * If eof is set, a final line without a newline is executed too. Returns
+ * how many bytes were used up, or -1 if the connection has to be
+ * closed. */
+static ssize_t conn_execute(uconn_t *c, char *buf, size_t len, int eof) {
+    size_t start = 0;
+    ssize_t n;
+
+    if (c->mode == COMM_UNKNOWN && len > 0) {
+        if ((unsigned char)buf[0] == FRAME_MAGIC) {
+            c->mode = COMM_FRAME;
+            start = 1;
+        } else {
+            c->mode = COMM_TEXT;
+        }
+    }
+
+    if (c->mode == COMM_FRAME) {
+        while ((n = comm_frame_length(buf + start, len - start)) > 0) {
+            char *reply;
+
+            if ((reply = conn_reserve(c, FRAME_REPLY_MAX)) == NULL) return -1;
+            c->olen += frame_handler(buf + start, reply);
+            start += n;
+        }
+        if (n < 0) return -1;
+    } else if (c->mode == COMM_TEXT) {
+        while ((n = comm_line_length(buf + start, len - start, eof)) > 0) {
+            char *command = buf + start;
+            char *reply, saved;
+            size_t rlen;
+
+            if ((reply = conn_reserve(c, RESPLEN)) == NULL) return -1;
+
+            saved = command[n];
+            command[n] = '\0';
+            reply[0] = '\0';
+            handler(command, reply, RESPLEN);
+            command[n] = saved;
+            start += n;
+
+            if ((rlen = strlen(reply)) > 0) {
+                reply[rlen] = '\n';
+                c->olen += rlen + 1;
+            }
+        }
+    }
+
+    return start;
+}
+
+/* Executes the commands in n received bytes. As long as no command is cut
+ * in two, they are executed in the receive buffer itself; only the start
+ * of a cut command is kept in rbuf until the rest arrives. */
+static int conn_input(uconn_t *c, char *buf, size_t n, int eof) {
+    ssize_t used;
+
+    if (c->rlen == 0) {
+        if ((used = conn_execute(c, buf, n, eof)) < 0) return -1;
+        if ((size_t)used == n) return 0;
+        // RBUFLEN + 1 bytes, allocated the first time this happens
+        if (c->rbuf == NULL &&
+            (c->rbuf = (char *)malloc(RBUFLEN + 1)) == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(c->rbuf, buf + used, n - used);
+        c->rlen = n - used;
+        return 0;
+    }
+
+    // what is left of a command is shorter than BUFLEN, and BUFSIZE more
+    // bytes fit behind it
+    memcpy(c->rbuf + c->rlen, buf, n);
+    c->rlen += n;
+    if ((used = conn_execute(c, c->rbuf, c->rlen, eof)) < 0) return -1;
+    memmove(c->rbuf, c->rbuf + used, c->rlen - used);
+    c->rlen -= used;
+    return 0;
+}
+
+/* Moves a connection on after one of its requests completed: sends the
+ * replies gathered (once the last send is done), reads on while the
+ * output is not backed up, and closes it once it is done with. */
+static void conn_progress(uconn_t *c) {
+    if (c->closed) return;
+
+    if (c->closing) {
+        if (c->recv_armed) {
+            // wake the receive up, the socket can't be closed under it
+            shutdown(c->fd, SHUT_RDWR);
+        } else if (!c->sending) {
+            if (c->olen > 0) {
+                char *tmp = c->sbuf;
+                size_t cap = c->scap;
+
+                c->sbuf = c->out;
+                c->scap = c->ocap;
+                c->slen = c->olen;
+                c->soff = 0;
+                c->out = tmp;
+                c->ocap = cap;
+                c->olen = 0;
+                submit_send(c, 1);
+            }
+            submit_close(c);
+        }
+        return;
+    }
+
+    if (!c->sending && c->olen > 0) {
+        char *tmp = c->sbuf;
+        size_t cap = c->scap;
+
+        c->sbuf = c->out;
+        c->scap = c->ocap;
+        c->slen = c->olen;
+        c->soff = 0;
+        c->out = tmp;
+        c->ocap = cap;
+        c->olen = 0;
+        submit_send(c, 0);
+    }
+    if (!c->recv_armed && c->olen < WBUF_HIGH) arm_recv(c);
+}
+
+static void on_accept(ring_t *r, int res, unsigned flags) {
+    if (res >= 0) {
+        conn_constructor(r, res);
+    } else if (res != -EINTR && res != -ECONNABORTED) {
+        errno = -res;
+        perror("accept");
+    }
+    // the accept stops being multishot after an error
+    if (!(flags & IORING_CQE_F_MORE)) arm_accept(r);
+}
+
+static void on_recv(uconn_t *c, int res, unsigned flags) {
+    ring_t *r = c->ring;
+
+    c->recv_armed = 0;
+    if (res > 0) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = r->bufs + (size_t)bid * (BUFSIZE + 1);
+
+        if (!c->closing && conn_input(c, buf, res, 0) < 0) c->closing = 1;
+        buf_return(r, bid);
+    } else if (res == 0) {
+        // the client is done; answer what it sent and hang up
+        if (!c->closing && c->rlen > 0) conn_input(c, c->rbuf, 0, 1);
+        c->closing = 1;
+    } else if (res != -ENOBUFS && res != -EINTR) {
+        // (out of buffers just means trying again once some are back)
+        c->closing = 1;
+        c->olen = 0;
+    }
+    conn_progress(c);
+}
+
+static void on_send(uconn_t *c, int res) {
+    c->sending = 0;
+    if (res < 0) {
+        c->closing = 1;
+        c->olen = 0;
+    } else if ((c->soff += res) < c->slen && !c->closed) {
+        submit_send(c, 0);
+        return;
+    }
+    conn_progress(c);
+}
+
+static void on_close(uconn_t *c, int res) {
+    // a failed send cancels the close linked to it
+    if (res == -ECANCELED && close(c->fd) < 0) perror("close");
+    conn_destructor(c);
+}
+
+static void *ring_loop(void *arg) {
+    ring_t *r = arg;
+
+    if (uring_nrings > 1) comm_pin_to_cpu(r->index);
+    r->lsock = comm_bind(uring_port, uring_nrings > 1);
+    arm_accept(r);
+
+    while (1) {
+        unsigned head, tail;
+        int n;
+
+        // submit everything queued and wait for something to happen
+        n = sys_io_uring_enter(r->fd, r->to_submit, 1,
+                               IORING_ENTER_GETEVENTS);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("io_uring_enter");
+                exit(1);
+            }
+            continue;
+        }
+        r->to_submit -= n;
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+            uconn_t *c = (uconn_t *)(uintptr_t)(cqe.user_data & ~OP_MASK);
+
+            // the slot is free once copied: handling it may have to wait
+            // for the kernel (see ring_sqe), which needs room to complete
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+            switch (cqe.user_data & OP_MASK) {
+                case OP_ACCEPT:
+                    on_accept(r, cqe.res, cqe.flags);
+                    break;
+                case OP_RECV:
+                    on_recv(c, cqe.res, cqe.flags);
+                    break;
+                case OP_SEND:
+                    on_send(c, cqe.res);
+                    break;
+                case OP_CLOSE:
+                    on_close(c, cqe.res);
+                    break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Disconnects every client. Each socket is shut down rather than closed,
+ * so that its pending receive completes and its ring thread frees it. */
+void uring_drop_clients(void) {
+    pthread_mutex_lock(&conn_list_mutex);
+    for (uconn_t *c = conn_list_head; c != NULL; c = c->next) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn_list_mutex);
+}
@@ -0,0 +1,36 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <pthread.h>
+#include "./reactor.h"
+
+/*
+ * io_uring alternative to the epoll reactor. Each of a few ring threads
+ * owns an io_uring instance and a listening socket of its own (with
+ * SO_REUSEPORT if there are several), and serves every connection it
+ * accepts itself, start to finish:
+ *
+ * - one multishot accept keeps producing new connections;
+ * - receives pick a buffer from a ring of buffers registered with the
+ *   kernel, so an idle connection holds no receive buffer, and commands
+ *   are executed where they lie in it;
+ * - the replies gathered while a send is in flight go out in the next
+ *   one, and a connection's last send is linked to its close.
+ *
+ * A thread enters the kernel once per round, to submit everything it
+ * queued and wait for the next completions. Commands run on the ring
+ * thread, so a command that blocks (a stopped server, a log sync) holds
+ * up that thread's other connections; each connection's commands are
+ * still executed and answered strictly in order.
+ *
+ * Needs Linux 5.19 or later (buffer rings, multishot accept).
+ */
+
+/* Starts nrings ring threads serving the given port. Returns 0 and the
+ * first thread in *first, or -1 with errno set, having started nothing,
+ * if the kernel lacks the support needed. */
+extern int start_uring(int port, int nrings, command_handler_t handler,
+                       frame_handler_t frame_handler, pthread_t *first);
+extern void uring_drop_clients(void);
+
+#endif  // URING_H_
@@ -0,0 +1,373 @@
+#include "./wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "./db.h"
+#include "./db_engine.h"
+
+#define WAL_FLUSH (1 << 20)  // bytes that end a commit window early
+#define TRAILER_MAX 64
+
+typedef struct wal {
+    int fd;
+    int next_fd;  // the log to write from the next write on (see wal_rotate)
+    char *path;
+    long window_us;
+    pthread_mutex_t mutex;
+    pthread_cond_t pending;  // records arrived for the writer
+    pthread_cond_t synced;   // durable moved on
+    char *buf;               // records not yet handed to the writer
+    size_t len, cap;
+    uint64_t appended;  // bytes of records appended so far
+    uint64_t durable;   // bytes of records on disk (read atomically)
+} wal_t;
+
+static wal_t wal = {
+    -1, -1, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0,
+};
+
+// how far the log has to be on disk for this thread's changes to be
+static __thread uint64_t last_lsn;
+
+/* FNV-1a, eight bytes at a time */
+static uint64_t checksum(const char *p, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    uint64_t word;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    while (len-- > 0) {
+        h = (h ^ (unsigned char)*p++) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Returns the length of the part of the log that is made of complete,
+ * intact writes. */
+static size_t wal_valid_length(const char *map, size_t size) {
+    size_t valid = 0;
+    const char *p = map;
+    const char *end = map + size;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        char line[TRAILER_MAX];
+        unsigned long long sum;
+        size_t len;
+
+        if (eol == 0) break;
+        if (*p == 'c') {
+            if (eol - p >= TRAILER_MAX) break;
+            memcpy(line, p, eol - p);
+            line[eol - p] = '\0';
+            if (sscanf(line, "c %llx %zu", &sum, &len) != 2 ||
+                len != (size_t)(p - map) - valid ||
+                checksum(map + valid, len) != sum)
+                break;
+            valid = eol + 1 - map;
+        }
+        p = eol + 1;
+    }
+    return valid;
+}
+
+/* Cuts whatever a crash may have left half-written off the end of the log
+ * at path, creating it if there is none, so that it can be replayed.
+ * Returns 0 on success, -1 (with errno set) on failure. */
+int wal_recover(const char *path) {
+    struct stat st;
+    char *map;
+    size_t valid;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    valid = wal_valid_length(map, st.st_size);
+    munmap(map, st.st_size);
+
+    if (valid < (size_t)st.st_size) {
+        fprintf(stderr, "wal: dropping %zu bytes of unfinished writes\n",
+                (size_t)st.st_size - valid);
+        if (ftruncate(fd, valid) < 0 || fsync(fd) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static void write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("wal: write");
+            exit(1);  // whatever follows could not be made durable
+        }
+        for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--) {
+            n -= iov->iov_len;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/* The writer: takes whatever records have piled up, writes them with their
+ * trailer and syncs, over and over. */
+static void *wal_writer(void *arg) {
+    char *spare = 0;
+    size_t spare_cap = 0;
+
+    (void)arg;
+
+    pthread_mutex_lock(&wal.mutex);
+    for (;;) {
+        char trailer[TRAILER_MAX];
+        struct iovec iov[2];
+        struct timespec deadline;
+        uint64_t upto;
+        char *records;
+        size_t len, cap;
+        int old_fd = -1;
+
+        while (wal.len == 0) {
+            pthread_cond_wait(&wal.pending, &wal.mutex);
+        }
+
+        if (wal.window_us > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += wal.window_us % 1000000 * 1000;
+            deadline.tv_sec += wal.window_us / 1000000 +
+                               deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (wal.len < WAL_FLUSH &&
+                   pthread_cond_timedwait(&wal.pending, &wal.mutex,
+                                          &deadline) != ETIMEDOUT) {
+            }
+        }
+
+        // swap buffers, so appends carry on while we write
+        records = wal.buf;
+        len = wal.len;
+        cap = wal.cap;
+        upto = wal.appended;
+        wal.buf = spare;
+        wal.cap = spare_cap;
+        wal.len = 0;
+        spare = records;
+        spare_cap = cap;
+        if (wal.next_fd >= 0) {
+            // the old log has had its last write, and sync
+            old_fd = wal.fd;
+            wal.fd = wal.next_fd;
+            wal.next_fd = -1;
+        }
+        pthread_mutex_unlock(&wal.mutex);
+        if (old_fd >= 0) close(old_fd);
+
+        iov[0].iov_base = records;
+        iov[0].iov_len = len;
+        iov[1].iov_base = trailer;
+        iov[1].iov_len = snprintf(trailer, sizeof(trailer), "c %016llx %zu\n",
+                                  (unsigned long long)checksum(records, len),
+                                  len);
+        write_all(wal.fd, iov, 2);
+        if (fdatasync(wal.fd) < 0) {
+            perror("wal: fdatasync");
+            exit(1);
+        }
+
+        pthread_mutex_lock(&wal.mutex);
+        __atomic_store_n(&wal.durable, upto, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&wal.synced);
+    }
+    return 0;
+}
+
+/* Makes sure the directory entry for path is on disk. */
+static void sync_dir(const char *path) {
+    char *dir;
+    int dfd;
+
+    if ((dir = strdup(path)) != 0) {
+        if ((dfd = open(dirname(dir), O_RDONLY)) >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
+    }
+}
+
+/* Appends the log at path (see wal_recover) from now on, syncing at most
+ * window_us microseconds after a change is made; records reach it through
+ * wal_append. Returns 0 on success, -1
+ * (with errno set) on failure. */
+int wal_start(const char *path, long window_us) {
+    pthread_t writer;
+    int err;
+
+    if ((wal.path = strdup(path)) == 0 ||
+        (wal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+        return -1;
+    sync_dir(path);
+
+    wal.window_us = window_us;
+    if ((err = pthread_create(&writer, 0, wal_writer, 0)) != 0) {
+        errno = err;
+        return -1;
+    }
+    pthread_detach(writer);
+    return 0;
+}
+
+/* Writes old, the name the log at wal.path has once it is rotated out. */
+static int old_path(char *old, size_t len) {
+    if (snprintf(old, len, "%s" WAL_OLD_SUFFIX, wal.path) >= (int)len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/* Starts a new log for a checkpoint: the log so far is renamed to
+ * <path>.old, and every record appended from now on goes to a new one at
+ * path. Snapshots must be taken after this returns, so that the new log
+ * holds every change they miss (see wal.h). Does nothing if the log is
+ * not started, or if an earlier checkpoint's old log is still there; that
+ * one is dropped by the next wal_drop_old. Returns 0 on success, -1 (with
+ * errno set) on failure, in which case the log is left as it was. */
+int wal_rotate(void) {
+    char old[4096];
+    int fd, err;
+
+    if (wal.path == 0) return 0;
+    if (old_path(old, sizeof(old)) < 0) return -1;
+    if (access(old, F_OK) == 0) return 0;
+
+    if (rename(wal.path, old) < 0) return -1;
+    if ((fd = open(wal.path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        err = errno;
+        rename(old, wal.path);
+        errno = err;
+        return -1;
+    }
+    sync_dir(wal.path);
+
+    pthread_mutex_lock(&wal.mutex);
+    wal.next_fd = fd;
+    pthread_mutex_unlock(&wal.mutex);
+    return 0;
+}
+
+/* Removes the log wal_rotate renamed, once a snapshot that holds all of
+ * it is in place. */
+void wal_drop_old(void) {
+    char old[4096];
+
+    if (wal.path == 0 || old_path(old, sizeof(old)) < 0) return;
+    if (unlink(old) == 0) sync_dir(old);
+}
+
+/* Returns whether s holds whitespace (isspace in the C locale), which
+ * replaying splits fields at. */
+static int has_blank(const char *s) {
+    for (; *s != '\0'; s++) {
+        if (*s == ' ' || (*s >= '\t' && *s <= '\r')) return 1;
+    }
+    return 0;
+}
+
+/* Appends the command that redoes a change (a db_logger_t). A change to a
+ * name or value with whitespace in it is not logged: its record would
+ * replay as other changes. */
+void wal_append(int op, const char *name, const char *value) {
+    char record[3 * MAXLEN + 8];  // the longest is a replace
+    int len;
+
+    if (has_blank(name) || (op != LOAD_DELETE && has_blank(value))) {
+        fprintf(stderr, "wal: not logging a change to a name or value "
+                        "with whitespace in it\n");
+        return;
+    }
+
+    if (op == LOAD_ADD) {
+        len = snprintf(record, sizeof(record), "a %s %s\n", name, value);
+    } else if (op == LOAD_PUT) {
+        len = snprintf(record, sizeof(record), "d %s\na %s %s\n", name, name,
+                       value);
+    } else {
+        len = snprintf(record, sizeof(record), "d %s\n", name);
+    }
+
+    pthread_mutex_lock(&wal.mutex);
+
+    if (wal.len + len > wal.cap) {
+        size_t cap = wal.cap ? wal.cap * 2 : 65536;
+        char *buf;
+
+        while (cap < wal.len + len) cap *= 2;
+        if ((buf = (char *)realloc(wal.buf, cap)) == 0) {
+            perror("wal: realloc");
+            abort();
+        }
+        wal.buf = buf;
+        wal.cap = cap;
+    }
+    memcpy(wal.buf + wal.len, record, len);
+    wal.len += len;
+    wal.appended += len;
+    last_lsn = wal.appended;
+
+    // wake the writer for the first record, and again once a window is full
+    if (wal.len == (size_t)len || (wal.len >= WAL_FLUSH &&
+                                   wal.len - len < WAL_FLUSH))
+        pthread_cond_signal(&wal.pending);
+
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+static void unlock_mutex(void *arg) {
+    pthread_mutex_unlock(arg);
+}
+
+/* Returns once every change the calling thread has made is on disk. */
+void wal_wait(void) {
+    if (last_lsn <= __atomic_load_n(&wal.durable, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&wal.mutex);
+    pthread_cleanup_push(unlock_mutex, &wal.mutex);
+    while (wal.durable < last_lsn) {
+        pthread_cond_wait(&wal.synced, &wal.mutex);
+    }
+    pthread_cleanup_pop(1);
+}
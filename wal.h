@@ -0,0 +1,44 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+/*
+ * Write-ahead log. Every change the storage engine makes (see db_logger in
+ * db_engine.h) is appended to the log as the text command that redoes it,
+ * "a name value" or "d name" (a replaced value is both), so the log is a
+ * script that f could run. Names and values with whitespace in them,
+ * which would not read back as they were, are never logged; the protocols
+ * do not accept them.
+ *
+ * Records are appended to a buffer in memory. A writer thread writes the
+ * buffer out and fdatasyncs it, so a single sync covers every change made
+ * in the meantime by any thread (group commit). With a commit window it
+ * waits that long after the first record before writing, to gather more.
+ * A thread that made changes calls wal_wait before answering, which
+ * returns once they are on disk.
+ *
+ * Each write ends with a line "c <checksum> <length>" covering the records
+ * before it. On recovery the log is cut after the last write that checks
+ * out; a crash can only have torn writes that nobody was told about.
+ *
+ * The log only holds the changes made since the database was last a
+ * snapshot: the one the server was started from (promoting its pairs into
+ * the engine is not logged), or the last checkpoint. A snapshot and the
+ * log are therefore always used as a pair, the log replayed over the
+ * snapshot it started from. At a checkpoint, wal_rotate renames the log
+ * to <path>.old and starts a new one before the snapshot is taken, and
+ * wal_drop_old removes the old one once the snapshot is in place. Should
+ * the server stop in between, the old log is replayed before the new
+ * one; the two may overlap what the snapshot holds, which replaying
+ * leaves as it is.
+ */
+
+#define WAL_OLD_SUFFIX ".old"
+
+extern int wal_recover(const char *path);
+extern int wal_start(const char *path, long window_us);
+extern void wal_append(int op, const char *name, const char *value);
+extern void wal_wait(void);
+extern int wal_rotate(void);
+extern void wal_drop_old(void);
+
+#endif  // WAL_H_